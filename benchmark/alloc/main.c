@@ -0,0 +1,188 @@
+/* main.c  -  Memory allocation benchmark  -  Public Domain  -  2013 Mattias Jansson
+ *
+ * This library provides a cross-platform memory allocation library in C11 providing basic support data types and
+ * functions to write applications and games in a platform-independent fashion. The latest source code is
+ * always available at
+ *
+ * https://github.com/mjansson/memory_lib
+ *
+ * This library is built on top of the foundation library available at
+ *
+ * https://github.com/mjansson/foundation_lib
+ *
+ * This library is put in the public domain; you can redistribute it and/or modify it without any restrictions.
+ *
+ */
+
+#include <foundation/foundation.h>
+
+#include <memory/memory.h>
+#include <memory/rpmalloc.h>
+
+#include <stdio.h>
+
+//! Number of heaps measured in each mode
+#define BENCHMARK_ROUNDS 64
+
+//! Sizes and block counts of the request, a mix of small, medium and large blocks
+static const size_t benchmark_request_size[] = {16,  32,   48,   64,   96,    128,   256,
+                                               512, 1024, 2048, 4096, 16384, 65536, 262144};
+static const size_t benchmark_request_count[] = {512, 512, 256, 256, 128, 128, 64, 64, 32, 32, 16, 8, 4, 2};
+
+#define BENCHMARK_REQUEST_SIZES (sizeof(benchmark_request_size) / sizeof(benchmark_request_size[0]))
+
+typedef enum {
+	BENCHMARK_COLD = 0,
+	BENCHMARK_WARM,
+	BENCHMARK_WARM_PREFAULT,
+	BENCHMARK_MODE_COUNT
+} benchmark_mode_t;
+
+static const char* benchmark_mode_name[BENCHMARK_MODE_COUNT] = {"cold", "warm", "warm+prefault"};
+
+typedef struct {
+	tick_t warmup_time;
+	tick_t first_time;
+	tick_t second_time;
+	tick_t first_min;
+	tick_t first_max;
+} benchmark_result_t;
+
+static void* benchmark_block[4096];
+
+//! Serve one request from the heap, allocating and writing all blocks, then free them
+static tick_t
+benchmark_request(rpmalloc_heap_t* heap) {
+	size_t iblock = 0;
+	tick_t start = time_current();
+	for (size_t isize = 0; isize < BENCHMARK_REQUEST_SIZES; ++isize) {
+		for (size_t icount = 0; icount < benchmark_request_count[isize]; ++icount, ++iblock) {
+			benchmark_block[iblock] = rpmalloc_heap_alloc(heap, benchmark_request_size[isize]);
+			memset(benchmark_block[iblock], (int)iblock, benchmark_request_size[isize]);
+		}
+	}
+	tick_t elapsed = time_diff(start, time_current());
+	while (iblock)
+		rpmalloc_heap_free(heap, benchmark_block[--iblock]);
+	return elapsed;
+}
+
+static void
+benchmark_run(benchmark_mode_t mode, benchmark_result_t* result) {
+	memset(result, 0, sizeof(benchmark_result_t));
+	result->first_min = (tick_t)-1;
+	for (int iround = 0; iround < BENCHMARK_ROUNDS; ++iround) {
+		rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+		if (mode != BENCHMARK_COLD) {
+			unsigned int flags = (mode == BENCHMARK_WARM_PREFAULT) ? RPMALLOC_WARMUP_PREFAULT : 0;
+			tick_t start = time_current();
+			rpmalloc_heap_warmup(heap, benchmark_request_size, benchmark_request_count, BENCHMARK_REQUEST_SIZES,
+			                     flags);
+			result->warmup_time += time_diff(start, time_current());
+		}
+		tick_t first = benchmark_request(heap);
+		result->first_time += first;
+		result->second_time += benchmark_request(heap);
+		if (first < result->first_min)
+			result->first_min = first;
+		if (first > result->first_max)
+			result->first_max = first;
+		rpmalloc_heap_free_all(heap);
+		rpmalloc_heap_release(heap);
+	}
+	result->warmup_time /= BENCHMARK_ROUNDS;
+	result->first_time /= BENCHMARK_ROUNDS;
+	result->second_time /= BENCHMARK_ROUNDS;
+}
+
+static double
+benchmark_microseconds(tick_t ticks) {
+	return (double)time_ticks_to_seconds(ticks) * 1000000.0;
+}
+
+//! Print the bytes lost to size class rounding by the benchmark requests, per size class used
+static void
+benchmark_print_fragmentation(void) {
+	rpmalloc_fragmentation_t report;
+	rpmalloc_fragmentation(&report);
+	size_t alloc_total = report.huge_alloc_total;
+	for (size_t iclass = 0; iclass < sizeof(report.size_class) / sizeof(report.size_class[0]); ++iclass)
+		alloc_total += report.size_class[iclass].alloc_total;
+	if (!alloc_total) {
+		printf("\nSize class rounding is only accounted when built with ENABLE_STATISTICS=1\n");
+		return;
+	}
+
+	size_t requested = report.huge_requested_total;
+	size_t allocated = report.huge_allocated_total;
+	printf("\n%-5s %12s %12s %14s %12s %9s\n", "Class", "Block size", "Allocations", "Requested KiB", "Wasted KiB",
+	       "Wasted %");
+	for (size_t iclass = 0; iclass < sizeof(report.size_class) / sizeof(report.size_class[0]); ++iclass) {
+		if (!report.size_class[iclass].alloc_total)
+			continue;
+		size_t class_requested = report.size_class[iclass].requested_total;
+		size_t class_allocated = report.size_class[iclass].alloc_total * report.size_class[iclass].block_size;
+		requested += class_requested;
+		allocated += class_allocated;
+		printf("%-5u %12u %12u %14.1f %12.1f %9.1f\n", (unsigned int)iclass,
+		       (unsigned int)report.size_class[iclass].block_size, (unsigned int)report.size_class[iclass].alloc_total,
+		       (double)class_requested / 1024.0, (double)(class_allocated - class_requested) / 1024.0,
+		       100.0 * (double)(class_allocated - class_requested) / (double)class_allocated);
+	}
+	printf("Wasted to size class rounding: %.1f KiB of %.1f KiB allocated (%.1f%%)\n",
+	       (double)(allocated - requested) / 1024.0, (double)allocated / 1024.0,
+	       100.0 * (double)(allocated - requested) / (double)allocated);
+}
+
+int
+main_initialize(void) {
+	foundation_config_t config;
+	application_t application;
+
+	memset(&config, 0, sizeof(config));
+
+	memset(&application, 0, sizeof(application));
+	application.name = string_const(STRING_CONST("Memory allocation benchmark"));
+	application.short_name = string_const(STRING_CONST("benchmark_alloc"));
+	application.company = string_const(STRING_CONST(""));
+	application.version = foundation_version();
+	application.flags = APPLICATION_UTILITY;
+
+	log_set_suppress(0, ERRORLEVEL_DEBUG);
+
+	return foundation_initialize(memory_system_malloc(), application, config);
+}
+
+int
+main_run(void* main_arg) {
+	benchmark_result_t result[BENCHMARK_MODE_COUNT];
+	FOUNDATION_UNUSED(main_arg);
+
+	rpmalloc_initialize(0);
+
+	// Discard one round of each mode to settle the process and the global span cache
+	for (int imode = 0; imode < BENCHMARK_MODE_COUNT; ++imode)
+		benchmark_run((benchmark_mode_t)imode, result + imode);
+	for (int imode = 0; imode < BENCHMARK_MODE_COUNT; ++imode)
+		benchmark_run((benchmark_mode_t)imode, result + imode);
+
+	printf("%-14s %12s %12s %12s %12s %12s\n", "Mode", "Warmup us", "First us", "First min", "First max",
+	       "Second us");
+	for (int imode = 0; imode < BENCHMARK_MODE_COUNT; ++imode) {
+		printf("%-14s %12.1f %12.1f %12.1f %12.1f %12.1f\n", benchmark_mode_name[imode],
+		       benchmark_microseconds(result[imode].warmup_time), benchmark_microseconds(result[imode].first_time),
+		       benchmark_microseconds(result[imode].first_min), benchmark_microseconds(result[imode].first_max),
+		       benchmark_microseconds(result[imode].second_time));
+	}
+
+	benchmark_print_fragmentation();
+
+	rpmalloc_finalize();
+
+	return 0;
+}
+
+void
+main_finalize(void) {
+	foundation_finalize();
+}
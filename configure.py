@@ -19,13 +19,21 @@ extrasources = []
 
 memory_sources = ['memory.c', 'rpmalloc.c', 'version.c']
 
-memory_lib = generator.lib(module = 'memory', sources = memory_sources + extrasources)
+memory_variables = {'defines': ['RPMALLOC_FIRST_CLASS_HEAPS=1']}
+
+memory_lib = generator.lib(module = 'memory', sources = memory_sources + extrasources, variables = memory_variables)
 
 #if not target.is_ios() and not target.is_android() and not target.is_tizen():
 #  configs = [config for config in toolchain.configs if config not in ['profile', 'deploy']]
 #  if not configs == []:
 #    generator.bin('bin2hex', ['main.c'], 'bin2hex', basepath = 'tools', implicit_deps = [foundation_lib], libs = ['foundation'], configs = configs)
 
+if not target.is_ios() and not target.is_android() and not target.is_tizen():
+  benchmark_includepaths = generator.test_includepaths()
+  generator.bin(module = 'alloc', sources = ['main.c'], binname = 'benchmark-alloc', basepath = 'benchmark', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = benchmark_includepaths, variables = memory_variables)
+  if not target.is_windows():
+    generator.bin(module = 'memstat', sources = ['main.c'], binname = 'memory-stat', basepath = 'tools', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = benchmark_includepaths, variables = memory_variables)
+
 if generator.skip_tests():
   sys.exit()
 
@@ -60,14 +68,14 @@ if toolchain.is_monolithic() or target.is_ios() or target.is_android() or target
   sources = [os.path.join(module, 'main.c') for module in test_cases] + test_extrasources
   dependlibs = ['test'] + dependlibs
   if target.is_ios() or target.is_android() or target.is_tizen():
-    generator.app(module = '', sources = sources, binname = 'test-memory', basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, resources = test_resources, includepaths = includepaths)
+    generator.app(module = '', sources = sources, binname = 'test-memory', basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, resources = test_resources, includepaths = includepaths, variables = memory_variables)
   else:
-    generator.bin(module = '', sources = sources, binname = 'test-memory', basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = includepaths)
+    generator.bin(module = '', sources = sources, binname = 'test-memory', basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = includepaths, variables = memory_variables)
 else:
   sources = ['main.c']
   #Build one binary per test case
   if not generator.is_subninja:
-    generator.bin(module = 'all', sources = sources, binname = 'test-all', basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = includepaths)
+    generator.bin(module = 'all', sources = sources, binname = 'test-all', basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = includepaths, variables = memory_variables)
   dependlibs = ['test'] + dependlibs
   for test in test_cases:
-    generator.bin(module = test, sources = sources, binname = 'test-' + test, basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = includepaths)
+    generator.bin(module = test, sources = sources, binname = 'test-' + test, basepath = 'test', implicit_deps = [memory_lib], libs = dependlibs, dependlibs = dependlibs, includepaths = includepaths, variables = memory_variables)
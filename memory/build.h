@@ -20,3 +20,11 @@
     Build setup */
 
 #include <foundation/platform.h>
+
+/*! \def BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+Set to 1 to enable per-context memory statistics in the memory system returned by
+memory_system_context_heaps. Counters are updated by the allocating thread and
+aggregated on demand, deallocations from other threads use one atomic operation per counter */
+#ifndef BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+#define BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS 1
+#endif
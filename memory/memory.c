@@ -19,6 +19,16 @@
 #include "memory.h"
 #include "rpmalloc.h"
 
+#if FOUNDATION_ARCH_X86 || FOUNDATION_ARCH_X86_64
+#if FOUNDATION_COMPILER_MSVC
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#elif FOUNDATION_COMPILER_MSVC
+#include <intrin.h>
+#endif
+
 #if FOUNDATION_COMPILER_CLANG
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wcast-qual"
@@ -53,10 +63,10 @@ memory_rpmalloc_allocate(hash_t context, size_t size, unsigned int align, unsign
 static void*
 memory_rpmalloc_reallocate(void* p, size_t size, unsigned int align, size_t oldsize, unsigned int hint) {
 	FOUNDATION_ASSERT(!p || oldsize);
-	void* block = rpaligned_realloc(p, align, size, oldsize, (hint & MEMORY_NO_PRESERVE) ? RPMALLOC_NO_PRESERVE : 0);
-	if ((hint & MEMORY_ZERO_INITIALIZED) && block && (size > oldsize))
-		memset(pointer_offset(block, oldsize), 0, (size - oldsize));
-	return block;
+	unsigned int flags = (hint & MEMORY_NO_PRESERVE) ? RPMALLOC_NO_PRESERVE : 0;
+	if (hint & MEMORY_ZERO_INITIALIZED)
+		flags |= RPMALLOC_ZERO_INIT;
+	return rpaligned_realloc(p, align, size, oldsize, flags);
 }
 
 static size_t
@@ -79,6 +89,569 @@ memory_rpmalloc_thread_finalize(void) {
 	rpmalloc_thread_finalize();
 }
 
+static void
+memory_lock_acquire(atomic32_t* lock) {
+	while (!atomic_cas32(lock, 1, 0, memorder_acquire, memorder_relaxed))
+		thread_yield();
+}
+
+static void
+memory_lock_release(atomic32_t* lock) {
+	atomic_store32(lock, 0, memorder_release);
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Maximum number of context heaps per thread, must be a power of two
+#define MEMORY_CONTEXT_HEAP_COUNT 64
+
+typedef struct memory_context_heap_t memory_context_heap_t;
+typedef struct memory_context_thread_t memory_context_thread_t;
+
+//! Heap for allocations in a single context, owned by a single thread
+struct memory_context_heap_t {
+	//! Context
+	hash_t context;
+	//! Heap
+	rpmalloc_heap_t* heap;
+	//! Owning thread ID, zero if orphaned
+	uint64_t owner_thread;
+	//! Next heap in orphan list
+	memory_context_heap_t* next;
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+	//! Next heap in list of all context heaps
+	memory_context_heap_t* next_heap;
+	//! Counters of the owning thread
+	memory_context_thread_t* owner;
+	//! Total number of allocations, only updated by owning thread
+	atomic64_t allocations;
+	//! Total number of allocated bytes, only updated by owning thread
+	atomic64_t allocated;
+	//! Total number of deallocations by owning thread, only updated by owning thread
+	atomic64_t deallocations;
+	//! Total number of bytes deallocated by owning thread, only updated by owning thread
+	atomic64_t deallocated;
+	//! Total number of deallocations by other threads
+	atomic64_t remote_deallocations;
+	//! Total number of bytes deallocated by other threads
+	atomic64_t remote_deallocated;
+	//! Total number of allocations at last statistics dump
+	int64_t allocations_dump;
+#endif
+};
+
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+//! Counters of a single thread for blocks not in a context heap, only updated by the owning thread
+struct memory_context_thread_t {
+	//! Total number of allocations
+	atomic64_t allocations;
+	//! Total number of allocated bytes
+	atomic64_t allocated;
+	//! Total number of deallocations
+	atomic64_t deallocations;
+	//! Total number of deallocated bytes
+	atomic64_t deallocated;
+	//! Next counters in list of all thread counters
+	memory_context_thread_t* next;
+	//! Next counters in list of counters released by finalized threads
+	memory_context_thread_t* next_free;
+};
+#endif
+
+FOUNDATION_DECLARE_THREAD_LOCAL_ARRAY(memory_context_heap_t*, context_heap, MEMORY_CONTEXT_HEAP_COUNT)
+
+//! Context heaps from finalized threads, adopted by the next thread allocating in the same context
+static memory_context_heap_t* memory_context_heap_orphan;
+//! Lock for orphan list
+static atomic32_t memory_context_heap_lock;
+
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+FOUNDATION_DECLARE_THREAD_LOCAL(memory_context_thread_t*, context_thread, 0)
+
+//! List of all context heaps
+static atomicptr_t memory_context_heap_list;
+//! List of all thread counters
+static atomicptr_t memory_context_thread_list;
+//! Thread counters released by finalized threads, reused by the next thread
+static memory_context_thread_t* memory_context_thread_free;
+//! Total number of allocations not in a context heap at last statistics dump
+static int64_t memory_context_untracked_dump;
+//! Timestamp of last statistics dump
+static tick_t memory_context_statistics_dump_time;
+
+static memory_context_thread_t*
+memory_context_thread_acquire(void) {
+	memory_context_thread_t* thread = get_thread_context_thread();
+	if (thread)
+		return thread;
+	memory_lock_acquire(&memory_context_heap_lock);
+	thread = memory_context_thread_free;
+	if (thread)
+		memory_context_thread_free = thread->next_free;
+	memory_lock_release(&memory_context_heap_lock);
+	if (!thread) {
+		thread = rpzalloc(sizeof(memory_context_thread_t));
+		if (!thread)
+			return 0;
+		memory_lock_acquire(&memory_context_heap_lock);
+		thread->next = atomic_load_ptr(&memory_context_thread_list, memorder_relaxed);
+		atomic_store_ptr(&memory_context_thread_list, thread, memorder_release);
+		memory_lock_release(&memory_context_heap_lock);
+	}
+	set_thread_context_thread(thread);
+	return thread;
+}
+
+static void
+memory_context_thread_release(void) {
+	// Keep the counters of finalized threads, the next thread continues counting in the same counters
+	memory_context_thread_t* thread = get_thread_context_thread();
+	if (thread) {
+		set_thread_context_thread(0);
+		memory_lock_acquire(&memory_context_heap_lock);
+		thread->next_free = memory_context_thread_free;
+		memory_context_thread_free = thread;
+		memory_lock_release(&memory_context_heap_lock);
+	}
+}
+#endif
+
+static memory_context_heap_t*
+memory_context_heap_acquire(hash_t context) {
+	memory_context_heap_t* context_heap = 0;
+	memory_lock_acquire(&memory_context_heap_lock);
+	memory_context_heap_t** link = &memory_context_heap_orphan;
+	while (*link) {
+		if ((*link)->context == context) {
+			context_heap = *link;
+			*link = context_heap->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	memory_lock_release(&memory_context_heap_lock);
+
+	if (context_heap) {
+		rpmalloc_heap_thread_adopt(context_heap->heap);
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+		context_heap->owner = memory_context_thread_acquire();
+#endif
+	} else {
+		context_heap = rpzalloc(sizeof(memory_context_heap_t));
+		if (!context_heap)
+			return 0;
+		context_heap->context = context;
+		context_heap->heap = rpmalloc_heap_acquire_thread();
+		rpmalloc_heap_set_user_data(context_heap->heap, context_heap);
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+		context_heap->owner = memory_context_thread_acquire();
+		memory_lock_acquire(&memory_context_heap_lock);
+		context_heap->next_heap = atomic_load_ptr(&memory_context_heap_list, memorder_relaxed);
+		atomic_store_ptr(&memory_context_heap_list, context_heap, memorder_release);
+		memory_lock_release(&memory_context_heap_lock);
+#endif
+	}
+	context_heap->owner_thread = thread_id();
+	context_heap->next = 0;
+	return context_heap;
+}
+
+//! Find or acquire the calling thread heap for the given context, null if table is full
+static memory_context_heap_t*
+memory_context_heap_find(hash_t context) {
+	memory_context_heap_t** table = get_thread_context_heap();
+	size_t islot = (size_t)context & (MEMORY_CONTEXT_HEAP_COUNT - 1);
+	for (size_t iprobe = 0; iprobe < MEMORY_CONTEXT_HEAP_COUNT; ++iprobe) {
+		memory_context_heap_t* context_heap = table[islot];
+		if (!context_heap)
+			return (table[islot] = memory_context_heap_acquire(context));
+		if (context_heap->context == context)
+			return context_heap;
+		islot = (islot + 1) & (MEMORY_CONTEXT_HEAP_COUNT - 1);
+	}
+	return 0;
+}
+
+//! Check if the given heap is a context heap owned by the calling thread
+static bool
+memory_context_heap_is_thread_owned(rpmalloc_heap_t* heap) {
+	memory_context_heap_t* context_heap = rpmalloc_heap_user_data(heap);
+	return context_heap && (context_heap->owner_thread == thread_id());
+}
+
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+
+static FOUNDATION_FORCEINLINE void
+memory_context_statistics_add_owned(atomic64_t* counter, int64_t value) {
+	// Only the owning thread updates the counter, no need for atomic increments
+	atomic_store64(counter, atomic_load64(counter, memorder_relaxed) + value, memorder_relaxed);
+}
+
+static void
+memory_context_statistics_allocate(memory_context_heap_t* context_heap, void* block) {
+	int64_t size = (int64_t)rpmalloc_usable_size(block);
+	if (context_heap) {
+		memory_context_statistics_add_owned(&context_heap->allocations, 1);
+		memory_context_statistics_add_owned(&context_heap->allocated, size);
+	} else {
+		memory_context_thread_t* thread = memory_context_thread_acquire();
+		if (!thread)
+			return;
+		memory_context_statistics_add_owned(&thread->allocations, 1);
+		memory_context_statistics_add_owned(&thread->allocated, size);
+	}
+}
+
+static void
+memory_context_statistics_deallocate(memory_context_heap_t* context_heap, size_t size) {
+	memory_context_thread_t* thread = memory_context_thread_acquire();
+	if (!context_heap) {
+		if (!thread)
+			return;
+		memory_context_statistics_add_owned(&thread->deallocations, 1);
+		memory_context_statistics_add_owned(&thread->deallocated, (int64_t)size);
+	} else if (thread && (context_heap->owner == thread)) {
+		memory_context_statistics_add_owned(&context_heap->deallocations, 1);
+		memory_context_statistics_add_owned(&context_heap->deallocated, (int64_t)size);
+	} else {
+		// Blocks freed by other threads already take the deferred deallocation path in the allocator
+		atomic_add64(&context_heap->remote_deallocations, 1, memorder_relaxed);
+		atomic_add64(&context_heap->remote_deallocated, (int64_t)size, memorder_relaxed);
+	}
+}
+
+#else
+
+static FOUNDATION_FORCEINLINE void
+memory_context_statistics_allocate(memory_context_heap_t* context_heap, void* block) {
+	FOUNDATION_UNUSED(context_heap);
+	FOUNDATION_UNUSED(block);
+}
+
+static FOUNDATION_FORCEINLINE void
+memory_context_statistics_deallocate(memory_context_heap_t* context_heap, size_t size) {
+	FOUNDATION_UNUSED(context_heap);
+	FOUNDATION_UNUSED(size);
+}
+
+#endif
+
+static void*
+memory_rpmalloc_allocate_context(hash_t context, size_t size, unsigned int align, unsigned int hint) {
+	memory_context_heap_t* context_heap = context ? memory_context_heap_find(context) : 0;
+	void* block;
+	if (!context_heap)
+		block = memory_rpmalloc_allocate(context, size, align, hint);
+	else if (!(hint & MEMORY_ZERO_INITIALIZED))
+		block = rpmalloc_heap_aligned_alloc(context_heap->heap, align, size);
+	else
+		block = rpmalloc_heap_aligned_calloc(context_heap->heap, align, 1, size);
+	if (block)
+		memory_context_statistics_allocate(context_heap, block);
+	return block;
+}
+
+static void*
+memory_rpmalloc_reallocate_context(void* p, size_t size, unsigned int align, size_t oldsize, unsigned int hint) {
+	// Keep the block in the same context heap if owned by this thread, otherwise fall back to the thread heap
+	rpmalloc_heap_t* heap = p ? rpmalloc_get_heap_for_ptr(p) : 0;
+	memory_context_heap_t* prev_context_heap = heap ? rpmalloc_heap_user_data(heap) : 0;
+	memory_context_heap_t* context_heap = 0;
+	size_t prev_size = p ? rpmalloc_usable_size(p) : 0;
+	void* block;
+	if (!heap || !memory_context_heap_is_thread_owned(heap)) {
+		block = memory_rpmalloc_reallocate(p, size, align, oldsize, hint);
+	} else {
+		FOUNDATION_ASSERT(oldsize);
+		context_heap = prev_context_heap;
+		unsigned int flags = (hint & MEMORY_NO_PRESERVE) ? RPMALLOC_NO_PRESERVE : 0;
+		if (hint & MEMORY_ZERO_INITIALIZED)
+			flags |= RPMALLOC_ZERO_INIT;
+		// Heap reallocation zero initializes from the old usable size, clear the remaining range of the old block
+		block = rpmalloc_heap_aligned_realloc(heap, p, align, size, flags);
+		if ((hint & MEMORY_ZERO_INITIALIZED) && block && (size > oldsize) && (prev_size > oldsize))
+			memset(pointer_offset(block, oldsize), 0, ((size < prev_size) ? size : prev_size) - oldsize);
+	}
+	if (block) {
+		if (p)
+			memory_context_statistics_deallocate(prev_context_heap, prev_size);
+		memory_context_statistics_allocate(context_heap, block);
+	}
+	return block;
+}
+
+static void
+memory_rpmalloc_deallocate_context(void* p) {
+	if (p) {
+		memory_context_statistics_deallocate(rpmalloc_heap_user_data(rpmalloc_get_heap_for_ptr(p)),
+		                                     rpmalloc_usable_size(p));
+		rpfree(p);
+	}
+}
+
+static void
+memory_context_heap_orphan_thread(void) {
+	// Leave the context heaps for adoption, blocks might still be in use and freed by other threads
+	memory_context_heap_t** table = get_thread_context_heap();
+	for (size_t islot = 0; islot < MEMORY_CONTEXT_HEAP_COUNT; ++islot) {
+		memory_context_heap_t* context_heap = table[islot];
+		if (context_heap) {
+			rpmalloc_heap_thread_orphan(context_heap->heap);
+			context_heap->owner_thread = 0;
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+			context_heap->owner = 0;
+#endif
+			memory_lock_acquire(&memory_context_heap_lock);
+			context_heap->next = memory_context_heap_orphan;
+			memory_context_heap_orphan = context_heap;
+			memory_lock_release(&memory_context_heap_lock);
+			table[islot] = 0;
+		}
+	}
+}
+
+static void
+memory_rpmalloc_thread_finalize_context(void) {
+	memory_context_heap_orphan_thread();
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+	memory_context_thread_release();
+#endif
+	rpmalloc_thread_finalize();
+}
+
+static void
+memory_rpmalloc_finalize_context(void) {
+	memory_context_heap_orphan_thread();
+
+	memory_context_heap_t* context_heap = memory_context_heap_orphan;
+	memory_context_heap_orphan = 0;
+	while (context_heap) {
+		memory_context_heap_t* next = context_heap->next;
+		rpmalloc_heap_release(context_heap->heap);
+		rpfree(context_heap);
+		context_heap = next;
+	}
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+	atomic_store_ptr(&memory_context_heap_list, 0, memorder_release);
+	set_thread_context_thread(0);
+	memory_context_thread_t* thread = atomic_load_ptr(&memory_context_thread_list, memorder_acquire);
+	atomic_store_ptr(&memory_context_thread_list, 0, memorder_release);
+	memory_context_thread_free = 0;
+	memory_context_untracked_dump = 0;
+	while (thread) {
+		memory_context_thread_t* next = thread->next;
+		rpfree(thread);
+		thread = next;
+	}
+#endif
+
+	rpmalloc_finalize();
+}
+
+#endif
+
+//! Number of power of two size classes in profile histograms
+#define MEMORY_PROFILE_SIZE_CLASS_COUNT 40
+//! Number of power of two cycle count buckets in profile histograms
+#define MEMORY_PROFILE_LATENCY_BUCKET_COUNT 32
+//! Maximum number of contexts counted per thread, must be a power of two
+#define MEMORY_PROFILE_CONTEXT_COUNT 64
+
+enum memory_profile_operation_t {
+	MEMORY_PROFILE_ALLOCATE = 0,
+	MEMORY_PROFILE_REALLOCATE,
+	MEMORY_PROFILE_DEALLOCATE,
+	MEMORY_PROFILE_OPERATION_COUNT
+};
+
+typedef struct memory_profile_t memory_profile_t;
+typedef struct memory_profile_context_t memory_profile_context_t;
+
+//! Allocation counters for a single context
+struct memory_profile_context_t {
+	//! Context
+	hash_t context;
+	//! Number of allocations
+	atomic64_t allocations;
+	//! Number of allocated bytes
+	atomic64_t allocated;
+};
+
+//! Profile data for a single thread. Counters are only updated by the owning thread, and
+//  are atomic only to allow reading them from other threads when dumping the profile
+struct memory_profile_t {
+	//! Number of calls per operation and size class
+	atomic64_t calls[MEMORY_PROFILE_OPERATION_COUNT][MEMORY_PROFILE_SIZE_CLASS_COUNT];
+	//! Total cycles per operation and size class
+	atomic64_t cycles[MEMORY_PROFILE_OPERATION_COUNT][MEMORY_PROFILE_SIZE_CLASS_COUNT];
+	//! Latency histogram per operation and size class
+	atomic64_t latency[MEMORY_PROFILE_OPERATION_COUNT][MEMORY_PROFILE_SIZE_CLASS_COUNT]
+	                  [MEMORY_PROFILE_LATENCY_BUCKET_COUNT];
+	//! Allocation counters per context, last slot counts contexts not fitting in the table
+	memory_profile_context_t context[MEMORY_PROFILE_CONTEXT_COUNT + 1];
+	//! Next profile in list of all profiles
+	memory_profile_t* next;
+	//! Next profile in list of profiles released by finalized threads
+	memory_profile_t* next_free;
+};
+
+FOUNDATION_DECLARE_THREAD_LOCAL(memory_profile_t*, memory_profile, 0)
+
+//! List of all profiles
+static atomicptr_t memory_profile_list;
+//! Profiles released by finalized threads, reused by the next profiled thread
+static memory_profile_t* memory_profile_free;
+//! Lock for profile lists
+static atomic32_t memory_profile_lock;
+
+static FOUNDATION_FORCEINLINE uint64_t
+memory_profile_cycles(void) {
+#if FOUNDATION_ARCH_X86 || FOUNDATION_ARCH_X86_64
+	return (uint64_t)__rdtsc();
+#elif FOUNDATION_ARCH_ARM8_64 && !FOUNDATION_COMPILER_MSVC
+	uint64_t virtual_timer;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(virtual_timer));
+	return virtual_timer;
+#else
+	return (uint64_t)time_current();
+#endif
+}
+
+static FOUNDATION_FORCEINLINE unsigned int
+memory_profile_log2(uint64_t value) {
+#if FOUNDATION_COMPILER_MSVC
+	unsigned long index;
+	_BitScanReverse64(&index, value | 1);
+	return (unsigned int)index;
+#else
+	return (unsigned int)(63 - __builtin_clzll(value | 1));
+#endif
+}
+
+static FOUNDATION_FORCEINLINE void
+memory_profile_add(atomic64_t* counter, int64_t value) {
+	atomic_store64(counter, atomic_load64(counter, memorder_relaxed) + value, memorder_relaxed);
+}
+
+static memory_profile_t*
+memory_profile_acquire(void) {
+	memory_lock_acquire(&memory_profile_lock);
+	memory_profile_t* profile = memory_profile_free;
+	if (profile)
+		memory_profile_free = profile->next_free;
+	memory_lock_release(&memory_profile_lock);
+	if (!profile) {
+		profile = rpzalloc(sizeof(memory_profile_t));
+		if (!profile)
+			return 0;
+		memory_lock_acquire(&memory_profile_lock);
+		profile->next = atomic_load_ptr(&memory_profile_list, memorder_relaxed);
+		atomic_store_ptr(&memory_profile_list, profile, memorder_release);
+		memory_lock_release(&memory_profile_lock);
+	}
+	set_thread_memory_profile(profile);
+	return profile;
+}
+
+static void
+memory_profile_record(unsigned int operation, size_t size, uint64_t cycles) {
+	memory_profile_t* profile = get_thread_memory_profile();
+	if (!profile) {
+		profile = memory_profile_acquire();
+		if (!profile)
+			return;
+	}
+	unsigned int size_class = memory_profile_log2(size);
+	unsigned int bucket = memory_profile_log2(cycles);
+	if (size_class >= MEMORY_PROFILE_SIZE_CLASS_COUNT)
+		size_class = MEMORY_PROFILE_SIZE_CLASS_COUNT - 1;
+	if (bucket >= MEMORY_PROFILE_LATENCY_BUCKET_COUNT)
+		bucket = MEMORY_PROFILE_LATENCY_BUCKET_COUNT - 1;
+	memory_profile_add(&profile->calls[operation][size_class], 1);
+	memory_profile_add(&profile->cycles[operation][size_class], (int64_t)cycles);
+	memory_profile_add(&profile->latency[operation][size_class][bucket], 1);
+}
+
+static void
+memory_profile_record_context(hash_t context, size_t size) {
+	memory_profile_t* profile = get_thread_memory_profile();
+	if (!profile)
+		return;
+	memory_profile_context_t* counter = &profile->context[MEMORY_PROFILE_CONTEXT_COUNT];
+	size_t islot = (size_t)context & (MEMORY_PROFILE_CONTEXT_COUNT - 1);
+	for (size_t iprobe = 0; iprobe < MEMORY_PROFILE_CONTEXT_COUNT; ++iprobe) {
+		memory_profile_context_t* slot = &profile->context[islot];
+		if (slot->context == context) {
+			counter = slot;
+			break;
+		}
+		if (!atomic_load64(&slot->allocations, memorder_relaxed)) {
+			slot->context = context;
+			counter = slot;
+			break;
+		}
+		islot = (islot + 1) & (MEMORY_PROFILE_CONTEXT_COUNT - 1);
+	}
+	memory_profile_add(&counter->allocations, 1);
+	memory_profile_add(&counter->allocated, (int64_t)size);
+}
+
+static void*
+memory_rpmalloc_allocate_profiled(hash_t context, size_t size, unsigned int align, unsigned int hint) {
+	uint64_t start = memory_profile_cycles();
+	void* block = memory_rpmalloc_allocate(context, size, align, hint);
+	uint64_t cycles = memory_profile_cycles() - start;
+	memory_profile_record(MEMORY_PROFILE_ALLOCATE, size, cycles);
+	memory_profile_record_context(context, size);
+	return block;
+}
+
+static void*
+memory_rpmalloc_reallocate_profiled(void* p, size_t size, unsigned int align, size_t oldsize, unsigned int hint) {
+	uint64_t start = memory_profile_cycles();
+	void* block = memory_rpmalloc_reallocate(p, size, align, oldsize, hint);
+	uint64_t cycles = memory_profile_cycles() - start;
+	memory_profile_record(MEMORY_PROFILE_REALLOCATE, size, cycles);
+	return block;
+}
+
+static void
+memory_rpmalloc_deallocate_profiled(void* p) {
+	size_t size = rpmalloc_usable_size(p);
+	uint64_t start = memory_profile_cycles();
+	rpfree(p);
+	uint64_t cycles = memory_profile_cycles() - start;
+	memory_profile_record(MEMORY_PROFILE_DEALLOCATE, size, cycles);
+}
+
+static void
+memory_rpmalloc_thread_finalize_profiled(void) {
+	// Keep the counters of finalized threads, the next profiled thread continues counting in the same profile
+	memory_profile_t* profile = get_thread_memory_profile();
+	if (profile) {
+		set_thread_memory_profile(0);
+		memory_lock_acquire(&memory_profile_lock);
+		profile->next_free = memory_profile_free;
+		memory_profile_free = profile;
+		memory_lock_release(&memory_profile_lock);
+	}
+	rpmalloc_thread_finalize();
+}
+
+static void
+memory_rpmalloc_finalize_profiled(void) {
+	set_thread_memory_profile(0);
+	memory_profile_t* profile = atomic_load_ptr(&memory_profile_list, memorder_acquire);
+	atomic_store_ptr(&memory_profile_list, 0, memorder_release);
+	memory_profile_free = 0;
+	while (profile) {
+		memory_profile_t* next = profile->next;
+		rpfree(profile);
+		profile = next;
+	}
+	rpmalloc_finalize();
+}
+
 memory_system_t
 memory_system(void) {
 	memory_system_t memsystem;
@@ -93,3 +666,240 @@ memory_system(void) {
 	memsystem.thread_finalize = memory_rpmalloc_thread_finalize;
 	return memsystem;
 }
+
+memory_system_t
+memory_system_context_heaps(void) {
+	memory_system_t memsystem = memory_system();
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	memsystem.allocate = memory_rpmalloc_allocate_context;
+	memsystem.reallocate = memory_rpmalloc_reallocate_context;
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+	memsystem.deallocate = memory_rpmalloc_deallocate_context;
+#endif
+	memsystem.finalize = memory_rpmalloc_finalize_context;
+	memsystem.thread_finalize = memory_rpmalloc_thread_finalize_context;
+#endif
+	return memsystem;
+}
+
+memory_system_t
+memory_system_profiled(void) {
+	memory_system_t memsystem = memory_system();
+	memsystem.allocate = memory_rpmalloc_allocate_profiled;
+	memsystem.reallocate = memory_rpmalloc_reallocate_profiled;
+	memsystem.deallocate = memory_rpmalloc_deallocate_profiled;
+	memsystem.finalize = memory_rpmalloc_finalize_profiled;
+	memsystem.thread_finalize = memory_rpmalloc_thread_finalize_profiled;
+	return memsystem;
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS && BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+
+static void
+memory_context_statistics_count(memory_context_statistics_t* statistics, int64_t allocations, int64_t allocated,
+                                int64_t deallocations, int64_t deallocated) {
+	// Counters are read without synchronization, a deallocation can be seen before the allocation
+	statistics->allocations_current += (allocations > deallocations) ? (size_t)(allocations - deallocations) : 0;
+	statistics->allocated_current += (allocated > deallocated) ? (size_t)(allocated - deallocated) : 0;
+	statistics->allocations_total += (size_t)allocations;
+	statistics->allocated_total += (size_t)allocated;
+}
+
+static void
+memory_context_statistics_add(memory_context_statistics_t* statistics, memory_context_heap_t* context_heap) {
+	memory_context_statistics_count(
+	    statistics, atomic_load64(&context_heap->allocations, memorder_relaxed),
+	    atomic_load64(&context_heap->allocated, memorder_relaxed),
+	    atomic_load64(&context_heap->deallocations, memorder_relaxed) +
+	        atomic_load64(&context_heap->remote_deallocations, memorder_relaxed),
+	    atomic_load64(&context_heap->deallocated, memorder_relaxed) +
+	        atomic_load64(&context_heap->remote_deallocated, memorder_relaxed));
+}
+
+//! Sum the counters of all threads for blocks not in a context heap, returns the total number of allocations
+static int64_t
+memory_context_statistics_add_untracked(memory_context_statistics_t* statistics) {
+	int64_t allocations = 0;
+	int64_t allocated = 0;
+	int64_t deallocations = 0;
+	int64_t deallocated = 0;
+	memory_context_thread_t* thread = atomic_load_ptr(&memory_context_thread_list, memorder_acquire);
+	for (; thread; thread = thread->next) {
+		allocations += atomic_load64(&thread->allocations, memorder_relaxed);
+		allocated += atomic_load64(&thread->allocated, memorder_relaxed);
+		deallocations += atomic_load64(&thread->deallocations, memorder_relaxed);
+		deallocated += atomic_load64(&thread->deallocated, memorder_relaxed);
+	}
+	memory_context_statistics_count(statistics, allocations, allocated, deallocations, deallocated);
+	return allocations;
+}
+
+size_t
+memory_context_statistics(memory_context_statistics_t* statistics, size_t capacity) {
+	size_t count = 0;
+	// Heaps are only inserted at the head, walk a single snapshot of the list so new heaps are not counted twice
+	memory_context_heap_t* head = atomic_load_ptr(&memory_context_heap_list, memorder_acquire);
+	memory_context_heap_t* context_heap = head;
+	for (; context_heap; context_heap = context_heap->next_heap) {
+		// Heaps for the same context in different threads are merged, skip if already aggregated
+		memory_context_heap_t* prev_heap = head;
+		while ((prev_heap != context_heap) && (prev_heap->context != context_heap->context))
+			prev_heap = prev_heap->next_heap;
+		if (prev_heap != context_heap)
+			continue;
+		if (count < capacity) {
+			memory_context_statistics_t* current = statistics + count;
+			memset(current, 0, sizeof(memory_context_statistics_t));
+			current->context = context_heap->context;
+			for (; prev_heap; prev_heap = prev_heap->next_heap) {
+				if (prev_heap->context == context_heap->context)
+					memory_context_statistics_add(current, prev_heap);
+			}
+		}
+		++count;
+	}
+	if (count < capacity) {
+		memset(statistics + count, 0, sizeof(memory_context_statistics_t));
+		memory_context_statistics_add_untracked(statistics + count);
+	}
+	return ++count;
+}
+
+void
+memory_context_statistics_dump(void) {
+	tick_t now = time_current();
+	deltatime_t elapsed = memory_context_statistics_dump_time ?
+	                          time_ticks_to_seconds(time_diff(memory_context_statistics_dump_time, now)) :
+	                          0;
+	memory_context_statistics_dump_time = now;
+
+	memory_context_heap_t* head = atomic_load_ptr(&memory_context_heap_list, memorder_acquire);
+	memory_context_heap_t* context_heap = head;
+	for (; context_heap; context_heap = context_heap->next_heap) {
+		memory_context_heap_t* prev_heap = head;
+		while ((prev_heap != context_heap) && (prev_heap->context != context_heap->context))
+			prev_heap = prev_heap->next_heap;
+		if (prev_heap != context_heap)
+			continue;
+		memory_context_statistics_t statistics;
+		memset(&statistics, 0, sizeof(statistics));
+		statistics.context = context_heap->context;
+		int64_t allocations_interval = 0;
+		for (; prev_heap; prev_heap = prev_heap->next_heap) {
+			if (prev_heap->context == context_heap->context) {
+				memory_context_statistics_add(&statistics, prev_heap);
+				int64_t allocations = atomic_load64(&prev_heap->allocations, memorder_relaxed);
+				allocations_interval += allocations - prev_heap->allocations_dump;
+				prev_heap->allocations_dump = allocations;
+			}
+		}
+		log_infof(HASH_MEMORY,
+		          STRING_CONST("Context %" PRIhash ": %" PRIsize " bytes in %" PRIsize " blocks, %" PRIsize
+		                       " allocations total, %.1f allocations/s"),
+		          statistics.context, statistics.allocated_current, statistics.allocations_current,
+		          statistics.allocations_total, (elapsed > 0) ? (double)allocations_interval / (double)elapsed : 0.0);
+	}
+
+	memory_context_statistics_t statistics;
+	memset(&statistics, 0, sizeof(statistics));
+	int64_t allocations = memory_context_statistics_add_untracked(&statistics);
+	int64_t allocations_interval = allocations - memory_context_untracked_dump;
+	memory_context_untracked_dump = allocations;
+	log_infof(HASH_MEMORY,
+	          STRING_CONST("No context: %" PRIsize " bytes in %" PRIsize " blocks, %" PRIsize
+	                       " allocations total, %.1f allocations/s"),
+	          statistics.allocated_current, statistics.allocations_current, statistics.allocations_total,
+	          (elapsed > 0) ? (double)allocations_interval / (double)elapsed : 0.0);
+}
+
+#else
+
+size_t
+memory_context_statistics(memory_context_statistics_t* statistics, size_t capacity) {
+	FOUNDATION_UNUSED(statistics);
+	FOUNDATION_UNUSED(capacity);
+	return 0;
+}
+
+void
+memory_context_statistics_dump(void) {
+}
+
+#endif
+
+static const char* memory_profile_operation_name[MEMORY_PROFILE_OPERATION_COUNT] = {"allocate", "reallocate",
+                                                                                     "deallocate"};
+
+//! Upper bound of the cycle count bucket at the given fraction of all calls
+static uint64_t
+memory_profile_percentile(const int64_t* latency, int64_t calls, double fraction) {
+	int64_t threshold = (int64_t)((double)calls * fraction);
+	int64_t accumulated = 0;
+	for (unsigned int ibucket = 0; ibucket < MEMORY_PROFILE_LATENCY_BUCKET_COUNT; ++ibucket) {
+		accumulated += latency[ibucket];
+		if (accumulated > threshold)
+			return 2ULL << ibucket;
+	}
+	return 2ULL << (MEMORY_PROFILE_LATENCY_BUCKET_COUNT - 1);
+}
+
+void
+memory_profile_dump(void) {
+	memory_profile_t* head = atomic_load_ptr(&memory_profile_list, memorder_acquire);
+	for (unsigned int operation = 0; operation < MEMORY_PROFILE_OPERATION_COUNT; ++operation) {
+		for (unsigned int size_class = 0; size_class < MEMORY_PROFILE_SIZE_CLASS_COUNT; ++size_class) {
+			int64_t calls = 0;
+			int64_t cycles = 0;
+			int64_t latency[MEMORY_PROFILE_LATENCY_BUCKET_COUNT];
+			memset(latency, 0, sizeof(latency));
+			for (memory_profile_t* profile = head; profile; profile = profile->next) {
+				calls += atomic_load64(&profile->calls[operation][size_class], memorder_relaxed);
+				cycles += atomic_load64(&profile->cycles[operation][size_class], memorder_relaxed);
+				atomic64_t* profile_latency = profile->latency[operation][size_class];
+				for (unsigned int ibucket = 0; ibucket < MEMORY_PROFILE_LATENCY_BUCKET_COUNT; ++ibucket)
+					latency[ibucket] += atomic_load64(profile_latency + ibucket, memorder_relaxed);
+			}
+			if (!calls)
+				continue;
+			log_infof(HASH_MEMORY,
+			          STRING_CONST("%s %" PRIsize "-%" PRIsize " bytes: %" PRId64 " calls, %" PRId64
+			                       " cycles average, p50 < %" PRIu64 ", p99 < %" PRIu64 ", p99.9 < %" PRIu64 " cycles"),
+			          memory_profile_operation_name[operation], (size_t)(size_class ? (1ULL << size_class) : 0),
+			          (size_t)((2ULL << size_class) - 1), calls, cycles / calls,
+			          memory_profile_percentile(latency, calls, 0.5), memory_profile_percentile(latency, calls, 0.99),
+			          memory_profile_percentile(latency, calls, 0.999));
+		}
+	}
+
+	// Aggregate context counters of all threads, overflowing contexts are counted with the untracked slot
+	memory_profile_context_t context[MEMORY_PROFILE_CONTEXT_COUNT * 4 + 1];
+	size_t context_count = 0;
+	memset(context, 0, sizeof(context));
+	for (memory_profile_t* profile = head; profile; profile = profile->next) {
+		for (size_t islot = 0; islot <= MEMORY_PROFILE_CONTEXT_COUNT; ++islot) {
+			memory_profile_context_t* slot = &profile->context[islot];
+			int64_t allocations = atomic_load64(&slot->allocations, memorder_relaxed);
+			if (!allocations)
+				continue;
+			size_t icontext = 0;
+			hash_t slot_context = (islot < MEMORY_PROFILE_CONTEXT_COUNT) ? slot->context : 0;
+			while ((icontext < context_count) && (context[icontext].context != slot_context))
+				++icontext;
+			if (icontext == context_count) {
+				if (context_count < MEMORY_PROFILE_CONTEXT_COUNT * 4)
+					context[context_count++].context = slot_context;
+				else
+					icontext = MEMORY_PROFILE_CONTEXT_COUNT * 4;
+			}
+			memory_profile_add(&context[icontext].allocations, allocations);
+			memory_profile_add(&context[icontext].allocated, atomic_load64(&slot->allocated, memorder_relaxed));
+		}
+	}
+	for (size_t icontext = 0; icontext <= MEMORY_PROFILE_CONTEXT_COUNT * 4; ++icontext) {
+		int64_t allocations = atomic_load64(&context[icontext].allocations, memorder_relaxed);
+		if (allocations)
+			log_infof(HASH_MEMORY, STRING_CONST("Context %" PRIhash ": %" PRId64 " allocations, %" PRId64 " bytes"),
+			          context[icontext].context, allocations,
+			          atomic_load64(&context[icontext].allocated, memorder_relaxed));
+	}
+}
@@ -24,5 +24,40 @@
 MEMORY_API memory_system_t
 memory_system(void);
 
+/*! Get a memory system where each allocation context gets a separate heap per thread,
+keeping blocks of one context together and isolated from the page churn of other contexts.
+Blocks can be deallocated from any thread. Requires RPMALLOC_FIRST_CLASS_HEAPS, otherwise
+the returned memory system is identical to the one returned by memory_system
+\return Memory system using per-context heaps */
+MEMORY_API memory_system_t
+memory_system_context_heaps(void);
+
+/*! Get per-context memory statistics for the memory system returned by memory_system_context_heaps,
+aggregated over all threads. Statistics for at most capacity contexts are stored in the given array.
+Requires BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+\param statistics Array receiving statistics
+\param capacity Capacity of array
+\return Total number of contexts, can be larger than capacity */
+MEMORY_API size_t
+memory_context_statistics(memory_context_statistics_t* statistics, size_t capacity);
+
+/*! Log per-context memory statistics, with allocation rates measured since the previous
+call to this function. Intended to be called periodically, for example from a main loop
+or a timer. Requires BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS */
+MEMORY_API void
+memory_context_statistics_dump(void);
+
+/*! Get a memory system that measures the cycle count of each allocate, reallocate and
+deallocate call and records latency histograms per power of two size class and allocation
+counts per context in thread local storage. Use memory_profile_dump to output the profile
+\return Profiling memory system */
+MEMORY_API memory_system_t
+memory_system_profiled(void);
+
+/*! Log the latency histograms and context allocation counts recorded by the memory system
+returned by memory_system_profiled, aggregated over all threads */
+MEMORY_API void
+memory_profile_dump(void);
+
 MEMORY_API version_t
 memory_module_version(void);
@@ -59,6 +59,11 @@ static DWORD fls_key;
 #include <sched.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <time.h>
 static pthread_key_t pthread_key;
 #ifdef __FreeBSD__
 #include <sys/sysctl.h>
@@ -76,6 +81,9 @@ madvise(caddr_t, size_t, int);
 #ifndef MAP_UNINITIALIZED
 #define MAP_UNINITIALIZED 0
 #endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
 #endif
 
 #if defined(__linux__) || defined(__ANDROID__)
@@ -84,6 +92,9 @@ madvise(caddr_t, size_t, int);
 #define PR_SET_VMA 0x53564d41
 #define PR_SET_VMA_ANON_NAME 0
 #endif
+#if !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23
+#endif
 #endif
 #if defined(__APPLE__)
 #include <TargetConditionals.h>
@@ -96,6 +107,15 @@ madvise(caddr_t, size_t, int);
 #if defined(__HAIKU__) || defined(__TINYC__)
 #include <pthread.h>
 #endif
+#if ENABLE_SAMPLING && (defined(__GLIBC__) || defined(__APPLE__))
+#include <execinfo.h>
+#endif
+#if (ENABLE_SAMPLING || ENABLE_LATENCY) && defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#if ENABLE_TRACEPOINTS
+#include <sys/sdt.h>
+#endif
 
 #include <limits.h>
 #if (INTPTR_MAX > INT32_MAX)
@@ -147,6 +167,18 @@ madvise(caddr_t, size_t, int);
 //! Enable statistics
 #define ENABLE_STATISTICS 0
 #endif
+#ifndef ENABLE_SAMPLING
+//! Enable the sampling heap profiler
+#define ENABLE_SAMPLING 0
+#endif
+#ifndef ENABLE_LATENCY
+//! Enable slow path latency histograms
+#define ENABLE_LATENCY 0
+#endif
+#ifndef ENABLE_TRACEPOINTS
+//! Enable statically defined tracepoints on slow paths, requires sys/sdt.h
+#define ENABLE_TRACEPOINTS 0
+#endif
 
 ////////////
 ///
@@ -178,9 +210,57 @@ madvise(caddr_t, size_t, int);
 #define LARGE_PAGE_SIZE (1 << LARGE_PAGE_SIZE_SHIFT)
 #define LARGE_PAGE_MASK (~((uintptr_t)LARGE_PAGE_SIZE - 1))
 
-#define SPAN_SIZE (256 * 1024 * 1024)
+//! Maximum number of blocks in a page, the smallest size class in a small page
+#define PAGE_BLOCK_COUNT_MAX ((SMALL_PAGE_SIZE - PAGE_HEADER_SIZE) / SMALL_GRANULARITY)
+
+//! Number of cross thread frees from a heap between each sampled free recorded by heap pair
+#define REMOTE_FREE_SAMPLE_PERIOD 64
+//! Number of heap pairs with separate sampled cross thread free counts
+#define REMOTE_FREE_PAIR_COUNT 256
+//! Number of log2 buckets in the histogram of blocks adopted from page thread free lists
+#define ADOPT_BATCH_BUCKET_COUNT 16
+
+//! Maximum number of frames in a sampled allocation stack trace
+#define SAMPLE_STACK_DEPTH 32
+//! Number of unique stack traces in the sampling profile
+#define SAMPLE_STACK_COUNT 4096
+#define SAMPLE_STACK_BUCKET_COUNT 1024
+//! Number of live sampled blocks tracked by the sampling profile
+#define SAMPLE_BLOCK_COUNT 16384
+#define SAMPLE_BLOCK_BUCKET_COUNT 4096
+//! Default mean number of bytes allocated between samples
+#define SAMPLE_INTERVAL_DEFAULT (512 * 1024)
+//! Number of bytes allocated between checks if sampling has been enabled
+#define SAMPLE_RECHECK_INTERVAL (1024 * 1024)
+//! Number of log2 buckets in sampled block lifetime histograms, bucket N counts lifetimes of [2^N, 2^(N+1)) ticks
+#define SAMPLE_LIFETIME_BUCKET_COUNT 64
+//! Number of heaps with separate lifetime histograms, lifetimes in further heaps are accounted together
+#define SAMPLE_HEAP_COUNT 64
+//! Number of free hook calls made per pass when purging sampled blocks of released memory
+#define SAMPLE_PURGE_HOOK_COUNT 64
+
+//! Number of log2 buckets in slow path latency histograms, bucket N counts latencies of [2^N, 2^(N+1)) ticks
+#define LATENCY_BUCKET_COUNT 32
+
+#define SPAN_SIZE_SHIFT 28
+#define SPAN_SIZE (1 << SPAN_SIZE_SHIFT)
 #define SPAN_MASK (~((uintptr_t)(SPAN_SIZE - 1)))
 
+//! Number of address bits covered by the span map, spans mapped at higher addresses are not tracked
+#ifndef SPAN_MAP_ADDRESS_BITS
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define SPAN_MAP_ADDRESS_BITS 48
+#else
+#define SPAN_MAP_ADDRESS_BITS 32
+#endif
+#endif
+#define SPAN_MAP_BITS ((uintptr_t)1 << (SPAN_MAP_ADDRESS_BITS - SPAN_SIZE_SHIFT))
+#define SPAN_MAP_WORD_BITS (sizeof(uintptr_t) * 8)
+#define SPAN_MAP_WORD_COUNT ((SPAN_MAP_BITS + SPAN_MAP_WORD_BITS - 1) / SPAN_MAP_WORD_BITS)
+
+//! Owner thread ID of an orphaned first class heap, never matches the ID of a thread
+#define HEAP_OWNER_ORPHAN (~((uintptr_t)0))
+
 //! Threshold number of pages for when free pages are decommitted
 #ifndef PAGE_FREE_OVERFLOW
 #define PAGE_FREE_OVERFLOW 32
@@ -191,6 +271,18 @@ madvise(caddr_t, size_t, int);
 #define PAGE_FREE_DECOMMIT 16
 #endif
 
+//! Maximum number of memory interfaces in use by heaps, including the global memory interface
+#ifndef MEMORY_INTERFACE_COUNT
+#define MEMORY_INTERFACE_COUNT 16
+#endif
+//! Memory interface index reserved for the cross process heap region, the same in all processes
+#define MEMORY_INTERFACE_IPC (MEMORY_INTERFACE_COUNT - 1)
+
+//! Size of a heap label used when naming mapped memory regions, including terminator
+#define HEAP_LABEL_SIZE RPMALLOC_HEAP_LABEL_SIZE
+//! Maximum size of a mapped memory region name including terminator, as limited by the kernel
+#define OS_PAGE_NAME_SIZE 80
+
 ////////////
 ///
 /// Utility macros
@@ -217,6 +309,28 @@ madvise(caddr_t, size_t, int);
 	} while (0)
 #endif
 
+#if ENABLE_TRACEPOINTS
+// Tracepoints in the rpmalloc provider, a nop instruction and an ELF note until a tracer attaches:
+//  span_map, span_unmap (heap id, page type, address, mapped size)
+//  page_commit, page_decommit (heap id, page type, address, size)
+//  heap_acquire, heap_release (heap id, first class flag)
+//  huge_alloc (heap id, block, requested size, mapped size), huge_free (heap id, block, size)
+//  thread_free_adopt (heap id, size class, number of blocks)
+#define rpmalloc_trace2(name, a, b) DTRACE_PROBE2(rpmalloc, name, a, b)
+#define rpmalloc_trace3(name, a, b, c) DTRACE_PROBE3(rpmalloc, name, a, b, c)
+#define rpmalloc_trace4(name, a, b, c, d) DTRACE_PROBE4(rpmalloc, name, a, b, c, d)
+#else
+#define rpmalloc_trace2(name, a, b) \
+	do {                            \
+	} while (0)
+#define rpmalloc_trace3(name, a, b, c) \
+	do {                               \
+	} while (0)
+#define rpmalloc_trace4(name, a, b, c, d) \
+	do {                                  \
+	} while (0)
+#endif
+
 #if __has_builtin(__builtin_assume)
 #define rpmalloc_assume(cond) __builtin_assume(cond)
 #elif defined(__GNUC__)
@@ -247,9 +361,31 @@ typedef struct rpmalloc_statistics_t {
 	atomic_size_t page_active;
 	atomic_size_t page_active_peak;
 	atomic_size_t heap_count;
+	//! Number of failed compare and swap operations pushing blocks to page thread free lists
+	atomic_size_t thread_free_retry;
+	//! Number of failed compare and swap operations adopting page thread free lists
+	atomic_size_t adopt_retry;
+	//! Number of failed compare and swap operations pushing pages to heap thread free page lists
+	atomic_size_t page_free_thread_retry;
 } rpmalloc_statistics_t;
 
+//! Sampled number of cross thread frees by a freeing heap into pages of an owning heap
+typedef struct statistics_remote_free_t {
+	//! ID of freeing heap, zero if the entry is unused
+	uint32_t heap_free;
+	//! ID of owning heap
+	uint32_t heap_owner;
+	//! Number of sampled frees
+	size_t count;
+} statistics_remote_free_t;
+
 static rpmalloc_statistics_t global_statistics;
+//! Sampled cross thread free counts, open addressed by heap pair
+static statistics_remote_free_t global_statistics_remote_free[REMOTE_FREE_PAIR_COUNT];
+//! Sampled cross thread free count of heap pairs not fitting in the table
+static size_t global_statistics_remote_free_other;
+//! Lock for the sampled cross thread free counts
+static atomic_uintptr_t global_statistics_remote_free_lock;
 
 #else
 
@@ -297,6 +433,48 @@ wait_spin(void) {
 #endif
 }
 
+#if ENABLE_SAMPLING || ENABLE_LATENCY
+
+//! Read a cheap monotonic cycle counter, used to measure sampled block lifetimes and slow path latencies
+static inline uint64_t
+cpu_ticks(void) {
+#if defined(_MSC_VER) && !defined(__clang__) && (defined(_M_X64) || defined(_M_IX86))
+	return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#elif PLATFORM_WINDOWS
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)counter.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+#endif
+}
+
+//! Get the monotonic time in nanoseconds, used to calibrate the cycle counter
+static uint64_t
+monotonic_time(void) {
+#if PLATFORM_WINDOWS
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (uint64_t)(((double)counter.QuadPart * 1000000000.0) / (double)frequency.QuadPart);
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+#endif
+}
+
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 
 #define EXPECTED(x) __builtin_expect((x), 1)
@@ -350,6 +528,14 @@ typedef struct page_t page_t;
 typedef struct block_t block_t;
 //! Size class for a memory block
 typedef struct size_class_t size_class_t;
+//! Heap shared by a group of threads
+typedef struct heap_shared_t heap_shared_t;
+//! Allocator instance with configuration, memory interface and heaps
+typedef struct instance_t instance_t;
+//! Header of a file backed persistent heap region
+typedef struct heap_persistent_t heap_persistent_t;
+//! Header of a cross process shared memory heap region
+typedef struct heap_ipc_t heap_ipc_t;
 
 //! Memory page type
 typedef enum page_type_t {
@@ -397,8 +583,13 @@ struct page_t {
 	uint32_t is_decommitted : 1;
 	//! Flag set if containing aligned blocks
 	uint32_t has_aligned_block : 1;
-	//! Fast combination flag for either huge, fully allocated or has aligned blocks
+	//! Flag set if containing blocks sampled by the heap profiler
+	uint32_t has_sampled_block : 1;
+	//! Fast combination flag for either huge, fully allocated or has aligned or sampled blocks
 	uint32_t generic_free : 1;
+	//! Bit N set if a block with index N modulo 16 was sampled since the page was made available, frees of other
+	//  blocks in a page with sampled blocks skip the sample table
+	uint32_t sample_map : 16;
 	//! Local free list count
 	uint32_t local_free_count;
 	//! Local free list
@@ -422,7 +613,9 @@ struct span_t {
 	//! Page address mask
 	uintptr_t page_address_mask;
 	//! Number of pages initialized
-	uint32_t page_initialized;
+	uint16_t page_initialized;
+	//! Number of pages initialized before the span was reset, memory in these pages is not zero
+	uint16_t page_dirty;
 	//! Number of pages in use
 	uint32_t page_count;
 	//! Number of bytes per page
@@ -431,12 +624,41 @@ struct span_t {
 	page_type_t page_type;
 	//! Offset to start of mapped memory region
 	uint32_t offset;
+	//! Index of memory interface used to map the span
+	uint32_t memory_interface;
 	//! Mapped size
 	uint64_t mapped_size;
 	//! Next span in list
 	span_t* next;
 };
 
+//! Allocator slow paths with latency histograms
+typedef enum latency_path_t {
+	//! Mapping a new span in heap_get_span
+	LATENCY_SPAN_MAP,
+	//! Recommitting the memory pages of a decommitted page
+	LATENCY_PAGE_COMMIT,
+	//! Decommitting the memory pages of free pages exceeding the retained count
+	LATENCY_PAGE_DECOMMIT,
+	//! Mapping a huge block
+	LATENCY_HUGE_MAP,
+	//! Unmapping a huge block
+	LATENCY_HUGE_UNMAP,
+	//! Adopting the thread free list of a page
+	LATENCY_THREAD_FREE_ADOPT,
+	LATENCY_PATH_COUNT
+} latency_path_t;
+
+//! Latency histogram of a slow path
+typedef struct latency_histogram_t {
+	//! Number of times the path was taken
+	size_t count;
+	//! Total number of ticks spent in the path
+	uint64_t ticks;
+	//! Log2 histogram of ticks spent in the path
+	size_t bucket[LATENCY_BUCKET_COUNT];
+} latency_histogram_t;
+
 // Control structure for a heap, either a thread heap or a first class heap if enabled
 struct heap_t {
 	//! Owning thread ID
@@ -451,7 +673,7 @@ struct heap_t {
 	uint32_t page_free_commit_count[3];
 	//! Multithreaded free pages for each page type
 	atomic_uintptr_t page_free_thread[3];
-	//! Available partially initialized spans for each page type
+	//! Available partially initialized spans for each page type, head is the span pages are initialized from
 	span_t* span_partial[3];
 	//! Spans in full use for each page type
 	span_t* span_used[4];
@@ -463,15 +685,317 @@ struct heap_t {
 	uint32_t id;
 	//! Finalization state flag
 	uint32_t finalize;
+	//! Flag set if first class heap
+	uint32_t first_class;
+	//! User data
+	void* user_data;
+	//! Owning shared heap if thread sub heap of a shared heap
+	heap_shared_t* shared;
+	//! Next sub heap in shared heap
+	heap_t* shared_next;
+	//! Mapped size of spans owned by the heap
+	atomic_size_t memory_usage;
+	//! Committed size of initialized pages and huge blocks owned by the heap
+	atomic_size_t memory_committed;
+	//! Limit of committed size of pages and huge blocks owned by the heap, zero if unlimited
+	size_t memory_limit;
+	//! Policy flags when limit is reached
+	unsigned int memory_limit_policy;
+	//! Callback when limit is reached
+	int (*memory_limit_callback)(heap_t* heap, size_t size);
+	//! Index of memory interface used to map spans
+	uint32_t memory_interface;
+	//! Owning allocator instance
+	instance_t* instance;
+	//! Owning process ID if heap in a cross process heap region, zero otherwise
+	uint32_t owner_process;
+	//! Flag set if heap only allocates from pinned spans reserved when the heap was acquired
+	uint32_t pinned;
+	//! Pinned heap flags
+	unsigned int pin_flags;
+	//! Number of bytes reserved in pinned spans
+	size_t pin_reserved;
+	//! Number of allocations diverted from an exhausted pinned heap
+	size_t pin_diverted;
+	//! Number of allocations failed in an exhausted pinned heap
+	size_t pin_failed;
+	//! Number of memory map calls
+	size_t map_count;
+	//! Number of memory unmap calls, can be made by other threads for huge blocks
+	atomic_size_t unmap_count;
+	//! Number of memory commit calls
+	size_t commit_count;
+	//! Number of memory decommit calls
+	size_t decommit_count;
+	//! Memory map region offset
+	uint32_t offset;
+	//! Memory map size
+	size_t mapped_size;
+	//! Label used when naming mapped memory regions, empty if not set
+	char label[HEAP_LABEL_SIZE];
+	//! Number of bytes left to allocate until next sampled allocation
+	size_t sample_countdown;
+	//! Sampling interval the countdown was drawn from, zero if sampling was disabled
+	size_t sample_interval;
+	//! Random generator state for sampling intervals
+	uint64_t sample_random;
+	//! Number of blocks sampled from the heap, orders sampled blocks against heap marks
+	uint64_t sample_generation;
+#if ENABLE_LATENCY
+	//! Latency histograms of slow paths taken by the heap
+	latency_histogram_t latency[LATENCY_PATH_COUNT];
+#endif
+#if ENABLE_STATISTICS
+	//! Number of allocations per size class, last is for huge blocks
+	size_t alloc_total[SIZE_CLASS_COUNT + 1];
+	//! Number of requested bytes per size class, last is for huge blocks
+	size_t requested_total[SIZE_CLASS_COUNT + 1];
+	//! Number of bytes in allocated huge blocks
+	size_t huge_allocated_total;
+	//! Number of frees of blocks in pages owned by other heaps
+	size_t remote_free_count;
+	//! Number of cross thread frees since last sampled free
+	uint32_t remote_free_sample;
+	//! Histogram of number of blocks adopted from page thread free lists
+	size_t adopt_batch[ADOPT_BATCH_BUCKET_COUNT];
+#endif
+};
+
+// Control structure for a heap shared by a group of threads, each thread allocates from a sub heap
+struct heap_shared_t {
+	//! Lock for span pool and huge span lists of sub heaps, holding the process ID and thread lock index of the
+	//  owner since the lock can be in memory shared between processes
+	atomic_ullong lock;
+	//! Sub heaps, one per thread, only ever prepended
+	atomic_uintptr_t heap;
+	//! Pool of available spans for each page type, shared by all sub heaps
+	span_t* span_free[3];
 	//! Memory map region offset
 	uint32_t offset;
 	//! Memory map size
 	size_t mapped_size;
 };
 
+// Allocator instance, the process global allocator is the default instance
+struct instance_t {
+	//! Configuration
+	rpmalloc_config_t config;
+	//! Memory interface used to map heaps and spans
+	rpmalloc_interface_t* memory_interface;
+	//! Index of memory interface in memory interface table
+	uint32_t memory_interface_index;
+	//! Available heaps
+	heap_t* heap_queue;
+	//! In use heaps
+	heap_t* heap_used;
+	//! Lock for heap queue
+	atomic_uintptr_t heap_lock;
+	//! Memory map region offset
+	uint32_t offset;
+	//! Memory map size
+	size_t mapped_size;
+};
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Magic identifier of a persistent heap region
+#define PERSISTENT_MAGIC 0x31504d4852504d52ULL
+//! Version of the persistent heap region layout
+#define PERSISTENT_VERSION 1
+#ifndef PERSISTENT_SPAN_COUNT
+//! Maximum number of spans in a persistent heap region, including the header span
+#define PERSISTENT_SPAN_COUNT 4096
+#endif
+//! Span slot used by the mapping starting in a preceding slot
+#define PERSISTENT_SLOT_CONTINUED 0xFFFFFFFF
+//! Region was synced and unmapped by detach
+#define PERSISTENT_STATE_CLEAN 1
+//! Region is mapped by a process
+#define PERSISTENT_STATE_OPEN 2
+
+// Header of a persistent heap region, stored at the start of the first span of the mapped file. All
+// pointers in the region are absolute, the file must always be mapped at the same base address
+struct heap_persistent_t {
+	//! Magic identifier
+	uint64_t magic;
+	//! Layout version
+	uint32_t version;
+	//! Size of heap structure, to detect layout changes
+	uint32_t heap_size;
+	//! Region state
+	uint32_t state;
+	//! Number of span slots in region
+	uint32_t span_count;
+	//! Number of syncs to the file
+	uint64_t checkpoint;
+	//! Base address of the mapped region
+	uintptr_t base;
+	//! Size of the mapped region
+	size_t size;
+	//! Root object set by user
+	void* root;
+	//! Number of slots for a mapping starting in a slot, PERSISTENT_SLOT_CONTINUED if used by a preceding mapping
+	uint32_t slot[PERSISTENT_SPAN_COUNT];
+	//! The heap
+	heap_t heap;
+};
+
+//! Magic identifier of a cross process heap region
+#define IPC_MAGIC 0x31435049504d5052ULL
+//! Version of the cross process heap region layout
+#define IPC_VERSION 1
+#ifndef IPC_SPAN_COUNT
+//! Maximum number of spans in a cross process heap region, including the header span
+#define IPC_SPAN_COUNT 1024
+#endif
+#ifndef IPC_HEAP_COUNT
+//! Maximum number of heaps in a cross process heap region
+#define IPC_HEAP_COUNT 64
+#endif
+
+// Header of a cross process heap region, stored at the start of the first span of the shared memory. Each
+// process allocates from its own heaps in the region, and blocks freed by other processes are deferred to the
+// owning heap in the same way as blocks freed by other threads. The region is mapped at the same base address
+// in all processes, so pointers into the region are valid in every process. Heaps in the region store no
+// pointers to process local data, they are owned by process ID and the shared lock owner is the process ID and
+// thread lock index, since thread IDs are only unique within a process
+struct heap_ipc_t {
+	//! Magic identifier
+	uint64_t magic;
+	//! Layout version
+	uint32_t version;
+	//! Size of heap structure, to detect layout changes
+	uint32_t heap_size;
+	//! Number of span slots in region
+	uint32_t span_count;
+	//! Base address of the mapped region
+	uintptr_t base;
+	//! Size of the mapped region
+	size_t size;
+	//! Lock for span slots, heap slots and huge span lists, set as the shared heap of all heaps in the region
+	heap_shared_t shared;
+	//! Number of slots for a mapping starting in a slot, PERSISTENT_SLOT_CONTINUED if used by a preceding mapping
+	uint32_t slot[IPC_SPAN_COUNT];
+	//! The heaps, in use if owner process is set
+	heap_t heap[IPC_HEAP_COUNT];
+};
+
+#endif
+
+//! Live sampled block
+typedef struct sample_block_t {
+	//! Block address
+	void* block;
+	//! Heap the block was allocated from
+	heap_t* heap;
+	//! Requested size
+	size_t size;
+	//! Sample generation of the heap when the block was sampled
+	uint64_t generation;
+	//! Cycle counter when allocated
+	uint64_t timestamp;
+	//! Index of stack trace
+	uint32_t stack;
+	//! Index of next block in hash bucket or free list
+	uint32_t next;
+	//! Size class of the block, SIZE_CLASS_COUNT for huge blocks
+	uint32_t size_class;
+	//! Index of lifetime histogram of the heap
+	uint32_t heap_slot;
+	//! ID of the heap the block was allocated from
+	uint32_t heap_id;
+	//! Flag set if the block is reported to the sampling hooks
+	uint32_t hooked;
+} sample_block_t;
+
+//! Sampling hook call prepared under the sample lock and made after the lock is released
+typedef struct sample_hook_call_t {
+	//! Hook to call, zero if no call
+	rpmalloc_sampling_hook_t hook;
+	//! Context of the hooks
+	void* context;
+	//! Sampled block
+	void* block;
+	//! Requested size
+	size_t size;
+	//! Size class of the block, SIZE_CLASS_COUNT for huge blocks
+	uint32_t size_class;
+	//! ID of the heap the block was allocated from
+	uint32_t heap_id;
+} sample_hook_call_t;
+
+//! Lifetime histogram of sampled blocks freed from a heap
+typedef struct sample_heap_t {
+	//! Heap ID, zero for the histogram of heaps not fitting in the table
+	uint32_t id;
+	//! Number of lifetimes recorded
+	size_t count;
+	//! Lifetime histogram
+	size_t lifetime[SAMPLE_LIFETIME_BUCKET_COUNT];
+} sample_heap_t;
+
+//! Unique stack trace of sampled allocations with live and accumulated counters
+typedef struct sample_stack_t {
+	//! Hash of frames
+	uint64_t hash;
+	//! Number of frames
+	uint32_t depth;
+	//! Index of next stack trace in hash bucket
+	uint32_t next;
+	//! Number of sampled allocations
+	size_t alloc_count;
+	//! Requested size of sampled allocations
+	size_t alloc_size;
+	//! Number of live sampled allocations
+	size_t live_count;
+	//! Requested size of live sampled allocations
+	size_t live_size;
+	//! Frames
+	void* frame[SAMPLE_STACK_DEPTH];
+} sample_stack_t;
+
+//! Sampling profile tables, entries are linked by index where zero is the null index
+typedef struct sample_table_t {
+	//! Sampling interval used when the profile was started
+	size_t interval;
+	//! Number of samples dropped because the tables were full
+	size_t dropped;
+	//! Memory map region offset
+	size_t offset;
+	//! Memory map size
+	size_t mapped_size;
+	//! Cycle counter when the profile was started
+	uint64_t start_ticks;
+	//! Monotonic time in nanoseconds when the profile was started
+	uint64_t start_time;
+	//! Number of heap lifetime histograms in use, the first is for heaps not fitting in the table
+	uint32_t heap_count;
+	//! Head of free block entry list
+	uint32_t block_free;
+	//! Number of block entries taken from the array
+	uint32_t block_count;
+	//! Number of stack trace entries
+	uint32_t stack_count;
+	//! Block hash buckets
+	uint32_t block_bucket[SAMPLE_BLOCK_BUCKET_COUNT];
+	//! Stack trace hash buckets
+	uint32_t stack_bucket[SAMPLE_STACK_BUCKET_COUNT];
+	//! Block entries
+	sample_block_t block[SAMPLE_BLOCK_COUNT + 1];
+	//! Stack trace entries
+	sample_stack_t stack[SAMPLE_STACK_COUNT + 1];
+	//! Lifetime histograms per size class, last is for huge blocks
+	size_t lifetime[SIZE_CLASS_COUNT + 1][SAMPLE_LIFETIME_BUCKET_COUNT];
+	//! Lifetime histograms per heap
+	sample_heap_t heap[SAMPLE_HEAP_COUNT + 1];
+} sample_table_t;
+
 _Static_assert(sizeof(page_t) <= PAGE_HEADER_SIZE, "Invalid page header size");
 _Static_assert(sizeof(span_t) <= SPAN_HEADER_SIZE, "Invalid span header size");
-_Static_assert(sizeof(heap_t) <= 4096, "Invalid heap size");
+// Per size class counters grow the heap beyond one memory page, latency histograms alone still fit
+_Static_assert(sizeof(heap_t) <= (ENABLE_STATISTICS ? 8192 : 4096), "Invalid heap size");
+_Static_assert(PAGE_HUGE + 1 == RPMALLOC_SMAPS_HEAPMETA, "Invalid mapped memory region categories");
+_Static_assert(SIZE_CLASS_COUNT == RPMALLOC_SIZE_CLASS_COUNT, "Invalid public size class count");
 
 ////////////
 ///
@@ -483,24 +1007,76 @@ _Static_assert(sizeof(heap_t) <= 4096, "Invalid heap size");
 static RPMALLOC_CACHE_ALIGNED heap_t global_heap_fallback;
 //! Default heap
 static heap_t* global_heap_default = &global_heap_fallback;
-//! Available heaps
-static heap_t* global_heap_queue;
-//! In use heaps
-static heap_t* global_heap_used;
-//! Lock for heap queue
-static atomic_uintptr_t global_heap_lock;
+//! Default allocator instance
+static instance_t global_instance;
 //! Heap ID counter
 static atomic_uint global_heap_id = 1;
+//! Thread lock index counter
+static atomic_uint global_thread_lock_count;
 //! Initialized flag
 static int global_rpmalloc_initialized;
-//! Memory interface
-static rpmalloc_interface_t* global_memory_interface;
 //! Default memory interface
 static rpmalloc_interface_t global_memory_interface_default;
-//! Current configuration
-static rpmalloc_config_t global_config = {0};
+#if RPMALLOC_FIRST_CLASS_HEAPS
+//! Default memory interface using huge pages, for instances configured to use huge pages
+static rpmalloc_interface_t global_memory_interface_huge;
+#endif
+//! Memory interfaces used by heaps, first is always the global memory interface
+static rpmalloc_interface_t* global_memory_interface_table[MEMORY_INTERFACE_COUNT];
+//! Number of memory interfaces in table
+static atomic_uint global_memory_interface_count;
 //! Main thread ID
 static uintptr_t global_main_thread_id;
+//! Bit map of span aligned addresses where a span is mapped, one bit per span size of address space
+static atomic_uintptr_t global_span_map[SPAN_MAP_WORD_COUNT];
+#if PLATFORM_POSIX
+//! Mapped shared memory segment of the statistics export
+static rpmalloc_statistics_export_t* global_statistics_export;
+//! Name of the shared memory segment of the statistics export
+static char global_statistics_export_name[256];
+//! Thread updating the statistics export
+static pthread_t global_statistics_export_thread;
+//! Lock and condition to wake the statistics export thread when stopping
+static pthread_mutex_t global_statistics_export_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t global_statistics_export_signal = PTHREAD_COND_INITIALIZER;
+//! Flag set to stop the statistics export thread
+static int global_statistics_export_stop;
+#endif
+#if ENABLE_LATENCY
+//! Cycle counter and monotonic time in nanoseconds at initialization, used to calibrate latency ticks
+static uint64_t global_latency_start_ticks;
+static uint64_t global_latency_start_time;
+#endif
+#if ENABLE_SAMPLING
+//! Mean number of bytes allocated between sampled allocations, zero if sampling is disabled
+static atomic_size_t global_sample_interval;
+//! Sampling profile tables, mapped when sampling is first started
+static sample_table_t* global_sample_table;
+//! Lock for sampling profile tables
+static atomic_uintptr_t global_sample_lock;
+//! Hooks called for sampled blocks, protected by the sample lock
+static rpmalloc_sampling_hooks_t global_sample_hooks;
+//! Number of hook calls prepared under the sample lock and not yet returned
+static atomic_uint global_sample_hook_calls;
+#endif
+#if RPMALLOC_FIRST_CLASS_HEAPS
+//! Mapped persistent heap region
+static heap_persistent_t* global_persistent_region;
+//! File descriptor of the mapped persistent heap region
+static int global_persistent_fd;
+//! Instance of the persistent heap
+static instance_t global_persistent_instance;
+//! Memory interface mapping spans from the persistent heap region
+static rpmalloc_interface_t global_memory_interface_persistent;
+//! Mapped cross process heap region
+static heap_ipc_t* global_ipc_region;
+//! Instance of the heaps in the cross process heap region
+static instance_t global_ipc_instance;
+//! Memory interface mapping spans from the cross process heap region
+static rpmalloc_interface_t global_memory_interface_ipc;
+//! Process ID, updated in child processes after fork
+static uint32_t global_process_id;
+#endif
 
 //! Size classes
 #define SCLASS(n) \
@@ -530,6 +1106,8 @@ static const size_class_t global_size_class[SIZE_CLASS_COUNT] = {
 
 //! OS huge page support
 static int os_huge_pages;
+//! OS huge page size, zero if huge pages are not supported or not detected
+static size_t os_huge_page_size;
 //! OS memory map granularity
 static size_t os_map_granularity;
 //! OS memory page size
@@ -541,6 +1119,29 @@ static size_t os_page_size;
 ///
 //////
 
+//! Get the memory interface used to map the span
+static inline rpmalloc_interface_t*
+span_memory_interface(span_t* span) {
+	return global_memory_interface_table[span->memory_interface];
+}
+
+//! Get the memory interface used by the heap to map spans
+static inline rpmalloc_interface_t*
+heap_memory_interface(heap_t* heap) {
+	return global_memory_interface_table[heap->memory_interface];
+}
+
+//! Get the instance of the heap. Heaps in a cross process heap region store no process local pointers, they
+//  use the cross process heap instance of the calling process
+static inline instance_t*
+heap_instance(heap_t* heap) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (UNEXPECTED(heap->memory_interface == MEMORY_INTERFACE_IPC))
+		return &global_ipc_instance;
+#endif
+	return heap->instance;
+}
+
 //! Current thread heap
 #if defined(_MSC_VER) && !defined(__clang__)
 #define TLS_MODEL
@@ -549,13 +1150,28 @@ static size_t os_page_size;
 #define TLS_MODEL __attribute__((tls_model("initial-exec")))
 #endif
 static _Thread_local heap_t* global_thread_heap TLS_MODEL = &global_heap_fallback;
+#if RPMALLOC_FIRST_CLASS_HEAPS
+//! Last used sub heap of a shared heap
+static _Thread_local heap_t* global_thread_shared_heap TLS_MODEL;
+#endif
+#if ENABLE_SAMPLING
+//! Flag set while the thread is in a sampling hook, blocks allocated and freed by hooks are not reported
+static _Thread_local int global_thread_sample_hook TLS_MODEL;
+#endif
+//! Index of the thread in the process used as shared heap lock owner, zero until first used
+static _Thread_local uint32_t global_thread_lock_index TLS_MODEL;
 
 static heap_t*
-heap_allocate(int first_class);
+heap_allocate(instance_t* instance, int first_class);
 
 static void
 heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count);
 
+#if RPMALLOC_FIRST_CLASS_HEAPS
+static void
+heap_huge_span_remove(heap_t* heap, span_t* span);
+#endif
+
 //! Fast thread ID
 static inline uintptr_t
 get_thread_id(void) {
@@ -606,7 +1222,7 @@ set_thread_heap(heap_t* heap) {
 
 static heap_t*
 get_thread_heap_allocate(void) {
-	heap_t* heap = heap_allocate(0);
+	heap_t* heap = heap_allocate(&global_instance, 0);
 	set_thread_heap(heap);
 	return heap;
 }
@@ -665,9 +1281,9 @@ get_page_type(uint32_t size_class) {
 
 static inline size_t
 get_page_aligned_size(size_t size) {
-	size_t unalign = size % global_config.page_size;
+	size_t unalign = size % global_instance.config.page_size;
 	if (unalign)
-		size += global_config.page_size - unalign;
+		size += global_instance.config.page_size - unalign;
 	return size;
 }
 
@@ -677,43 +1293,75 @@ get_page_aligned_size(size_t size) {
 ///
 //////
 
+//! Names of mapped memory region categories, indexed by page type followed by heap metadata
+static const char* const os_page_category_name[RPMALLOC_SMAPS_CATEGORY_COUNT] = {"small", "medium", "large", "huge",
+                                                                                 "heapmeta"};
+
+//! Copy a name part to the buffer, replacing characters not allowed in a region name, returns the new length
+static size_t
+os_page_name_append(char* name, size_t length, const char* part) {
+	for (; *part && (length + 1 < OS_PAGE_NAME_SIZE); ++part) {
+		char c = *part;
+		name[length++] = ((c <= ' ') || (c > '~') || (c == '[') || (c == ']') || (c == '\\') || (c == '$') ||
+		                  (c == '`'))
+		                     ? '_'
+		                     : c;
+	}
+	name[length] = 0;
+	return length;
+}
+
+//! Name the mapped memory region <prefix>-<category> or <prefix>-<category>:<label>, with prefix from the
+//  configured page name (rpmalloc if not set) so regions can be attributed in /proc/<pid>/smaps. Regions are
+//  left unnamed if no page name is configured and the label is null
 static void
-os_set_page_name(void* address, size_t size) {
+os_set_page_name(void* address, size_t size, int huge_pages, unsigned int category, const char* label) {
 #if defined(__linux__) || defined(__ANDROID__)
-	const char* name = os_huge_pages ? global_config.huge_page_name : global_config.page_name;
-	if ((address == MAP_FAILED) || !name)
+	const char* prefix = huge_pages ? global_instance.config.huge_page_name : global_instance.config.page_name;
+	if (!prefix && !label)
 		return;
+	char name[OS_PAGE_NAME_SIZE];
+	size_t length = os_page_name_append(name, 0, prefix ? prefix : "rpmalloc");
+	length = os_page_name_append(name, length, "-");
+	length = os_page_name_append(name, length, os_page_category_name[category]);
+	if (label && *label) {
+		length = os_page_name_append(name, length, ":");
+		length = os_page_name_append(name, length, label);
+	}
 	// If the kernel does not support CONFIG_ANON_VMA_NAME or if the call fails
 	// (e.g. invalid name) it is a no-op basically.
 	(void)prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, (uintptr_t)address, size, (uintptr_t)name);
 #else
 	(void)sizeof(size);
 	(void)sizeof(address);
+	(void)sizeof(huge_pages);
+	(void)sizeof(category);
+	(void)sizeof(label);
 #endif
 }
 
 static void*
-os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+os_mmap_pages(size_t size, size_t alignment, size_t* offset, size_t* mapped_size, int huge_pages) {
 	size_t map_size = size + alignment;
 #if PLATFORM_WINDOWS
 	// Ok to MEM_COMMIT - according to MSDN, "actual physical pages are not allocated unless/until the virtual addresses
 	// are actually accessed"
 	void* ptr =
-	    VirtualAlloc(0, map_size, (os_huge_pages ? MEM_LARGE_PAGES : 0) | MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	    VirtualAlloc(0, map_size, (huge_pages ? MEM_LARGE_PAGES : 0) | MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
 #else
 	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_UNINITIALIZED;
 #if defined(__APPLE__) && !TARGET_OS_IPHONE && !TARGET_OS_SIMULATOR
 	int fd = (int)VM_MAKE_TAG(240U);
-	if (os_huge_pages)
+	if (huge_pages)
 		fd |= VM_FLAGS_SUPERPAGE_SIZE_2MB;
 	void* ptr = mmap(0, map_size, PROT_READ | PROT_WRITE, flags, fd, 0);
 #elif defined(MAP_HUGETLB)
 	void* ptr = mmap(0, map_size, PROT_READ | PROT_WRITE | PROT_MAX(PROT_READ | PROT_WRITE),
-	                 (os_huge_pages ? MAP_HUGETLB : 0) | flags, -1, 0);
+	                 (huge_pages ? MAP_HUGETLB : 0) | flags, -1, 0);
 #if defined(MADV_HUGEPAGE)
 	// In some configurations, huge pages allocations might fail thus
 	// we fallback to normal allocations and promote the region as transparent huge page
-	if ((ptr == MAP_FAILED || !ptr) && os_huge_pages) {
+	if ((ptr == MAP_FAILED || !ptr) && huge_pages) {
 		ptr = mmap(0, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
 		if (ptr && ptr != MAP_FAILED) {
 			int prm = madvise(ptr, size, MADV_HUGEPAGE);
@@ -722,28 +1370,20 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 		}
 	}
 #endif
-	os_set_page_name(ptr, map_size);
 #elif defined(MAP_ALIGNED)
 	const size_t align = (sizeof(size_t) * 8) - (size_t)(__builtin_clzl(size - 1));
-	void* ptr = mmap(0, map_size, PROT_READ | PROT_WRITE, (os_huge_pages ? MAP_ALIGNED(align) : 0) | flags, -1, 0);
+	void* ptr = mmap(0, map_size, PROT_READ | PROT_WRITE, (huge_pages ? MAP_ALIGNED(align) : 0) | flags, -1, 0);
 #elif defined(MAP_ALIGN)
-	caddr_t base = (os_huge_pages ? (caddr_t)(4 << 20) : 0);
-	void* ptr = mmap(base, map_size, PROT_READ | PROT_WRITE, (os_huge_pages ? MAP_ALIGN : 0) | flags, -1, 0);
+	caddr_t base = (huge_pages ? (caddr_t)(4 << 20) : 0);
+	void* ptr = mmap(base, map_size, PROT_READ | PROT_WRITE, (huge_pages ? MAP_ALIGN : 0) | flags, -1, 0);
 #else
 	void* ptr = mmap(0, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
 #endif
 	if (ptr == MAP_FAILED)
 		ptr = 0;
 #endif
-	if (!ptr) {
-		if (global_memory_interface->map_fail_callback) {
-			if (global_memory_interface->map_fail_callback(map_size))
-				return os_mmap(size, alignment, offset, mapped_size);
-		} else {
-			rpmalloc_assert(ptr != 0, "Failed to map more virtual memory");
-		}
+	if (!ptr)
 		return 0;
-	}
 	if (alignment) {
 		size_t padding = ((uintptr_t)ptr & (uintptr_t)(alignment - 1));
 		if (padding)
@@ -755,7 +1395,7 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 	}
 	*mapped_size = map_size;
 #if ENABLE_STATISTICS
-	size_t page_count = map_size / global_config.page_size;
+	size_t page_count = map_size / global_instance.config.page_size;
 	size_t page_mapped_current =
 	    atomic_fetch_add_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed) + page_count;
 	size_t page_mapped_peak = atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed);
@@ -776,11 +1416,62 @@ os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
 	return ptr;
 }
 
+static void*
+os_mmap(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	return os_mmap_pages(size, alignment, offset, mapped_size, os_huge_pages);
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Map memory using huge pages, used by instances configured to use huge pages
+static void*
+os_mmap_huge(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	return os_mmap_pages(size, alignment, offset, mapped_size, os_huge_page_size ? 1 : 0);
+}
+
+#endif
+
+//! Name a memory region mapped through the given memory interface by category, only regions mapped by the
+//  default implementations are anonymous memory that can be named
+static void
+os_name_mapping(const rpmalloc_interface_t* memory_interface, void* address, size_t offset, size_t mapped_size,
+                unsigned int category, const char* label) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (memory_interface->memory_map == os_mmap_huge) {
+		os_set_page_name(pointer_offset(address, -(ptrdiff_t)offset), mapped_size, os_huge_page_size ? 1 : 0,
+		                 category, label);
+		return;
+	}
+#endif
+	if (memory_interface->memory_map == os_mmap)
+		os_set_page_name(pointer_offset(address, -(ptrdiff_t)offset), mapped_size, os_huge_pages, category, label);
+}
+
+//! Map memory through the given memory interface. If the default implementation fails to map memory, the map
+//  fail callback of the same interface decides if the call is retried
+static void*
+memory_interface_map(const rpmalloc_interface_t* memory_interface, size_t size, size_t alignment, size_t* offset,
+                     size_t* mapped_size) {
+	int is_default = (memory_interface->memory_map == os_mmap);
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	is_default = is_default || (memory_interface->memory_map == os_mmap_huge);
+#endif
+	while (1) {
+		void* ptr = memory_interface->memory_map(size, alignment, offset, mapped_size);
+		if (ptr || !is_default)
+			return ptr;
+		if (!memory_interface->map_fail_callback) {
+			rpmalloc_assert(ptr != 0, "Failed to map more virtual memory");
+			return 0;
+		}
+		if (!memory_interface->map_fail_callback(size + alignment))
+			return 0;
+	}
+}
+
 static void
 os_mcommit(void* address, size_t size) {
 #if ENABLE_DECOMMIT
-	if (global_config.disable_decommit)
-		return;
 #if PLATFORM_WINDOWS
 	if (!VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE)) {
 		rpmalloc_assert(0, "Failed to commit virtual memory block");
@@ -793,7 +1484,7 @@ os_mcommit(void* address, size_t size) {
 	*/
 #endif
 #if ENABLE_STATISTICS
-	size_t page_count = size / global_config.page_size;
+	size_t page_count = size / global_instance.config.page_size;
 	atomic_fetch_add_explicit(&global_statistics.page_commit, page_count, memory_order_relaxed);
 	size_t page_active_current =
 	    atomic_fetch_add_explicit(&global_statistics.page_active, page_count, memory_order_relaxed) + page_count;
@@ -812,8 +1503,6 @@ os_mcommit(void* address, size_t size) {
 static void
 os_mdecommit(void* address, size_t size) {
 #if ENABLE_DECOMMIT
-	if (global_config.disable_decommit)
-		return;
 #if PLATFORM_WINDOWS
 	if (!VirtualFree(address, size, MEM_DECOMMIT)) {
 		rpmalloc_assert(0, "Failed to decommit virtual memory block");
@@ -842,7 +1531,7 @@ os_mdecommit(void* address, size_t size) {
 	}
 #endif
 #if ENABLE_STATISTICS
-	size_t page_count = size / global_config.page_size;
+	size_t page_count = size / global_instance.config.page_size;
 	atomic_fetch_add_explicit(&global_statistics.page_decommit, page_count, memory_order_relaxed);
 	size_t page_active_current =
 	    atomic_fetch_sub_explicit(&global_statistics.page_active, page_count, memory_order_relaxed);
@@ -869,13 +1558,43 @@ os_munmap(void* address, size_t offset, size_t mapped_size) {
 		rpmalloc_assert(0, "Failed to unmap virtual memory block");
 #endif
 #if ENABLE_STATISTICS
-	size_t page_count = mapped_size / global_config.page_size;
+	size_t page_count = mapped_size / global_instance.config.page_size;
 	atomic_fetch_sub_explicit(&global_statistics.page_mapped, page_count, memory_order_relaxed);
 	atomic_fetch_sub_explicit(&global_statistics.page_active, page_count, memory_order_relaxed);
 #endif
 #endif
 }
 
+//! Pre-fault the memory pages in the given range
+static void
+os_mpopulate(void* address, size_t size) {
+#if defined(__linux__) || defined(__ANDROID__)
+	if (!madvise(address, size, MADV_POPULATE_WRITE))
+		return;
+#endif
+	// Fallback to touching each memory page, writing back the existing value to preserve content
+	volatile char* page = address;
+	volatile char* end = page + size;
+	while (page < end) {
+		*page = *page;
+		page += os_page_size;
+	}
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Lock the memory pages in the given range in physical memory
+static int
+os_mlock(void* address, size_t size) {
+#if PLATFORM_WINDOWS
+	return VirtualLock(address, size) ? 0 : -1;
+#else
+	return mlock(address, size);
+#endif
+}
+
+#endif
+
 ////////////
 ///
 /// Page interface
@@ -902,7 +1621,11 @@ page_get_size(page_t* page) {
 static inline int
 page_is_thread_heap(page_t* page) {
 #if RPMALLOC_FIRST_CLASS_HEAPS
-	return (!page->heap->owner_thread || (page->heap->owner_thread == get_thread_id()));
+	heap_t* heap = page->heap;
+	// Heaps in a cross process heap region are owned by a process, thread IDs are only unique within a process
+	if (UNEXPECTED(heap->owner_process != 0))
+		return (heap->owner_process == global_process_id);
+	return (!heap->owner_thread || (heap->owner_thread == get_thread_id()));
 #else
 	return (page->heap->owner_thread == get_thread_id());
 #endif
@@ -924,6 +1647,16 @@ page_block_index(page_t* page, block_t* block) {
 	return (uint32_t)pointer_diff(block, block_first) / page->block_size;
 }
 
+#if ENABLE_SAMPLING
+
+//! Get the bit of the block in the sampled block bitmap of the page
+static inline uint32_t
+page_sample_bit(page_t* page, void* block) {
+	return 1U << (page_block_index(page, block) & 15);
+}
+
+#endif
+
 static inline uint32_t
 page_block_from_thread_free_list(page_t* page, uint64_t token, block_t** block) {
 	uint32_t block_index = (uint32_t)(token & 0xFFFFFFFFULL);
@@ -954,13 +1687,31 @@ page_get_local_free_block(page_t* page) {
 	return block;
 }
 
+#if ENABLE_LATENCY
+
+//! Record the ticks spent in a slow path since the given start in the latency histogram of the heap
+static void
+latency_record(heap_t* heap, latency_path_t path, uint64_t start) {
+	uint64_t ticks = cpu_ticks() - start;
+	uint32_t bucket = ticks ? (uint32_t)(63 - __builtin_clzll(ticks)) : 0;
+	latency_histogram_t* histogram = heap->latency + path;
+	++histogram->count;
+	histogram->ticks += ticks;
+	++histogram->bucket[(bucket < LATENCY_BUCKET_COUNT) ? bucket : (LATENCY_BUCKET_COUNT - 1)];
+}
+
+#endif
+
 static inline void
 page_decommit_memory_pages(page_t* page) {
 	if (page->is_decommitted)
 		return;
-	void* extra_page = pointer_offset(page, global_config.page_size);
-	size_t extra_page_size = page_get_size(page) - global_config.page_size;
-	global_memory_interface->memory_decommit(extra_page, extra_page_size);
+	void* extra_page = pointer_offset(page, global_instance.config.page_size);
+	size_t extra_page_size = page_get_size(page) - global_instance.config.page_size;
+	span_memory_interface(page_get_span(page))->memory_decommit(extra_page, extra_page_size);
+	rpmalloc_trace4(page_decommit, page->heap->id, page->page_type, extra_page, extra_page_size);
+	atomic_fetch_sub_explicit(&page->heap->memory_committed, extra_page_size, memory_order_relaxed);
+	++page->heap->decommit_count;
 	page->is_decommitted = 1;
 }
 
@@ -968,9 +1719,15 @@ static inline void
 page_commit_memory_pages(page_t* page) {
 	if (!page->is_decommitted)
 		return;
-	void* extra_page = pointer_offset(page, global_config.page_size);
-	size_t extra_page_size = page_get_size(page) - global_config.page_size;
-	global_memory_interface->memory_commit(extra_page, extra_page_size);
+#if ENABLE_LATENCY
+	uint64_t latency_start = cpu_ticks();
+#endif
+	void* extra_page = pointer_offset(page, global_instance.config.page_size);
+	size_t extra_page_size = page_get_size(page) - global_instance.config.page_size;
+	span_memory_interface(page_get_span(page))->memory_commit(extra_page, extra_page_size);
+	rpmalloc_trace4(page_commit, page->heap->id, page->page_type, extra_page, extra_page_size);
+	atomic_fetch_add_explicit(&page->heap->memory_committed, extra_page_size, memory_order_relaxed);
+	++page->heap->commit_count;
 	page->is_decommitted = 0;
 #if ENABLE_DECOMMIT
 #if !defined(__APPLE__)
@@ -978,10 +1735,13 @@ page_commit_memory_pages(page_t* page) {
 	// will be zeroed out by OS - take advantage in zalloc/calloc calls and make sure
 	// blocks in first page is zeroed out
 	void* first_page = pointer_offset(page, PAGE_HEADER_SIZE);
-	memset(first_page, 0, global_config.page_size - PAGE_HEADER_SIZE);
+	memset(first_page, 0, global_instance.config.page_size - PAGE_HEADER_SIZE);
 	page->is_zero = 1;
 #endif
 #endif
+#if ENABLE_LATENCY
+	latency_record(page->heap, LATENCY_PAGE_COMMIT, latency_start);
+#endif
 }
 
 static void
@@ -1014,7 +1774,7 @@ page_full_to_available(page_t* page) {
 		page->next->prev = page;
 	heap->page_available[page->size_class] = page;
 	page->is_full = 0;
-	if (page->has_aligned_block == 0)
+	if ((page->has_aligned_block == 0) && (page->has_sampled_block == 0))
 		page->generic_free = 0;
 }
 
@@ -1065,13 +1825,36 @@ page_adopt_thread_free_block_list(page_t* page) {
 		return;
 	unsigned long long thread_free = atomic_load_explicit(&page->thread_free, memory_order_relaxed);
 	if (thread_free != 0) {
+#if ENABLE_LATENCY
+		uint64_t latency_start = cpu_ticks();
+#endif
+#if ENABLE_STATISTICS
+		size_t retry_count = 0;
+#endif
 		// Other threads can only replace with another valid list head, this will never change to 0 in other threads
 		while (!atomic_compare_exchange_weak_explicit(&page->thread_free, &thread_free, 0, memory_order_relaxed,
-		                                              memory_order_relaxed))
+		                                              memory_order_relaxed)) {
+#if ENABLE_STATISTICS
+			++retry_count;
+#endif
 			wait_spin();
+		}
+#if ENABLE_STATISTICS
+		if (retry_count)
+			atomic_fetch_add_explicit(&global_statistics.adopt_retry, retry_count, memory_order_relaxed);
+#endif
 		page->local_free_count = page_block_from_thread_free_list(page, thread_free, &page->local_free);
+		rpmalloc_trace3(thread_free_adopt, page->heap->id, page->size_class, page->local_free_count);
 		rpmalloc_assert(page->local_free_count <= page->block_used, "Page thread free list count internal failure");
 		page->block_used -= page->local_free_count;
+#if ENABLE_STATISTICS
+		uint32_t batch_bucket = (uint32_t)(31 - __builtin_clz(page->local_free_count | 1));
+		++page->heap->adopt_batch[(batch_bucket < ADOPT_BATCH_BUCKET_COUNT) ? batch_bucket
+		                                                                      : (ADOPT_BATCH_BUCKET_COUNT - 1)];
+#endif
+#if ENABLE_LATENCY
+		latency_record(page->heap, LATENCY_THREAD_FREE_ADOPT, latency_start);
+#endif
 	}
 }
 
@@ -1082,12 +1865,22 @@ page_put_thread_free_block(page_t* page, block_t* block) {
 	rpmalloc_assert(page_block(page, block_index) == block, "Block pointer is not aligned to start of block");
 	uint32_t list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
 	uint64_t thread_free = page_block_to_thread_free_list(page, block_index, list_size);
+#if ENABLE_STATISTICS
+	size_t retry_count = 0;
+#endif
 	while (!atomic_compare_exchange_weak_explicit(&page->thread_free, &prev_thread_free, thread_free,
 	                                              memory_order_relaxed, memory_order_relaxed)) {
+#if ENABLE_STATISTICS
+		++retry_count;
+#endif
 		list_size = page_block_from_thread_free_list(page, prev_thread_free, &block->next) + 1;
 		thread_free = page_block_to_thread_free_list(page, block_index, list_size);
 		wait_spin();
 	}
+#if ENABLE_STATISTICS
+	if (retry_count)
+		atomic_fetch_add_explicit(&global_statistics.thread_free_retry, retry_count, memory_order_relaxed);
+#endif
 	if ((list_size == 1) && page->is_full) {
 		// TODO: Add the page to heap list of potentially available pages
 		// rpmalloc_assert(0, "Not implemented");
@@ -1095,19 +1888,32 @@ page_put_thread_free_block(page_t* page, block_t* block) {
 		// Page is completely freed by multithreaded deallocations, clean up
 		// Safe since the page is marked as full and will never be touched by owning heap
 		rpmalloc_assert(page->is_full, "Mismatch between page full flag and thread free list");
+		// Pages in first class heaps are never migrated to keep them isolated from other heaps
 		heap_t* heap = get_thread_heap();
-		if (heap->page_free_commit_count[page->page_type] < page->heap->page_free_commit_count[page->page_type]) {
+		if (!page->heap->first_class &&
+		    (heap->page_free_commit_count[page->page_type] < page->heap->page_free_commit_count[page->page_type])) {
 			page_full_to_free_on_new_heap(page, heap);
 		} else {
 			heap = page->heap;
 			uintptr_t prev_head = atomic_load_explicit(&heap->page_free_thread[page->page_type], memory_order_relaxed);
 			page->next = (void*)prev_head;
+#if ENABLE_STATISTICS
+			retry_count = 0;
+#endif
 			while (!atomic_compare_exchange_weak_explicit(&heap->page_free_thread[page->page_type], &prev_head,
 			                                              (uintptr_t)page, memory_order_relaxed,
 			                                              memory_order_relaxed)) {
+#if ENABLE_STATISTICS
+				++retry_count;
+#endif
 				page->next = (void*)prev_head;
 				wait_spin();
 			}
+#if ENABLE_STATISTICS
+			if (retry_count)
+				atomic_fetch_add_explicit(&global_statistics.page_free_thread_retry, retry_count,
+				                          memory_order_relaxed);
+#endif
 		}
 	}
 }
@@ -1128,10 +1934,10 @@ page_initialize_blocks(page_t* page) {
 	++page->block_initialized;
 	++page->block_used;
 
-	if ((page->page_type == PAGE_SMALL) && (page->block_size < (global_config.page_size >> 1))) {
+	if ((page->page_type == PAGE_SMALL) && (page->block_size < (global_instance.config.page_size >> 1))) {
 		// Link up until next memory page in free list
-		void* memory_page_start = (void*)((uintptr_t)block & ~(uintptr_t)(global_config.page_size - 1));
-		void* memory_page_next = pointer_offset(memory_page_start, global_config.page_size);
+		void* memory_page_start = (void*)((uintptr_t)block & ~(uintptr_t)(global_instance.config.page_size - 1));
+		void* memory_page_next = pointer_offset(memory_page_start, global_instance.config.page_size);
 		block_t* free_block = pointer_offset(block, page->block_size);
 		block_t* first_block = free_block;
 		block_t* last_block = free_block;
@@ -1154,9 +1960,9 @@ page_initialize_blocks(page_t* page) {
 	return block;
 }
 
+//! Allocate a block from the page, setting the is_zero flag if the block memory is known to be zero
 static inline RPMALLOC_ALLOCATOR void*
-page_allocate_block(page_t* page, unsigned int zero) {
-	unsigned int is_zero = 0;
+page_allocate_block(page_t* page, unsigned int* is_zero) {
 	block_t* block = (page->local_free != 0) ? page_get_local_free_block(page) : 0;
 	if (UNEXPECTED(block == 0)) {
 		if (atomic_load_explicit(&page->thread_free, memory_order_relaxed) != 0) {
@@ -1165,7 +1971,7 @@ page_allocate_block(page_t* page, unsigned int zero) {
 		}
 		if (block == 0) {
 			block = page_initialize_blocks(page);
-			is_zero = page->is_zero;
+			*is_zero = page->is_zero;
 		}
 	}
 
@@ -1184,13 +1990,6 @@ page_allocate_block(page_t* page, unsigned int zero) {
 		page_available_to_full(page);
 	}
 
-	if (zero) {
-		if (!is_zero)
-			memset(block, 0, page->block_size);
-		else
-			*(uintptr_t*)block = 0;
-	}
-
 	return block;
 }
 
@@ -1224,14 +2023,17 @@ span_allocate_page(span_t* span) {
 	++span->page_initialized;
 
 	page->page_type = span->page_type;
-	page->is_zero = 1;
+	page->is_zero = (span->page_initialized > span->page_dirty) ? 1 : 0;
 	page->heap = heap;
+	// Pages initialized before the span was reset are still committed and accounted
+	if (page->is_zero)
+		atomic_fetch_add_explicit(&heap->memory_committed, span->page_size, memory_order_relaxed);
 	rpmalloc_assert(page_is_thread_heap(page), "Page owner thread mismatch");
 
 	if (span->page_initialized == span->page_count) {
 		// Span fully utilized
 		rpmalloc_assert(span == heap->span_partial[span->page_type], "Span partial tracking out of sync");
-		heap->span_partial[span->page_type] = 0;
+		heap->span_partial[span->page_type] = span->next;
 
 		span->next = heap->span_used[span->page_type];
 		heap->span_used[span->page_type] = span;
@@ -1240,72 +2042,552 @@ span_allocate_page(span_t* span) {
 	return page;
 }
 
-static NOINLINE void
-span_deallocate_block(span_t* span, page_t* page, void* block) {
-	if (UNEXPECTED(page->page_type == PAGE_HUGE)) {
-		global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
-		return;
-	}
-
-	if (page->has_aligned_block) {
-		// Realign pointer to block start
-		block = page_block_realign(page, block);
-	}
-
-	int is_thread_local = page_is_thread_heap(page);
-	if (EXPECTED(is_thread_local != 0)) {
-		page_put_local_free_block(page, block);
-	} else {
-		// Multithreaded deallocation, push to deferred deallocation list.
-		page_put_thread_free_block(page, block);
-	}
+//! Mark the span as mapped in the span map, which covers the first span size of a huge block mapping
+static inline void
+span_map_insert(span_t* span) {
+	uintptr_t index = (uintptr_t)span >> SPAN_SIZE_SHIFT;
+	if (index < SPAN_MAP_BITS)
+		atomic_fetch_or_explicit(&global_span_map[index / SPAN_MAP_WORD_BITS],
+		                         (uintptr_t)1 << (index % SPAN_MAP_WORD_BITS), memory_order_release);
 }
 
-////////////
-///
-/// Block interface
-///
-//////
+//! Mark the span as unmapped in the span map
+static inline void
+span_map_remove(span_t* span) {
+	uintptr_t index = (uintptr_t)span >> SPAN_SIZE_SHIFT;
+	if (index < SPAN_MAP_BITS)
+		atomic_fetch_and_explicit(&global_span_map[index / SPAN_MAP_WORD_BITS],
+		                          ~((uintptr_t)1 << (index % SPAN_MAP_WORD_BITS)), memory_order_release);
+}
 
-static inline span_t*
-block_get_span(block_t* block) {
-	return (span_t*)((uintptr_t)block & SPAN_MASK);
+//! Check if the pointer is in a span mapped by this process, lock free
+static inline int
+span_map_contains(const void* ptr) {
+	uintptr_t index = (uintptr_t)ptr >> SPAN_SIZE_SHIFT;
+	if (index >= SPAN_MAP_BITS)
+		return 0;
+	uintptr_t word = atomic_load_explicit(&global_span_map[index / SPAN_MAP_WORD_BITS], memory_order_acquire);
+	return (int)((word >> (index % SPAN_MAP_WORD_BITS)) & 1);
 }
 
-static inline void
-block_deallocate(block_t* block) {
-	span_t* span = (span_t*)((uintptr_t)block & SPAN_MASK);
-	page_t* page = span_get_page_from_block(span, block);
-	const int is_thread_local = page_is_thread_heap(page);
+//! Unmap the memory of a span and remove it from the span map
+static void
+span_unmap_memory(span_t* span) {
+	span_map_remove(span);
+	span_memory_interface(span)->memory_unmap(span, span->offset, span->mapped_size);
+}
 
-	// Optimized path for thread local free with non-huge block in page
-	// that has no aligned blocks
-	if (EXPECTED(is_thread_local != 0)) {
-		if (EXPECTED(page->generic_free == 0)) {
-			// Page is not huge, not full and has no aligned block - fast path
-			block->next = page->local_free;
-			page->local_free = block;
-			++page->local_free_count;
-			if (UNEXPECTED(--page->block_used == 0))
-				page_available_to_free(page);
-		} else {
-			span_deallocate_block(span, page, block);
-		}
-	} else {
-		span_deallocate_block(span, page, block);
+//! Get the number of bytes committed in the pages of the span initialized since it was mapped
+static size_t
+span_committed_size(span_t* span) {
+	if (span->page_type == PAGE_HUGE)
+		return (size_t)span->page_size * (size_t)span->page_count;
+	uint32_t page_count = (span->page_initialized > span->page_dirty) ? span->page_initialized : span->page_dirty;
+	size_t committed = 0;
+	for (uint32_t ipage = 0; ipage < page_count; ++ipage) {
+		page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+		committed += page->is_decommitted ? global_instance.config.page_size : span->page_size;
 	}
+	return committed;
 }
 
+//! Get the number of bytes committed when the next page of the span is initialized
 static inline size_t
-block_usable_size(block_t* block) {
-	span_t* span = (span_t*)((uintptr_t)block & SPAN_MASK);
-	if (EXPECTED(span->page_type <= PAGE_LARGE)) {
-		page_t* page = span_get_page_from_block(span, block);
-		void* blocks_start = pointer_offset(page, PAGE_HEADER_SIZE);
-		return page->block_size - ((size_t)pointer_diff(block, blocks_start) % page->block_size);
-	} else {
-		return ((size_t)span->page_size * (size_t)span->page_count) - (size_t)pointer_diff(block, span);
-	}
+span_page_commit_size(span_t* span) {
+	if (span->page_initialized >= span->page_dirty)
+		return span->page_size;
+	page_t* page = pointer_offset(span, (size_t)span->page_size * span->page_initialized);
+	return page->is_decommitted ? (span->page_size - global_instance.config.page_size) : 0;
+}
+
+//! Unmap a span owned by a heap
+static void
+span_unmap(span_t* span) {
+	rpmalloc_trace4(span_unmap, span->heap->id, span->page_type, span, span->mapped_size);
+	atomic_fetch_sub_explicit(&span->heap->memory_usage, span->mapped_size, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&span->heap->memory_committed, span_committed_size(span), memory_order_relaxed);
+	atomic_fetch_add_explicit(&span->heap->unmap_count, 1, memory_order_relaxed);
+	span_unmap_memory(span);
+}
+
+#if ENABLE_STATISTICS
+
+//! Account the requested size of an allocation in the heap, the block size of the size class is the
+//  number of bytes actually allocated, the difference is lost to size class rounding
+static void
+statistics_requested(heap_t* heap, size_t size) {
+	if (heap == global_heap_default)
+		return;
+	uint32_t size_class = get_size_class(size);
+	if (size_class >= SIZE_CLASS_COUNT) {
+		size_class = SIZE_CLASS_COUNT;
+		heap->huge_allocated_total += get_page_aligned_size(size + SPAN_HEADER_SIZE) - SPAN_HEADER_SIZE;
+	}
+	++heap->alloc_total[size_class];
+	heap->requested_total[size_class] += size;
+}
+
+//! Remove the alignment padding of an aligned allocation of the given size from the requested size accounted when
+//  allocating the padded block, only the size requested by the caller is requested
+static void
+statistics_requested_aligned(heap_t* heap, size_t size, size_t alignment) {
+	if (heap == global_heap_default)
+		return;
+	uint32_t size_class = get_size_class(size + alignment);
+	if (size_class >= SIZE_CLASS_COUNT)
+		size_class = SIZE_CLASS_COUNT;
+	heap->requested_total[size_class] -= alignment;
+}
+
+//! Count a cross thread free by the calling thread into a page owned by another heap, recording every
+//  REMOTE_FREE_SAMPLE_PERIOD free from the calling heap in the heap pair table
+static void
+statistics_remote_free(page_t* page) {
+	heap_t* heap = get_thread_heap();
+	if (heap == global_heap_default)
+		return;
+	++heap->remote_free_count;
+	if (++heap->remote_free_sample < REMOTE_FREE_SAMPLE_PERIOD)
+		return;
+	heap->remote_free_sample = 0;
+	uint32_t heap_free = heap->id;
+	uint32_t heap_owner = page->heap->id;
+	uint32_t index = ((heap_free * 0x9E3779B1U) ^ heap_owner) & (REMOTE_FREE_PAIR_COUNT - 1);
+	uintptr_t lock = 0;
+	while (!atomic_compare_exchange_strong(&global_statistics_remote_free_lock, &lock, 1)) {
+		lock = 0;
+		wait_spin();
+	}
+	uint32_t iprobe = 0;
+	for (; iprobe < REMOTE_FREE_PAIR_COUNT; ++iprobe) {
+		statistics_remote_free_t* entry = global_statistics_remote_free + index;
+		if (!entry->heap_free) {
+			entry->heap_free = heap_free;
+			entry->heap_owner = heap_owner;
+		}
+		if ((entry->heap_free == heap_free) && (entry->heap_owner == heap_owner)) {
+			++entry->count;
+			break;
+		}
+		index = (index + 1) & (REMOTE_FREE_PAIR_COUNT - 1);
+	}
+	if (iprobe == REMOTE_FREE_PAIR_COUNT)
+		++global_statistics_remote_free_other;
+	atomic_store_explicit(&global_statistics_remote_free_lock, 0, memory_order_release);
+}
+
+#endif
+
+#if ENABLE_SAMPLING
+
+////////////
+///
+/// Sampling heap profiler
+///
+//////
+
+static void
+sample_lock_acquire(void) {
+	uintptr_t lock = 0;
+	while (!atomic_compare_exchange_strong(&global_sample_lock, &lock, 1)) {
+		lock = 0;
+		wait_spin();
+	}
+}
+
+static void
+sample_lock_release(void) {
+	atomic_store_explicit(&global_sample_lock, 0, memory_order_release);
+}
+
+//! Get the lifetime histogram bucket of the given number of ticks
+static inline uint32_t
+sample_lifetime_bucket(uint64_t ticks) {
+	return ticks ? (uint32_t)(63 - __builtin_clzll(ticks)) : 0;
+}
+
+//! Find or add the lifetime histogram of the heap with the given ID
+static uint32_t
+sample_heap_slot(sample_table_t* table, uint32_t id) {
+	for (uint32_t islot = 1; islot < table->heap_count; ++islot) {
+		if (table->heap[islot].id == id)
+			return islot;
+	}
+	if (table->heap_count > SAMPLE_HEAP_COUNT)
+		return 0;
+	if (!table->heap_count)
+		table->heap_count = 1;
+	table->heap[table->heap_count].id = id;
+	return table->heap_count++;
+}
+
+static inline uint32_t
+sample_block_bucket(void* block) {
+	uintptr_t value = (uintptr_t)block >> 4;
+	return (uint32_t)((value ^ (value >> 12) ^ (value >> 24)) & (SAMPLE_BLOCK_BUCKET_COUNT - 1));
+}
+
+//! Find or add the stack trace in the table, returns zero if the table is full
+static uint32_t
+sample_stack_find(sample_table_t* table, void** frame, uint32_t depth) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (uint32_t iframe = 0; iframe < depth; ++iframe)
+		hash = (hash ^ (uint64_t)(uintptr_t)frame[iframe]) * 0x100000001b3ULL;
+	uint32_t bucket = (uint32_t)(hash ^ (hash >> 32)) & (SAMPLE_STACK_BUCKET_COUNT - 1);
+	for (uint32_t index = table->stack_bucket[bucket]; index; index = table->stack[index].next) {
+		sample_stack_t* stack = table->stack + index;
+		if ((stack->hash == hash) && (stack->depth == depth) && !memcmp(stack->frame, frame, depth * sizeof(void*)))
+			return index;
+	}
+	if (table->stack_count == SAMPLE_STACK_COUNT)
+		return 0;
+	uint32_t index = ++table->stack_count;
+	sample_stack_t* stack = table->stack + index;
+	stack->hash = hash;
+	stack->depth = depth;
+	memcpy(stack->frame, frame, depth * sizeof(void*));
+	stack->next = table->stack_bucket[bucket];
+	table->stack_bucket[bucket] = index;
+	return index;
+}
+
+//! Remove the block entry linked from the given link and account it as freed
+static void
+sample_block_remove(sample_table_t* table, uint32_t* link) {
+	uint32_t index = *link;
+	sample_block_t* entry = table->block + index;
+	sample_stack_t* stack = table->stack + entry->stack;
+	--stack->live_count;
+	stack->live_size -= entry->size;
+	*link = entry->next;
+	entry->block = 0;
+	entry->next = table->block_free;
+	table->block_free = index;
+}
+
+//! Prepare a call of the given hook for the sampled block entry
+static void
+sample_hook_prepare(sample_hook_call_t* call, rpmalloc_sampling_hook_t hook, const sample_block_t* entry) {
+	call->hook = hook;
+	if (hook)
+		atomic_fetch_add_explicit(&global_sample_hook_calls, 1, memory_order_relaxed);
+	call->context = global_sample_hooks.context;
+	call->block = entry->block;
+	call->size = entry->size;
+	call->size_class = entry->size_class;
+	call->heap_id = entry->heap_id;
+}
+
+//! Make a prepared hook call, blocks allocated and freed by the hook are not reported to avoid recursion
+static void
+sample_hook_call(const sample_hook_call_t* call) {
+	if (!call->hook)
+		return;
+	global_thread_sample_hook = 1;
+	call->hook(call->context, call->block, call->size,
+	           (call->size_class < SIZE_CLASS_COUNT) ? call->size_class : RPMALLOC_SAMPLING_HUGE_CLASS, call->heap_id);
+	global_thread_sample_hook = 0;
+	atomic_fetch_sub_explicit(&global_sample_hook_calls, 1, memory_order_release);
+}
+
+//! Record a sampled block allocated with the given stack trace, returns zero if the tables are full. If the block
+//  is reported to the sampling hooks the allocation hook call is prepared in the given call
+static int
+sample_block_insert(heap_t* heap, void* block, size_t size, uint32_t size_class, void** frame, uint32_t depth,
+                    sample_hook_call_t* call) {
+	int result = 0;
+	uint64_t timestamp = cpu_ticks();
+	call->hook = 0;
+	sample_lock_acquire();
+	sample_table_t* table = global_sample_table;
+	if (table) {
+		uint32_t* bucket = table->block_bucket + sample_block_bucket(block);
+		// A stale entry for the same address was never freed through the allocator
+		for (uint32_t* link = bucket; *link; link = &table->block[*link].next) {
+			if (table->block[*link].block == block) {
+				sample_block_remove(table, link);
+				break;
+			}
+		}
+		uint32_t index = table->block_free;
+		if (index)
+			table->block_free = table->block[index].next;
+		else if (table->block_count < SAMPLE_BLOCK_COUNT)
+			index = ++table->block_count;
+		uint32_t stack_index = index ? sample_stack_find(table, frame, depth) : 0;
+		if (stack_index) {
+			sample_stack_t* stack = table->stack + stack_index;
+			++stack->alloc_count;
+			stack->alloc_size += size;
+			++stack->live_count;
+			stack->live_size += size;
+			sample_block_t* entry = table->block + index;
+			entry->block = block;
+			entry->heap = heap;
+			entry->size = size;
+			entry->generation = ++heap->sample_generation;
+			entry->timestamp = timestamp;
+			entry->stack = stack_index;
+			entry->size_class = size_class;
+			entry->heap_slot = sample_heap_slot(table, heap->id);
+			entry->heap_id = heap->id;
+			entry->hooked = (global_sample_hooks.alloc || global_sample_hooks.free) && !global_thread_sample_hook;
+			entry->next = *bucket;
+			*bucket = index;
+			if (entry->hooked)
+				sample_hook_prepare(call, global_sample_hooks.alloc, entry);
+			result = 1;
+		} else {
+			if (index) {
+				table->block[index].next = table->block_free;
+				table->block_free = index;
+			}
+			++table->dropped;
+		}
+	}
+	sample_lock_release();
+	return result;
+}
+
+//! Account the block as freed if it is a sampled block, called for all blocks freed in pages with sampled blocks.
+//  Records the lifetime of the block in the histograms of the size class and heap.
+static void
+sample_block_free(void* block) {
+	uint64_t timestamp = cpu_ticks();
+	sample_hook_call_t call;
+	call.hook = 0;
+	sample_lock_acquire();
+	sample_table_t* table = global_sample_table;
+	if (table) {
+		for (uint32_t* link = table->block_bucket + sample_block_bucket(block); *link;
+		     link = &table->block[*link].next) {
+			sample_block_t* entry = table->block + *link;
+			if (entry->block == block) {
+				uint64_t lifetime = (timestamp > entry->timestamp) ? (timestamp - entry->timestamp) : 0;
+				uint32_t lifetime_bucket = sample_lifetime_bucket(lifetime);
+				++table->lifetime[entry->size_class][lifetime_bucket];
+				sample_heap_t* heap = table->heap + entry->heap_slot;
+				++heap->count;
+				++heap->lifetime[lifetime_bucket];
+				if (entry->hooked && !global_thread_sample_hook)
+					sample_hook_prepare(&call, global_sample_hooks.free, entry);
+				sample_block_remove(table, link);
+				break;
+			}
+		}
+	}
+	sample_lock_release();
+	sample_hook_call(&call);
+}
+
+//! Update the requested size of the block if it is a sampled block, called when a block is resized in place
+static void
+sample_block_resize(void* block, size_t size) {
+	span_t* span = (span_t*)((uintptr_t)block & SPAN_MASK);
+	page_t* page = (span->page_type == PAGE_HUGE) ? &span->page : span_get_page_from_block(span, block);
+	if (EXPECTED(page->has_sampled_block == 0))
+		return;
+	if (span->page_type == PAGE_HUGE) {
+		block = pointer_offset(span, SPAN_HEADER_SIZE);
+	} else {
+		if (!(page->sample_map & page_sample_bit(page, block)))
+			return;
+		block = page_block(page, page_block_index(page, block));
+	}
+	sample_lock_acquire();
+	sample_table_t* table = global_sample_table;
+	if (table) {
+		for (uint32_t index = table->block_bucket[sample_block_bucket(block)]; index;
+		     index = table->block[index].next) {
+			sample_block_t* entry = table->block + index;
+			if (entry->block == block) {
+				sample_stack_t* stack = table->stack + entry->stack;
+				stack->live_size = (stack->live_size - entry->size) + size;
+				entry->size = size;
+				break;
+			}
+		}
+	}
+	sample_lock_release();
+}
+
+//! Drop sampled blocks of the heap sampled after the given generation or in the address range, when memory is
+//  released without freeing blocks
+static void
+sample_purge(heap_t* heap, uint64_t generation, void* start, size_t size) {
+	sample_hook_call_t call[SAMPLE_PURGE_HOOK_COUNT];
+	uint32_t call_count;
+	do {
+		// Hooks are called without the lock held, purge in passes until no more hook calls are pending
+		call_count = 0;
+		sample_lock_acquire();
+		sample_table_t* table = global_sample_table;
+		for (uint32_t ibucket = 0; table && (ibucket < SAMPLE_BLOCK_BUCKET_COUNT); ++ibucket) {
+			uint32_t* link = table->block_bucket + ibucket;
+			while (*link && (call_count < SAMPLE_PURGE_HOOK_COUNT)) {
+				sample_block_t* entry = table->block + *link;
+				if ((heap && (entry->heap == heap) && (entry->generation > generation)) ||
+				    (((uintptr_t)entry->block >= (uintptr_t)start) &&
+				     ((uintptr_t)entry->block - (uintptr_t)start < size))) {
+					if (entry->hooked && global_sample_hooks.free && !global_thread_sample_hook)
+						sample_hook_prepare(call + call_count++, global_sample_hooks.free, entry);
+					sample_block_remove(table, link);
+				} else {
+					link = &entry->next;
+				}
+			}
+		}
+		sample_lock_release();
+		for (uint32_t icall = 0; icall < call_count; ++icall)
+			sample_hook_call(call + icall);
+	} while (call_count == SAMPLE_PURGE_HOOK_COUNT);
+}
+
+//! Capture the stack trace of the calling allocation, skipping the frames inside the allocator sampling path
+static NOINLINE uint32_t
+sample_capture_stack(void** frame) {
+#if PLATFORM_WINDOWS
+	return (uint32_t)CaptureStackBackTrace(2, SAMPLE_STACK_DEPTH, frame, 0);
+#elif defined(__GLIBC__) || defined(__APPLE__)
+	void* trace[SAMPLE_STACK_DEPTH + 2];
+	int depth = backtrace(trace, SAMPLE_STACK_DEPTH + 2);
+	if (depth <= 2)
+		return 0;
+	memcpy(frame, trace + 2, (size_t)(depth - 2) * sizeof(void*));
+	return (uint32_t)(depth - 2);
+#else
+	frame[0] = __builtin_return_address(0);
+	return 1;
+#endif
+}
+
+//! Approximate base 2 logarithm of a positive value
+static double
+sample_log2(double value) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	int exponent = (int)((bits >> 52) & 0x7FF) - 1023;
+	bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+	double mantissa;
+	memcpy(&mantissa, &bits, sizeof(mantissa));
+	// log2(m) = 2 * atanh((m - 1) / (m + 1)) / ln(2), series converges quickly for m in [1, 2)
+	double ratio = (mantissa - 1.0) / (mantissa + 1.0);
+	double square = ratio * ratio;
+	double series = ratio * (1.0 + square * (1.0 / 3.0 + square * (1.0 / 5.0 + square * (1.0 / 7.0 + square / 9.0))));
+	return (double)exponent + (series * 2.8853900817779268);
+}
+
+//! Get the number of bytes allocated until the next sampled allocation, exponentially distributed with the
+//  given mean so sampling is a Poisson process over allocated bytes
+static size_t
+sample_next_interval(heap_t* heap, size_t interval) {
+	uint64_t random = heap->sample_random;
+	random ^= random >> 12;
+	random ^= random << 25;
+	random ^= random >> 27;
+	heap->sample_random = random;
+	// Uniform value in (0, 1] from the top 53 bits of the xorshift64* output
+	double uniform = ((double)((random * 0x2545F4914F6CDD1DULL) >> 11) + 1.0) * (1.0 / 9007199254740992.0);
+	double next = -sample_log2(uniform) * 0.6931471805599453 * (double)interval;
+	if (next > (double)(SIZE_MAX / 2))
+		return SIZE_MAX / 2;
+	return (size_t)next + 1;
+}
+
+#endif
+
+static NOINLINE void
+span_deallocate_block(span_t* span, page_t* page, void* block) {
+	if (UNEXPECTED(page->page_type == PAGE_HUGE)) {
+#if ENABLE_SAMPLING
+		if (UNEXPECTED(page->has_sampled_block != 0))
+			sample_block_free(pointer_offset(span, SPAN_HEADER_SIZE));
+#endif
+#if ENABLE_LATENCY
+		// Huge blocks can be freed by any thread, the histograms are only updated by the thread owning the heap so
+		// always record in the thread heap of the freeing thread, never in the heap owning the block
+		heap_t* heap = get_thread_heap();
+		uint64_t latency_start = cpu_ticks();
+#endif
+		rpmalloc_trace3(huge_free, span->heap->id, block, (size_t)span->page_size * (size_t)span->page_count);
+#if RPMALLOC_FIRST_CLASS_HEAPS
+		heap_huge_span_remove(span->heap, span);
+#endif
+		span_unmap(span);
+#if ENABLE_LATENCY
+		// The fallback heap is shared by all threads without a heap
+		if (heap != global_heap_default)
+			latency_record(heap, LATENCY_HUGE_UNMAP, latency_start);
+#endif
+		return;
+	}
+
+	if (page->has_aligned_block) {
+		// Realign pointer to block start
+		block = page_block_realign(page, block);
+	}
+#if ENABLE_SAMPLING
+	if (UNEXPECTED(page->has_sampled_block != 0) && (page->sample_map & page_sample_bit(page, block)))
+		sample_block_free(block);
+#endif
+
+	int is_thread_local = page_is_thread_heap(page);
+	if (EXPECTED(is_thread_local != 0)) {
+		page_put_local_free_block(page, block);
+	} else {
+		// Multithreaded deallocation, push to deferred deallocation list.
+#if ENABLE_STATISTICS
+		statistics_remote_free(page);
+#endif
+		page_put_thread_free_block(page, block);
+	}
+}
+
+////////////
+///
+/// Block interface
+///
+//////
+
+static inline span_t*
+block_get_span(block_t* block) {
+	return (span_t*)((uintptr_t)block & SPAN_MASK);
+}
+
+static inline void
+block_deallocate(block_t* block) {
+	span_t* span = (span_t*)((uintptr_t)block & SPAN_MASK);
+	page_t* page = span_get_page_from_block(span, block);
+	const int is_thread_local = page_is_thread_heap(page);
+
+	// Optimized path for thread local free with non-huge block in page
+	// that has no aligned blocks
+	if (EXPECTED(is_thread_local != 0)) {
+		if (EXPECTED(page->generic_free == 0)) {
+			// Page is not huge, not full and has no aligned block - fast path
+			block->next = page->local_free;
+			page->local_free = block;
+			++page->local_free_count;
+			if (UNEXPECTED(--page->block_used == 0))
+				page_available_to_free(page);
+		} else {
+			span_deallocate_block(span, page, block);
+		}
+	} else {
+		span_deallocate_block(span, page, block);
+	}
+}
+
+static inline size_t
+block_usable_size(block_t* block) {
+	span_t* span = (span_t*)((uintptr_t)block & SPAN_MASK);
+	if (EXPECTED(span->page_type <= PAGE_LARGE)) {
+		page_t* page = span_get_page_from_block(span, block);
+		void* blocks_start = pointer_offset(page, PAGE_HEADER_SIZE);
+		return page->block_size - ((size_t)pointer_diff(block, blocks_start) % page->block_size);
+	} else {
+		return ((size_t)span->page_size * (size_t)span->page_count) - (size_t)pointer_diff(block, span);
+	}
 }
 
 ////////////
@@ -1315,22 +2597,53 @@ block_usable_size(block_t* block) {
 //////
 
 static inline void
-heap_lock_acquire(void) {
+heap_lock_acquire(instance_t* instance) {
 	uintptr_t lock = 0;
 	uintptr_t this_lock = get_thread_id();
-	while (!atomic_compare_exchange_strong(&global_heap_lock, &lock, this_lock)) {
+	while (!atomic_compare_exchange_strong(&instance->heap_lock, &lock, this_lock)) {
 		lock = 0;
 		wait_spin();
 	}
 }
 
 static inline void
-heap_lock_release(void) {
-	rpmalloc_assert((uintptr_t)atomic_load_explicit(&global_heap_lock, memory_order_relaxed) == get_thread_id(),
+heap_lock_release(instance_t* instance) {
+	rpmalloc_assert((uintptr_t)atomic_load_explicit(&instance->heap_lock, memory_order_relaxed) == get_thread_id(),
 	                "Bad heap lock");
-	atomic_store_explicit(&global_heap_lock, 0, memory_order_release);
+	atomic_store_explicit(&instance->heap_lock, 0, memory_order_release);
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Find or add the memory interface in the memory interface table, using the OS entry points if the interface
+//  has no map and unmap functions. Returns the index in the table, or -1 if the table is full
+static int
+memory_interface_register(rpmalloc_interface_t* memory_interface) {
+	if (!memory_interface->memory_map || !memory_interface->memory_unmap) {
+		memory_interface->memory_map = os_mmap;
+		memory_interface->memory_commit = os_mcommit;
+		memory_interface->memory_decommit = os_mdecommit;
+		memory_interface->memory_unmap = os_munmap;
+	}
+	heap_lock_acquire(&global_instance);
+	unsigned int count = atomic_load_explicit(&global_memory_interface_count, memory_order_relaxed);
+	unsigned int index = 0;
+	while ((index < count) && (global_memory_interface_table[index] != memory_interface))
+		++index;
+	if (index == count) {
+		if (count == MEMORY_INTERFACE_IPC) {
+			heap_lock_release(&global_instance);
+			return -1;
+		}
+		global_memory_interface_table[index] = memory_interface;
+		atomic_store_explicit(&global_memory_interface_count, count + 1, memory_order_release);
+	}
+	heap_lock_release(&global_instance);
+	return (int)index;
 }
 
+#endif
+
 static inline heap_t*
 heap_initialize(void* block) {
 	heap_t* heap = block;
@@ -1340,14 +2653,17 @@ heap_initialize(void* block) {
 }
 
 static heap_t*
-heap_allocate_new(void) {
+heap_allocate_new(instance_t* instance) {
 	size_t heap_size = get_page_aligned_size(sizeof(heap_t));
 	size_t offset = 0;
 	size_t mapped_size = 0;
-	block_t* block = global_memory_interface->memory_map(heap_size, 0, &offset, &mapped_size);
+	block_t* block = memory_interface_map(instance->memory_interface, heap_size, 0, &offset, &mapped_size);
+	if (!block)
+		return 0;
 	heap_t* heap = heap_initialize((void*)block);
 	heap->offset = (uint32_t)offset;
 	heap->mapped_size = mapped_size;
+	os_name_mapping(instance->memory_interface, block, offset, mapped_size, RPMALLOC_SMAPS_HEAPMETA, 0);
 #if ENABLE_STATISTICS
 	atomic_fetch_add_explicit(&global_statistics.heap_count, 1, memory_order_relaxed);
 #endif
@@ -1356,60 +2672,111 @@ heap_allocate_new(void) {
 
 static void
 heap_unmap(heap_t* heap) {
-	global_memory_interface->memory_unmap(heap, heap->offset, heap->mapped_size);
+	heap_instance(heap)->memory_interface->memory_unmap(heap, heap->offset, heap->mapped_size);
+}
+
+//! Reset the heap state that is only valid in the process and for the owner that acquired the heap, used when
+//  a heap is acquired and when a persistent heap is attached by a new process
+static void
+heap_reset_process_state(heap_t* heap, instance_t* instance, int first_class) {
+	heap->instance = instance;
+	heap->first_class = (uint32_t)first_class;
+	heap->user_data = 0;
+	heap->shared = 0;
+	heap->shared_next = 0;
+	heap->memory_limit = 0;
+	heap->memory_limit_policy = 0;
+	heap->memory_limit_callback = 0;
+	heap->memory_interface = instance->memory_interface_index;
+	heap->owner_process = 0;
+	heap->pinned = 0;
+	heap->pin_flags = 0;
+	heap->pin_reserved = 0;
+	heap->pin_diverted = 0;
+	heap->pin_failed = 0;
+	heap->map_count = 0;
+	atomic_store_explicit(&heap->unmap_count, 0, memory_order_relaxed);
+	heap->commit_count = 0;
+	heap->decommit_count = 0;
+	heap->label[0] = 0;
+	heap->sample_countdown = 0;
+	heap->sample_interval = 0;
+#if ENABLE_STATISTICS
+	heap->remote_free_count = 0;
+	heap->remote_free_sample = 0;
+	memset(heap->adopt_batch, 0, sizeof(heap->adopt_batch));
+#endif
+#if ENABLE_LATENCY
+	memset(heap->latency, 0, sizeof(heap->latency));
+#endif
 }
 
 static heap_t*
-heap_allocate(int first_class) {
+heap_allocate(instance_t* instance, int first_class) {
 	heap_t* heap = 0;
 	if (!first_class) {
-		heap_lock_acquire();
-		heap = global_heap_queue;
-		global_heap_queue = heap ? heap->next : 0;
-		heap_lock_release();
+		heap_lock_acquire(instance);
+		heap = instance->heap_queue;
+		instance->heap_queue = heap ? heap->next : 0;
+		heap_lock_release(instance);
 	}
 	if (!heap)
-		heap = heap_allocate_new();
+		heap = heap_allocate_new(instance);
 	if (heap) {
 		uintptr_t current_thread_id = get_thread_id();
-		heap_lock_acquire();
-		heap->next = global_heap_used;
+		heap_lock_acquire(instance);
+		heap->next = instance->heap_used;
 		heap->prev = 0;
-		if (global_heap_used)
-			global_heap_used->prev = heap;
-		global_heap_used = heap;
-		heap_lock_release();
+		if (instance->heap_used)
+			instance->heap_used->prev = heap;
+		instance->heap_used = heap;
+		heap_lock_release(instance);
 		heap->owner_thread = current_thread_id;
+		heap_reset_process_state(heap, instance, first_class);
+		rpmalloc_trace2(heap_acquire, heap->id, first_class);
 	}
 	return heap;
 }
 
 static inline void
 heap_release(heap_t* heap) {
-	heap_lock_acquire();
+	rpmalloc_trace2(heap_release, heap->id, heap->first_class);
+	instance_t* instance = heap->instance;
+	heap_lock_acquire(instance);
 	if (heap->prev)
 		heap->prev->next = heap->next;
 	if (heap->next)
 		heap->next->prev = heap->prev;
-	if (global_heap_used == heap)
-		global_heap_used = heap->next;
-	heap->next = global_heap_queue;
-	global_heap_queue = heap;
-	heap_lock_release();
+	if (instance->heap_used == heap)
+		instance->heap_used = heap->next;
+	heap->next = instance->heap_queue;
+	instance->heap_queue = heap;
+	heap_lock_release(instance);
 }
 
 static void
 heap_page_free_decommit(heap_t* heap, uint32_t page_type, uint32_t page_retain_count) {
+	// Pinned heaps never decommit, decommitted pages would fault again when reused
+	if (heap->pinned || heap_instance(heap)->config.disable_decommit)
+		return;
 	page_t* page = heap->page_free[page_type];
 	while (page && page_retain_count) {
 		page = page->next;
 		--page_retain_count;
 	}
+#if ENABLE_LATENCY
+	if (!page || page->is_decommitted)
+		return;
+	uint64_t latency_start = cpu_ticks();
+#endif
 	while (page && (page->is_decommitted == 0)) {
 		page_decommit_memory_pages(page);
 		--heap->page_free_commit_count[page_type];
 		page = page->next;
 	}
+#if ENABLE_LATENCY
+	latency_record(heap, LATENCY_PAGE_DECOMMIT, latency_start);
+#endif
 }
 
 static inline void
@@ -1424,7 +2791,9 @@ heap_make_free_page_available(heap_t* heap, uint32_t size_class, page_t* page) {
 	page->is_full = 0;
 	page->is_free = 0;
 	page->has_aligned_block = 0;
+	page->has_sampled_block = 0;
 	page->generic_free = 0;
+	page->sample_map = 0;
 	page->heap = heap;
 	page_t* head = heap->page_available[size_class];
 	page->next = head;
@@ -1437,54 +2806,246 @@ heap_make_free_page_available(heap_t* heap, uint32_t size_class, page_t* page) {
 		page_commit_memory_pages(page);
 }
 
-//! Find or allocate a span for the given page type with the given size class
-static inline span_t*
-heap_get_span(heap_t* heap, page_type_t page_type) {
-	// Fast path, available span for given page type
-	if (EXPECTED(heap->span_partial[page_type] != 0))
-		return heap->span_partial[page_type];
-
-	// Fallback path, map more memory
-	size_t offset = 0;
-	size_t mapped_size = 0;
-	span_t* span = global_memory_interface->memory_map(SPAN_SIZE, SPAN_SIZE, &offset, &mapped_size);
-	if (EXPECTED(span != 0)) {
-		span->heap = heap;
-		span->page_type = page_type;
-		if (page_type == PAGE_SMALL) {
-			span->page_count = SPAN_SIZE / SMALL_PAGE_SIZE;
-			span->page_size = SMALL_PAGE_SIZE;
-			span->page_address_mask = SMALL_PAGE_MASK;
-		} else if (page_type == PAGE_MEDIUM) {
-			span->page_count = SPAN_SIZE / MEDIUM_PAGE_SIZE;
-			span->page_size = MEDIUM_PAGE_SIZE;
-			span->page_address_mask = MEDIUM_PAGE_MASK;
-		} else {
-			span->page_count = SPAN_SIZE / LARGE_PAGE_SIZE;
-			span->page_size = LARGE_PAGE_SIZE;
-			span->page_address_mask = LARGE_PAGE_MASK;
-		}
-		span->offset = (uint32_t)offset;
-		span->mapped_size = mapped_size;
+//! Check if the heap keeps track of huge spans to release them when the heap is cleared
+static inline int
+heap_is_tracking_huge(heap_t* heap) {
+	return heap->first_class && (!heap->owner_thread || heap->shared);
+}
 
-		heap->span_partial[page_type] = span;
+//! Get the shared heap lock owner of the calling thread. Thread IDs are only unique within a process, the owner
+//  is the process ID in the high bits and a thread index unique within the process in the low bits
+static inline unsigned long long
+heap_shared_lock_owner(void) {
+	uint32_t thread_index = global_thread_lock_index;
+	if (UNEXPECTED(!thread_index)) {
+		thread_index = atomic_fetch_add_explicit(&global_thread_lock_count, 1, memory_order_relaxed) + 1;
+		global_thread_lock_index = thread_index;
 	}
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	return ((unsigned long long)global_process_id << 32) | thread_index;
+#else
+	return thread_index;
+#endif
+}
 
-	return span;
+//! Check if the process holding a shared heap lock has terminated without releasing the lock
+static int
+heap_shared_lock_owner_is_dead(unsigned long long lock) {
+#if RPMALLOC_FIRST_CLASS_HEAPS && PLATFORM_POSIX
+	pid_t owner_process = (pid_t)(lock >> 32);
+	if (!owner_process || ((uint32_t)owner_process == global_process_id))
+		return 0;
+	return (kill(owner_process, 0) != 0) && (errno == ESRCH);
+#else
+	(void)sizeof(lock);
+	return 0;
+#endif
 }
 
-//! Find or allocate a page for the given size class
-static inline page_t*
-heap_get_page(heap_t* heap, uint32_t size_class) {
-	// Fast path, available page for given size class
-	page_t* page = heap->page_available[size_class];
-	if (EXPECTED(page != 0))
-		return page;
+//! Lock the shared heap, safe to pass a null pointer. A lock in a cross process heap region held by a process
+//  that terminated is taken over, the state it protects is only consistent if the process did not terminate
+//  while holding the lock
+static inline void
+heap_shared_lock_acquire(heap_shared_t* shared) {
+	if (!shared)
+		return;
+	unsigned long long lock = 0;
+	unsigned long long this_lock = heap_shared_lock_owner();
+	unsigned int spin_count = 0;
+	while (!atomic_compare_exchange_strong(&shared->lock, &lock, this_lock)) {
+		if (!(++spin_count & 0xFFFF) && heap_shared_lock_owner_is_dead(lock))
+			continue;
+		lock = 0;
+		wait_spin();
+	}
+}
+
+//! Unlock the shared heap, safe to pass a null pointer
+static inline void
+heap_shared_lock_release(heap_shared_t* shared) {
+	if (!shared)
+		return;
+	rpmalloc_assert(atomic_load_explicit(&shared->lock, memory_order_relaxed) == heap_shared_lock_owner(),
+	                "Bad shared heap lock");
+	atomic_store_explicit(&shared->lock, 0, memory_order_release);
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Pop a span from the shared heap span pool
+static span_t*
+heap_shared_pop_span(heap_shared_t* shared, page_type_t page_type) {
+	heap_shared_lock_acquire(shared);
+	span_t* span = shared->span_free[page_type];
+	if (span)
+		shared->span_free[page_type] = span->next;
+	heap_shared_lock_release(shared);
+	return span;
+}
+
+//! Put a span back in the span pool of the shared heap
+static void
+heap_shared_push_span(heap_shared_t* shared, span_t* span) {
+	heap_shared_lock_acquire(shared);
+	span->next = shared->span_free[span->page_type];
+	shared->span_free[span->page_type] = span;
+	heap_shared_lock_release(shared);
+}
+
+//! Remove a huge span from the tracked huge spans of the heap
+static void
+heap_huge_span_remove(heap_t* heap, span_t* span) {
+	if (!heap_is_tracking_huge(heap))
+		return;
+	heap_shared_lock_acquire(heap->shared);
+	span_t** list = &heap->span_used[PAGE_HUGE];
+	while (*list && (*list != span))
+		list = &(*list)->next;
+	if (*list)
+		*list = span->next;
+	heap_shared_lock_release(heap->shared);
+}
+
+#endif
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Unmap spans in the heap which have no initialized pages but still have committed pages from before the
+//  span was reset, returns the number of committed bytes released
+static size_t
+heap_trim(heap_t* heap) {
+	size_t released = 0;
+	if (heap->pinned)
+		return 0;
+	for (int itype = 0; itype < 3; ++itype) {
+		span_t** list = &heap->span_partial[itype];
+		while (*list) {
+			span_t* span = *list;
+			if ((span->page_initialized == 0) && (span->page_dirty != 0)) {
+				*list = span->next;
+				released += span_committed_size(span);
+				span_unmap(span);
+			} else {
+				list = &span->next;
+			}
+		}
+	}
+	return released;
+}
+
+//! Check if the heap can commit the given number of bytes without exceeding the heap limit, applying the limit
+//  policy of the heap
+static NOINLINE int
+heap_limit_check(heap_t* heap, size_t size) {
+	if (!size)
+		return 1;
+	while ((atomic_load_explicit(&heap->memory_committed, memory_order_relaxed) + size) > heap->memory_limit) {
+		if ((heap->memory_limit_policy & RPMALLOC_HEAP_LIMIT_TRIM) && heap_trim(heap))
+			continue;
+		if ((heap->memory_limit_policy & RPMALLOC_HEAP_LIMIT_CALLBACK) && heap->memory_limit_callback &&
+		    heap->memory_limit_callback(heap, size))
+			continue;
+		return 0;
+	}
+	return 1;
+}
+
+#endif
+
+//! Map a new span for the given page type
+static span_t*
+heap_map_span(heap_t* heap, page_type_t page_type) {
+	size_t offset = 0;
+	size_t mapped_size = 0;
+	span_t* span = memory_interface_map(heap_memory_interface(heap), SPAN_SIZE, SPAN_SIZE, &offset, &mapped_size);
+	++heap->map_count;
+	if (EXPECTED(span != 0)) {
+		span->heap = heap;
+		span->memory_interface = heap->memory_interface;
+		span->page_type = page_type;
+		if (page_type == PAGE_SMALL) {
+			span->page_count = SPAN_SIZE / SMALL_PAGE_SIZE;
+			span->page_size = SMALL_PAGE_SIZE;
+			span->page_address_mask = SMALL_PAGE_MASK;
+		} else if (page_type == PAGE_MEDIUM) {
+			span->page_count = SPAN_SIZE / MEDIUM_PAGE_SIZE;
+			span->page_size = MEDIUM_PAGE_SIZE;
+			span->page_address_mask = MEDIUM_PAGE_MASK;
+		} else {
+			span->page_count = SPAN_SIZE / LARGE_PAGE_SIZE;
+			span->page_size = LARGE_PAGE_SIZE;
+			span->page_address_mask = LARGE_PAGE_MASK;
+		}
+		span->offset = (uint32_t)offset;
+		span->mapped_size = mapped_size;
+		span->next = 0;
+		span_map_insert(span);
+		os_name_mapping(heap_memory_interface(heap), span, offset, mapped_size, page_type,
+		                heap->label[0] ? heap->label : 0);
+		rpmalloc_trace4(span_map, heap->id, page_type, span, mapped_size);
+		atomic_fetch_add_explicit(&heap->memory_usage, mapped_size, memory_order_relaxed);
+	}
+	return span;
+}
 
+//! Find or allocate a span for the given page type with the given size class
+static inline span_t*
+heap_get_span(heap_t* heap, page_type_t page_type) {
+	// Fast path, available span for given page type
+	if (EXPECTED(heap->span_partial[page_type] != 0))
+		return heap->span_partial[page_type];
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	// Pinned heaps never map memory after the reserve is exhausted
+	if (UNEXPECTED(heap->pinned != 0))
+		return 0;
+
+	// Sub heaps of a shared heap use spans from the shared pool before mapping more memory
+	if (heap->shared) {
+		span_t* span = heap_shared_pop_span(heap->shared, page_type);
+		if (span) {
+			// Pages of the span initialized by the previous owner are still committed
+			size_t committed = span_committed_size(span);
+			if (UNEXPECTED(heap->memory_limit != 0) && !heap_limit_check(heap, committed)) {
+				heap_shared_push_span(heap->shared, span);
+				return 0;
+			}
+			span->heap = heap;
+			span->next = 0;
+			atomic_fetch_add_explicit(&heap->memory_usage, span->mapped_size, memory_order_relaxed);
+			atomic_fetch_add_explicit(&heap->memory_committed, committed, memory_order_relaxed);
+			heap->span_partial[page_type] = span;
+			return span;
+		}
+	}
+#endif
+
+	// Fallback path, map more memory
+#if ENABLE_LATENCY
+	uint64_t latency_start = cpu_ticks();
+#endif
+	span_t* span = heap_map_span(heap, page_type);
+#if ENABLE_LATENCY
+	latency_record(heap, LATENCY_SPAN_MAP, latency_start);
+#endif
+	if (EXPECTED(span != 0))
+		heap->span_partial[page_type] = span;
+
+	return span;
+}
+
+//! Find or allocate a free page for the given size class and make it available
+static page_t*
+heap_get_free_page(heap_t* heap, uint32_t size_class) {
 	// Check if there is a free page
 	page_type_t page_type = get_page_type(size_class);
-	page = heap->page_free[page_type];
+	page_t* page = heap->page_free[page_type];
 	if (EXPECTED(page != 0)) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+		if (UNEXPECTED(heap->memory_limit != 0) && page->is_decommitted &&
+		    !heap_limit_check(heap, page_get_size(page) - global_instance.config.page_size))
+			return 0;
+#endif
 		heap->page_free[page_type] = page->next;
 		if (page->is_decommitted == 0) {
 			rpmalloc_assert(heap->page_free_commit_count[page_type] > 0, "Free committed page count out of sync");
@@ -1498,7 +3059,7 @@ heap_get_page(heap_t* heap, uint32_t size_class) {
 	if (heap->id == 0) {
 		// Thread has not yet initialized, assign heap and try again
 		rpmalloc_initialize(0);
-		return heap_get_page(get_thread_heap(), size_class);
+		return heap_get_free_page(get_thread_heap(), size_class);
 	}
 
 	// Check if there is a free page from multithreaded deallocations
@@ -1530,6 +3091,11 @@ heap_get_page(heap_t* heap, uint32_t size_class) {
 	// (which is the default heap) - so use span page heap instead
 	span_t* span = heap_get_span(heap, page_type);
 	if (EXPECTED(span != 0)) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+		if (UNEXPECTED(span->heap->memory_limit != 0) &&
+		    !heap_limit_check(span->heap, span_page_commit_size(span)))
+			return 0;
+#endif
 		page = span_allocate_page(span);
 		heap_make_free_page_available(page->heap, size_class, page);
 	}
@@ -1537,6 +3103,50 @@ heap_get_page(heap_t* heap, uint32_t size_class) {
 	return page;
 }
 
+//! Get a page with available blocks for the given size class, making a free or new page available if needed
+static inline page_t*
+heap_get_page(heap_t* heap, uint32_t size_class) {
+	// Fast path, available page for given size class
+	page_t* page = heap->page_available[size_class];
+	if (EXPECTED(page != 0))
+		return page;
+	return heap_get_free_page(heap, size_class);
+}
+
+//! Make enough pages available in the heap to allocate the given number of blocks of the given size class
+//  without taking the free page or span paths, optionally pre-faulting the memory for the blocks
+static int
+heap_warmup(heap_t* heap, uint32_t size_class, size_t count, unsigned int flags) {
+	size_t block_size = global_size_class[size_class].block_size;
+	size_t block_count = global_size_class[size_class].block_count;
+	page_t* page = heap->page_available[size_class];
+	while (page && count) {
+		count -= (count > block_count) ? block_count : count;
+		page = page->next;
+	}
+	while (count) {
+		page = heap_get_free_page(heap, size_class);
+		if (!page)
+			return -1;
+		size_t page_blocks = (count > block_count) ? block_count : count;
+		count -= page_blocks;
+		if (flags & RPMALLOC_WARMUP_PREFAULT)
+			os_mpopulate(page, get_page_aligned_size(PAGE_HEADER_SIZE + (page_blocks * block_size)));
+	}
+	return 0;
+}
+
+//! Warm up the heap for the given sizes and block counts, ignoring sizes above the large block limit
+static int
+heap_warmup_sizes(heap_t* heap, const size_t* sizes, const size_t* counts, size_t count, unsigned int flags) {
+	for (size_t isize = 0; isize < count; ++isize) {
+		uint32_t size_class = get_size_class(sizes[isize]);
+		if ((size_class < SIZE_CLASS_COUNT) && heap_warmup(heap, size_class, counts[isize], flags))
+			return -1;
+	}
+	return 0;
+}
+
 //! Pop a block from the heap local free list
 static inline RPMALLOC_ALLOCATOR void*
 heap_pop_local_free(heap_t* heap, uint32_t size_class) {
@@ -1547,29 +3157,76 @@ heap_pop_local_free(heap_t* heap, uint32_t size_class) {
 	return block;
 }
 
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+static inline RPMALLOC_ALLOCATOR void*
+heap_allocate_block(heap_t* heap, size_t size, unsigned int zero);
+
+//! Allocation path when a pinned heap reserve is exhausted, either fail or divert to the thread heap
+static NOINLINE RPMALLOC_ALLOCATOR void*
+heap_allocate_block_pinned_exhausted(heap_t* heap, size_t size, unsigned int zero) {
+	if (heap->pin_flags & RPMALLOC_HEAP_PIN_DIVERT) {
+		++heap->pin_diverted;
+		return heap_allocate_block(get_thread_heap(), size, zero);
+	}
+	++heap->pin_failed;
+	return 0;
+}
+
+#endif
+
 //! Generic allocation path from heap pages, spans or new mapping
 static NOINLINE RPMALLOC_ALLOCATOR void*
 heap_allocate_block_small_to_large(heap_t* heap, uint32_t size_class, unsigned int zero) {
 	page_t* page = heap_get_page(heap, size_class);
-	if (EXPECTED(page != 0))
-		return page_allocate_block(page, zero);
+	if (EXPECTED(page != 0)) {
+		unsigned int is_zero = 0;
+		void* block = page_allocate_block(page, &is_zero);
+		if (zero) {
+			if (!is_zero)
+				memset(block, 0, page->block_size);
+			else
+				*(uintptr_t*)block = 0;
+		}
+		return block;
+	}
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (heap->pinned)
+		return heap_allocate_block_pinned_exhausted(heap, global_size_class[size_class].block_size, zero);
+#endif
 	return 0;
 }
 
 //! Generic allocation path from heap pages, spans or new mapping
 static NOINLINE RPMALLOC_ALLOCATOR void*
 heap_allocate_block_huge(heap_t* heap, size_t size, unsigned int zero) {
-	(void)sizeof(heap);
 	size_t alloc_size = get_page_aligned_size(size + SPAN_HEADER_SIZE);
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	if (heap->pinned)
+		return heap_allocate_block_pinned_exhausted(heap, size, zero);
+	if (UNEXPECTED(heap->memory_limit != 0) && !heap_limit_check(heap, alloc_size))
+		return 0;
+#endif
 	size_t offset = 0;
 	size_t mapped_size = 0;
-	void* block = global_memory_interface->memory_map(alloc_size, SPAN_SIZE, &offset, &mapped_size);
+	rpmalloc_interface_t* memory_interface = heap_memory_interface(heap);
+#if ENABLE_LATENCY
+	uint64_t latency_start = cpu_ticks();
+#endif
+	void* block = memory_interface_map(memory_interface, alloc_size, SPAN_SIZE, &offset, &mapped_size);
+	++heap->map_count;
+#if ENABLE_LATENCY
+	latency_record(heap, LATENCY_HUGE_MAP, latency_start);
+#endif
 	if (block) {
+		atomic_fetch_add_explicit(&heap->memory_usage, mapped_size, memory_order_relaxed);
+		atomic_fetch_add_explicit(&heap->memory_committed, alloc_size, memory_order_relaxed);
 		span_t* span = block;
 		span->heap = heap;
+		span->memory_interface = heap->memory_interface;
 		span->page_type = PAGE_HUGE;
-		span->page_size = (uint32_t)global_config.page_size;
-		span->page_count = (uint32_t)(alloc_size / global_config.page_size);
+		span->page_size = (uint32_t)global_instance.config.page_size;
+		span->page_count = (uint32_t)(alloc_size / global_instance.config.page_size);
 		span->page_address_mask = LARGE_PAGE_MASK;
 		span->offset = (uint32_t)offset;
 		span->mapped_size = mapped_size;
@@ -1577,14 +3234,20 @@ heap_allocate_block_huge(heap_t* heap, size_t size, unsigned int zero) {
 		span->page.is_full = 1;
 		span->page.generic_free = 1;
 		span->page.page_type = PAGE_HUGE;
+		span_map_insert(span);
+		os_name_mapping(memory_interface, span, offset, mapped_size, PAGE_HUGE, heap->label[0] ? heap->label : 0);
 		// Keep track of span if first class heap
-		if (!heap->owner_thread) {
+		if (heap_is_tracking_huge(heap)) {
+			heap_shared_lock_acquire(heap->shared);
 			span->next = heap->span_used[PAGE_HUGE];
 			heap->span_used[PAGE_HUGE] = span;
+			heap_shared_lock_release(heap->shared);
 		}
 		void* ptr = pointer_offset(block, SPAN_HEADER_SIZE);
-		if (zero)
-			memset(ptr, 0, alloc_size);
+		rpmalloc_trace4(huge_alloc, heap->id, ptr, size, mapped_size);
+		// Memory mapped by the default implementation is always zero
+		if (zero && (memory_interface->memory_map != os_mmap))
+			memset(ptr, 0, alloc_size - SPAN_HEADER_SIZE);
 		return ptr;
 	}
 	return 0;
@@ -1608,9 +3271,58 @@ heap_allocate_block_generic(heap_t* heap, size_t size, unsigned int zero) {
 	return heap_allocate_block_huge(heap, size, zero);
 }
 
+#if ENABLE_SAMPLING
+
+//! Allocation path when the sampling countdown of the heap expires, either sample the allocation or rearm the
+//  countdown if sampling was enabled, disabled or the interval changed since the countdown was drawn
+static NOINLINE RPMALLOC_ALLOCATOR void*
+heap_allocate_block_sampled(heap_t* heap, size_t size, unsigned int zero) {
+	if (UNEXPECTED(heap == global_heap_default))
+		return heap_allocate_block_generic(heap, size, zero);
+	size_t interval = atomic_load_explicit(&global_sample_interval, memory_order_relaxed);
+	if (!interval || (heap->sample_interval != interval)) {
+		if (!heap->sample_random)
+			heap->sample_random = ((uint64_t)(uintptr_t)heap ^ ((uint64_t)heap->id << 32)) | 1;
+		heap->sample_interval = interval;
+		heap->sample_countdown = interval ? sample_next_interval(heap, interval) : SAMPLE_RECHECK_INTERVAL;
+		return heap_allocate_block_generic(heap, size, zero);
+	}
+	// Allocations made while capturing the stack trace are never sampled
+	heap->sample_countdown = SIZE_MAX;
+	void* frame[SAMPLE_STACK_DEPTH];
+	uint32_t depth = sample_capture_stack(frame);
+	void* block = heap_allocate_block_generic(heap, size, zero);
+	heap->sample_countdown = sample_next_interval(heap, interval);
+	if (!block)
+		return 0;
+	span_t* span = block_get_span(block);
+	page_t* page = (span->page_type == PAGE_HUGE) ? &span->page : span_get_page_from_block(span, block);
+	uint32_t size_class = (span->page_type == PAGE_HUGE) ? SIZE_CLASS_COUNT : page->size_class;
+	sample_hook_call_t call;
+	if (sample_block_insert(heap, block, size, size_class, frame, depth, &call)) {
+		// Divert frees of blocks in the page to the generic path which consults the sample table
+		if (span->page_type != PAGE_HUGE)
+			page->sample_map |= page_sample_bit(page, block);
+		page->has_sampled_block = 1;
+		page->generic_free = 1;
+	}
+	sample_hook_call(&call);
+	return block;
+}
+
+#endif
+
 //! Find or allocate a block of the given size
 static inline RPMALLOC_ALLOCATOR void*
 heap_allocate_block(heap_t* heap, size_t size, unsigned int zero) {
+#if ENABLE_STATISTICS
+	statistics_requested(heap, size);
+#endif
+#if ENABLE_SAMPLING
+	if (UNEXPECTED(size >= heap->sample_countdown))
+		return heap_allocate_block_sampled(heap, size, zero);
+	heap->sample_countdown -= size;
+#endif
 	if (size <= (SMALL_GRANULARITY * 64)) {
 		uint32_t size_class = get_size_class_tiny(size);
 		block_t* block = heap_pop_local_free(heap, size_class);
@@ -1624,6 +3336,42 @@ heap_allocate_block(heap_t* heap, size_t size, unsigned int zero) {
 	return heap_allocate_block_generic(heap, size, zero);
 }
 
+//! Allocate a block of the given size where the memory in the given range must be zero,
+//  only clearing the range if the block memory is not already known to be zero
+static NOINLINE RPMALLOC_ALLOCATOR void*
+heap_allocate_block_zero_range(heap_t* heap, size_t size, size_t zero_offset, size_t zero_end) {
+#if ENABLE_STATISTICS
+	statistics_requested(heap, size);
+#endif
+#if ENABLE_SAMPLING
+	if (UNEXPECTED(size >= heap->sample_countdown))
+		return heap_allocate_block_sampled(heap, size, 1);
+	heap->sample_countdown -= size;
+#endif
+	uint32_t size_class = get_size_class(size);
+	if (UNEXPECTED(size_class >= SIZE_CLASS_COUNT))
+		return heap_allocate_block_huge(heap, size, 1);
+
+	unsigned int is_zero = 0;
+	block_t* block = heap_pop_local_free(heap, size_class);
+	if (!block) {
+		page_t* page = heap_get_page(heap, size_class);
+		if (UNEXPECTED(page == 0)) {
+#if RPMALLOC_FIRST_CLASS_HEAPS
+			if (heap->pinned)
+				return heap_allocate_block_pinned_exhausted(heap, size, 1);
+#endif
+			return 0;
+		}
+		block = page_allocate_block(page, &is_zero);
+	}
+	if (is_zero)
+		*(uintptr_t*)block = 0;
+	else if (zero_end > zero_offset)
+		memset(pointer_offset(block, zero_offset), 0, zero_end - zero_offset);
+	return block;
+}
+
 static RPMALLOC_ALLOCATOR void*
 heap_allocate_block_aligned(heap_t* heap, size_t alignment, size_t size, unsigned int zero) {
 	if (alignment <= SMALL_GRANULARITY)
@@ -1646,6 +3394,9 @@ heap_allocate_block_aligned(heap_t* heap, size_t alignment, size_t size, unsigne
 
 	size_t align_mask = alignment - 1;
 	block_t* block = heap_allocate_block(heap, size + alignment, zero);
+#if ENABLE_STATISTICS
+	statistics_requested_aligned(heap, size, alignment);
+#endif
 	if ((uintptr_t)block & align_mask) {
 		block = (void*)(((uintptr_t)block & ~(uintptr_t)align_mask) + alignment);
 		// Mark as having aligned blocks
@@ -1675,6 +3426,11 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 				// Still fits in block, never mind trying to save memory, but preserve data if alignment changed
 				if ((block != block_origin) && !(flags & RPMALLOC_NO_PRESERVE))
 					memmove(block_origin, block, old_size);
+				if ((flags & RPMALLOC_ZERO_INIT) && (size > old_size))
+					memset(pointer_offset(block_origin, old_size), 0, size - old_size);
+#if ENABLE_SAMPLING
+				sample_block_resize(block_origin, size);
+#endif
 				return block_origin;
 			}
 		} else {
@@ -1687,6 +3443,9 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 				// but preserve data if alignment changed
 				if ((block_start != block) && !(flags & RPMALLOC_NO_PRESERVE))
 					memmove(block_start, block, old_size);
+#if ENABLE_SAMPLING
+				sample_block_resize(block_start, size);
+#endif
 				return block_start;
 			}
 		}
@@ -1702,74 +3461,1440 @@ heap_reallocate_block(heap_t* heap, void* block, size_t size, size_t old_size, u
 	size_t lower_bound = old_size + (old_size >> 2) + (old_size >> 3);
 	size_t new_size = (size > lower_bound) ? size : ((size > old_size) ? lower_bound : size);
 	void* old_block = block;
-	block = heap_allocate_block(heap, new_size, 0);
+	if (flags & RPMALLOC_ZERO_INIT) {
+		// Content up to old size is either preserved or undefined, only zero the remaining range
+		block = heap_allocate_block_zero_range(heap, new_size, old_size, size);
+	} else {
+		block = heap_allocate_block(heap, new_size, 0);
+	}
 	if (block && old_block) {
 		if (!(flags & RPMALLOC_NO_PRESERVE))
 			memcpy(block, old_block, old_size < new_size ? old_size : new_size);
 		block_deallocate(old_block);
 	}
 
-	return block;
+	return block;
+}
+
+static void*
+heap_reallocate_block_aligned(heap_t* heap, void* block, size_t alignment, size_t size, size_t old_size,
+                              unsigned int flags) {
+	if (alignment <= SMALL_GRANULARITY)
+		return heap_reallocate_block(heap, block, size, old_size, flags);
+
+	int no_alloc = !!(flags & RPMALLOC_GROW_OR_FAIL);
+	size_t usable_size = (block ? block_usable_size(block) : 0);
+	if ((usable_size >= size) && !((uintptr_t)block & (alignment - 1))) {
+		if (no_alloc || (size >= (usable_size / 2))) {
+			size_t zero_offset = old_size ? old_size : usable_size;
+			if ((flags & RPMALLOC_ZERO_INIT) && (size > zero_offset))
+				memset(pointer_offset(block, zero_offset), 0, size - zero_offset);
+#if ENABLE_SAMPLING
+			sample_block_resize(block, size);
+#endif
+			return block;
+		}
+	}
+	// Aligned alloc marks span as having aligned blocks, known zero blocks are not cleared again
+	void* old_block = block;
+	unsigned int zero = !!(flags & RPMALLOC_ZERO_INIT);
+	block = (!no_alloc ? heap_allocate_block_aligned(heap, alignment, size, zero) : 0);
+	if (EXPECTED(block != 0)) {
+		if (!(flags & RPMALLOC_NO_PRESERVE) && old_block) {
+			if (!old_size)
+				old_size = usable_size;
+			memcpy(block, old_block, old_size < size ? old_size : size);
+		}
+		if (EXPECTED(old_block != 0))
+			block_deallocate(old_block);
+	}
+	return block;
+}
+
+static void
+heap_free_all(heap_t* heap) {
+#if ENABLE_SAMPLING
+	sample_purge(heap, 0, 0, 0);
+#endif
+	for (int itype = 0; itype < 3; ++itype) {
+		span_t* span = heap->span_partial[itype];
+		while (span) {
+			span_t* span_next = span->next;
+			span_unmap(span);
+			span = span_next;
+		}
+		heap->span_partial[itype] = 0;
+		heap->page_free[itype] = 0;
+		heap->page_free_commit_count[itype] = 0;
+		atomic_store_explicit(&heap->page_free_thread[itype], 0, memory_order_relaxed);
+	}
+	for (int itype = 0; itype < 4; ++itype) {
+		span_t* span = heap->span_used[itype];
+		while (span) {
+			span_t* span_next = span->next;
+			span_unmap(span);
+			span = span_next;
+		}
+		heap->span_used[itype] = 0;
+	}
+	memset(heap->local_free, 0, sizeof(heap->local_free));
+	memset(heap->page_available, 0, sizeof(heap->page_available));
+
+#if ENABLE_STATISTICS
+	// TODO: Fix
+#endif
+}
+
+//! Free all memory of all heaps in the instance and unmap the heaps
+static void
+instance_free_heaps(instance_t* instance) {
+	heap_t* heap = instance->heap_queue;
+	instance->heap_queue = 0;
+	while (heap) {
+		heap_t* heap_next = heap->next;
+		heap_free_all(heap);
+		heap_unmap(heap);
+		heap = heap_next;
+	}
+	heap = instance->heap_used;
+	instance->heap_used = 0;
+	while (heap) {
+		heap_t* heap_next = heap->next;
+		heap_free_all(heap);
+		heap_unmap(heap);
+		heap = heap_next;
+	}
+}
+
+//! Reset the span to the given number of initialized pages, remembering which pages have been used
+static inline void
+span_reset(span_t* span, uint32_t page_initialized) {
+	if (span->page_initialized > span->page_dirty)
+		span->page_dirty = span->page_initialized;
+	span->page_initialized = (uint16_t)page_initialized;
+}
+
+//! Clear all free lists and available pages in the heap
+static void
+heap_reset_lists(heap_t* heap) {
+	for (int itype = 0; itype < 3; ++itype) {
+		heap->page_free[itype] = 0;
+		heap->page_free_commit_count[itype] = 0;
+		atomic_store_explicit(&heap->page_free_thread[itype], 0, memory_order_relaxed);
+	}
+	memset(heap->local_free, 0, sizeof(heap->local_free));
+	memset(heap->page_available, 0, sizeof(heap->page_available));
+}
+
+//! Free all memory allocated by the heap, keeping spans mapped up to the given number of bytes of used pages.
+//  Returns the number of bytes of used pages retained
+static size_t
+heap_reset(heap_t* heap, size_t retain_size) {
+#if ENABLE_SAMPLING
+	sample_purge(heap, 0, 0, 0);
+#endif
+	size_t retained = 0;
+	for (int itype = 0; itype < 3; ++itype) {
+		span_t* retain_list = 0;
+		span_t* span_list[2] = {heap->span_partial[itype], heap->span_used[itype]};
+		for (int ilist = 0; ilist < 2; ++ilist) {
+			span_t* span = span_list[ilist];
+			while (span) {
+				span_t* span_next = span->next;
+				span_reset(span, 0);
+				size_t span_used_size = (size_t)span->page_dirty * (size_t)span->page_size;
+				if (heap->pinned || (retained + span_used_size <= retain_size)) {
+					retained += span_used_size;
+					span->next = retain_list;
+					retain_list = span;
+				} else {
+					span_unmap(span);
+				}
+				span = span_next;
+			}
+		}
+		heap->span_partial[itype] = retain_list;
+		heap->span_used[itype] = 0;
+	}
+	span_t* span = heap->span_used[PAGE_HUGE];
+	while (span) {
+		span_t* span_next = span->next;
+		span_unmap(span);
+		span = span_next;
+	}
+	heap->span_used[PAGE_HUGE] = 0;
+	heap_reset_lists(heap);
+	return retained;
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+//! Heap state at a mark, allocated from the heap itself after the mark
+struct heap_mark_t {
+	//! Heap local free lists
+	block_t* local_free[SIZE_CLASS_COUNT];
+	//! Available pages
+	page_t* page_available[SIZE_CLASS_COUNT];
+	//! Free pages
+	page_t* page_free[3];
+	//! Free but still committed page count
+	uint32_t page_free_commit_count[3];
+	//! Multithreaded free pages
+	uintptr_t page_free_thread[3];
+	//! Span pages were initialized from
+	span_t* span_partial[3];
+	//! Number of initialized pages in span
+	uint32_t page_initialized[3];
+	//! Head of spans in full use
+	span_t* span_used[4];
+#if ENABLE_SAMPLING
+	//! Sample generation of the heap, blocks sampled after the mark have a higher generation
+	uint64_t sample_generation;
+#endif
+};
+
+typedef struct heap_mark_t heap_mark_t;
+
+static void
+heap_mark_store(heap_t* heap, heap_mark_t* mark) {
+	memcpy(mark->local_free, heap->local_free, sizeof(heap->local_free));
+	memcpy(mark->page_available, heap->page_available, sizeof(heap->page_available));
+	for (int itype = 0; itype < 3; ++itype) {
+		mark->page_free[itype] = heap->page_free[itype];
+		mark->page_free_commit_count[itype] = heap->page_free_commit_count[itype];
+		mark->page_free_thread[itype] = atomic_load_explicit(&heap->page_free_thread[itype], memory_order_relaxed);
+		mark->span_partial[itype] = heap->span_partial[itype];
+		mark->page_initialized[itype] = heap->span_partial[itype] ? heap->span_partial[itype]->page_initialized : 0;
+	}
+	memcpy(mark->span_used, heap->span_used, sizeof(heap->span_used));
+#if ENABLE_SAMPLING
+	mark->sample_generation = heap->sample_generation;
+#endif
+}
+
+static void
+heap_mark_restore_lists(heap_t* heap, const heap_mark_t* mark) {
+	memcpy(heap->local_free, mark->local_free, sizeof(heap->local_free));
+	memcpy(heap->page_available, mark->page_available, sizeof(heap->page_available));
+	for (int itype = 0; itype < 3; ++itype) {
+		heap->page_free[itype] = mark->page_free[itype];
+		heap->page_free_commit_count[itype] = mark->page_free_commit_count[itype];
+		atomic_store_explicit(&heap->page_free_thread[itype], mark->page_free_thread[itype], memory_order_relaxed);
+	}
+}
+
+//! Store the heap state in a new mark and clear the free lists, making all following allocations
+//  use pages initialized after the mark
+static heap_mark_t*
+heap_mark(heap_t* heap) {
+	heap_mark_t mark;
+	heap_mark_store(heap, &mark);
+	heap_reset_lists(heap);
+	heap_mark_t* heap_mark = heap_allocate_block(heap, sizeof(heap_mark_t), 0);
+	if (!heap_mark) {
+		heap_mark_restore_lists(heap, &mark);
+		return 0;
+	}
+	memcpy(heap_mark, &mark, sizeof(heap_mark_t));
+	return heap_mark;
+}
+
+//! Release all pages initialized after the mark and restore the heap state stored in the mark
+static void
+heap_rewind(heap_t* heap, heap_mark_t* heap_mark) {
+	// Mark is allocated from a page initialized after the mark, copy before releasing it
+	heap_mark_t mark;
+	memcpy(&mark, heap_mark, sizeof(heap_mark_t));
+#if ENABLE_SAMPLING
+	sample_purge(heap, mark.sample_generation, 0, 0);
+#endif
+	for (int itype = 0; itype < 3; ++itype) {
+		// Spans filled after the mark and all partial spans are reset, span initialized from at the mark
+		// is kept up to the page count at the mark and put first in the partial list
+		span_t* partial = 0;
+		span_t* span_list[2] = {heap->span_used[itype], heap->span_partial[itype]};
+		span_t* span_end[2] = {mark.span_used[itype], 0};
+		for (int ilist = 0; ilist < 2; ++ilist) {
+			span_t* span = span_list[ilist];
+			while (span != span_end[ilist]) {
+				span_t* span_next = span->next;
+				if (span != mark.span_partial[itype]) {
+					span_reset(span, 0);
+					span->next = partial;
+					partial = span;
+				}
+				span = span_next;
+			}
+		}
+		span_t* span = mark.span_partial[itype];
+		if (span) {
+			span_reset(span, mark.page_initialized[itype]);
+			span->next = partial;
+			partial = span;
+		}
+		heap->span_partial[itype] = partial;
+		heap->span_used[itype] = mark.span_used[itype];
+	}
+	span_t* span = heap->span_used[PAGE_HUGE];
+	while (span != mark.span_used[PAGE_HUGE]) {
+		span_t* span_next = span->next;
+		span_unmap(span);
+		span = span_next;
+	}
+	heap->span_used[PAGE_HUGE] = mark.span_used[PAGE_HUGE];
+	heap_mark_restore_lists(heap, &mark);
+}
+
+//! Map, pre-fault and optionally lock spans for the given number of bytes of pages of the given type
+static int
+heap_pin_reserve(heap_t* heap, page_type_t page_type, size_t size) {
+	size_t page_size = (page_type == PAGE_SMALL) ? SMALL_PAGE_SIZE :
+	                   ((page_type == PAGE_MEDIUM) ? MEDIUM_PAGE_SIZE : LARGE_PAGE_SIZE);
+	size_t page_count = (size + (page_size - 1)) / page_size;
+	while (page_count) {
+		span_t* span = heap_map_span(heap, page_type);
+		if (!span)
+			return -1;
+		span->next = heap->span_partial[page_type];
+		heap->span_partial[page_type] = span;
+		if (page_count < span->page_count)
+			span->page_count = (uint32_t)page_count;
+		page_count -= span->page_count;
+		size_t reserve_size = (size_t)span->page_count * page_size;
+		os_mpopulate(span, reserve_size);
+		if ((heap->pin_flags & RPMALLOC_HEAP_PIN_LOCK) && os_mlock(span, reserve_size))
+			return -1;
+		heap->pin_reserved += reserve_size;
+	}
+	return 0;
+}
+
+static heap_shared_t*
+heap_shared_allocate(void) {
+	size_t shared_size = get_page_aligned_size(sizeof(heap_shared_t));
+	size_t offset = 0;
+	size_t mapped_size = 0;
+	heap_shared_t* shared =
+	    memory_interface_map(global_instance.memory_interface, shared_size, 0, &offset, &mapped_size);
+	if (shared) {
+		memset(shared, 0, sizeof(heap_shared_t));
+		shared->offset = (uint32_t)offset;
+		shared->mapped_size = mapped_size;
+		os_name_mapping(global_instance.memory_interface, shared, offset, mapped_size, RPMALLOC_SMAPS_HEAPMETA, 0);
+	}
+	return shared;
+}
+
+//! Get the sub heap of the calling thread in the shared heap, allocating a new sub heap if needed
+static heap_t*
+heap_shared_thread_heap(heap_shared_t* shared) {
+	uintptr_t thread_id = get_thread_id();
+	heap_t* heap = global_thread_shared_heap;
+	if (EXPECTED(heap && (heap->shared == shared) && (heap->owner_thread == thread_id)))
+		return heap;
+	// Sub heaps are only prepended to the list and never removed while the shared heap is in use,
+	// and only the calling thread can add a sub heap owned by the calling thread
+	heap = (heap_t*)atomic_load_explicit(&shared->heap, memory_order_acquire);
+	while (heap && (heap->owner_thread != thread_id))
+		heap = heap->shared_next;
+	if (!heap) {
+		heap = heap_allocate(&global_instance, 1);
+		if (!heap)
+			return 0;
+		heap->shared = shared;
+		uintptr_t head = atomic_load_explicit(&shared->heap, memory_order_relaxed);
+		do {
+			heap->shared_next = (heap_t*)head;
+		} while (!atomic_compare_exchange_weak_explicit(&shared->heap, &head, (uintptr_t)heap, memory_order_release,
+		                                                memory_order_relaxed));
+	}
+	global_thread_shared_heap = heap;
+	return heap;
+}
+
+//! Free all memory allocated by the sub heaps of the shared heap, keeping spans mapped in the shared
+//  span pool up to the given number of bytes of used pages
+static void
+heap_shared_reset(heap_shared_t* shared, size_t retain_size) {
+	size_t retained = 0;
+	for (int itype = 0; itype < 3; ++itype) {
+		span_t** list = &shared->span_free[itype];
+		while (*list) {
+			span_t* span = *list;
+			size_t span_used_size = (size_t)span->page_dirty * (size_t)span->page_size;
+			if (retained + span_used_size <= retain_size) {
+				retained += span_used_size;
+				list = &span->next;
+			} else {
+				*list = span->next;
+				span_unmap_memory(span);
+			}
+		}
+	}
+	heap_t* heap = (heap_t*)atomic_load_explicit(&shared->heap, memory_order_acquire);
+	while (heap) {
+		retained += heap_reset(heap, retain_size - retained);
+		for (int itype = 0; itype < 3; ++itype) {
+			span_t* span = heap->span_partial[itype];
+			while (span) {
+				span_t* span_next = span->next;
+				atomic_fetch_sub_explicit(&heap->memory_usage, span->mapped_size, memory_order_relaxed);
+				atomic_fetch_sub_explicit(&heap->memory_committed, span_committed_size(span), memory_order_relaxed);
+				span->next = shared->span_free[itype];
+				shared->span_free[itype] = span;
+				span = span_next;
+			}
+			heap->span_partial[itype] = 0;
+		}
+		heap = heap->shared_next;
+	}
+}
+
+#endif
+
+//! Mark the blocks in the free list in the free block map if given, returns the number of blocks in the list.
+//  The walk stops at the first block outside the page, which a list being modified by another thread can reach
+static uint32_t
+page_walk_free_list(page_t* page, block_t* block, uint32_t count_max, uint64_t* free_map) {
+	uint32_t count = 0;
+	uint32_t block_count = (page->block_count < PAGE_BLOCK_COUNT_MAX) ? page->block_count : PAGE_BLOCK_COUNT_MAX;
+	while (block && (count < count_max)) {
+		if ((uintptr_t)block < (uintptr_t)page_block_start(page))
+			break;
+		uint32_t block_index = page_block_index(page, block);
+		if (block_index >= block_count)
+			break;
+		if (free_map)
+			free_map[block_index / 64] |= 1ULL << (block_index % 64);
+		block = block->next;
+		++count;
+	}
+	return count;
+}
+
+//! Fill in the walk entry of the page, marking the blocks in free lists in the free block map if given
+static void
+page_walk_entry(heap_t* heap, page_t* page, rpmalloc_walk_entry_t* entry, uint64_t* free_map) {
+	memset(entry, 0, sizeof(rpmalloc_walk_entry_t));
+	entry->type = RPMALLOC_WALK_PAGE;
+	entry->page_type = page->page_type;
+	entry->heap = heap;
+	entry->address = page;
+	entry->size = page_get_size(page);
+	entry->committed = page->is_decommitted ? global_instance.config.page_size : entry->size;
+	entry->size_class = page->size_class;
+	entry->block_size = page->block_size;
+	entry->block_count = page->block_count;
+	if (page->is_decommitted)
+		entry->flags |= RPMALLOC_WALK_PAGE_DECOMMITTED;
+	if (page->is_free) {
+		entry->flags |= RPMALLOC_WALK_PAGE_FREE;
+		return;
+	}
+	if (page->is_full)
+		entry->flags |= RPMALLOC_WALK_PAGE_FULL;
+	rpmalloc_assert(page->block_count <= PAGE_BLOCK_COUNT_MAX, "Page block count exceeds free block map");
+	entry->block_initialized = page->block_initialized;
+	// Free blocks are in the page local free list, the heap local free list if pushed from this page, and the
+	// deferred list of blocks freed by other threads
+	uint32_t free_count = page_walk_free_list(page, page->local_free, page->local_free_count, free_map);
+	block_t* heap_free = heap->local_free[page->size_class];
+	if (heap_free && (span_get_page_from_block(page_get_span(page), heap_free) == page))
+		free_count += page_walk_free_list(page, heap_free, page->block_count, free_map);
+	block_t* thread_free = 0;
+	uint32_t thread_free_count = page_block_from_thread_free_list(
+	    page, atomic_load_explicit(&page->thread_free, memory_order_acquire), &thread_free);
+	free_count += page_walk_free_list(page, thread_free, thread_free_count, free_map);
+	entry->block_used = (free_count < page->block_initialized) ? (page->block_initialized - free_count) : 0;
+}
+
+//! Walk the span and its initialized pages, and the used blocks in each page if requested
+static int
+span_walk(heap_t* heap, span_t* span, unsigned int flags, rpmalloc_walk_callback_t callback, void* context) {
+	uint64_t free_map[(PAGE_BLOCK_COUNT_MAX + 63) / 64];
+	rpmalloc_walk_entry_t entry;
+	memset(&entry, 0, sizeof(rpmalloc_walk_entry_t));
+	entry.type = RPMALLOC_WALK_SPAN;
+	entry.page_type = span->page_type;
+	entry.heap = heap;
+	entry.address = span;
+	entry.size = span->mapped_size;
+	entry.page_count = span->page_count;
+	entry.page_initialized = span->page_initialized;
+	for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+		page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+		entry.committed += page->is_decommitted ? global_instance.config.page_size : span->page_size;
+	}
+	if (callback(&entry, context))
+		return 1;
+
+	for (uint32_t ipage = 0; ipage < span->page_initialized; ++ipage) {
+		page_t* page = pointer_offset(span, (size_t)span->page_size * ipage);
+		uint64_t* page_free_map = 0;
+		if (flags & RPMALLOC_WALK_BLOCKS) {
+			page_free_map = free_map;
+			memset(free_map, 0, sizeof(free_map));
+		}
+		page_walk_entry(heap, page, &entry, page_free_map);
+		if (callback(&entry, context))
+			return 1;
+		if (!page_free_map || !entry.block_used)
+			continue;
+		entry.type = RPMALLOC_WALK_BLOCK;
+		entry.size = entry.block_size;
+		entry.committed = 0;
+		uint32_t block_initialized =
+		    (entry.block_initialized < PAGE_BLOCK_COUNT_MAX) ? entry.block_initialized : PAGE_BLOCK_COUNT_MAX;
+		for (uint32_t iblock = 0; iblock < block_initialized; ++iblock) {
+			if (free_map[iblock / 64] & (1ULL << (iblock % 64)))
+				continue;
+			entry.address = page_block(page, iblock);
+			if (callback(&entry, context))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+//! Walk the span of a huge block, visited as a span with a single page and block
+static int
+span_walk_huge(heap_t* heap, span_t* span, unsigned int flags, rpmalloc_walk_callback_t callback, void* context) {
+	size_t size = (size_t)span->page_size * (size_t)span->page_count;
+	rpmalloc_walk_entry_t entry;
+	memset(&entry, 0, sizeof(rpmalloc_walk_entry_t));
+	entry.type = RPMALLOC_WALK_SPAN;
+	entry.page_type = PAGE_HUGE;
+	entry.heap = heap;
+	entry.address = span;
+	entry.size = span->mapped_size;
+	entry.committed = size;
+	entry.page_count = 1;
+	entry.page_initialized = 1;
+	if (callback(&entry, context))
+		return 1;
+	entry.type = RPMALLOC_WALK_PAGE;
+	entry.size = size;
+	entry.block_size = size - SPAN_HEADER_SIZE;
+	entry.block_count = 1;
+	entry.block_initialized = 1;
+	entry.block_used = 1;
+	entry.flags = RPMALLOC_WALK_PAGE_FULL;
+	if (callback(&entry, context))
+		return 1;
+	if (!(flags & RPMALLOC_WALK_BLOCKS))
+		return 0;
+	entry.type = RPMALLOC_WALK_BLOCK;
+	entry.address = pointer_offset(span, SPAN_HEADER_SIZE);
+	entry.size = entry.block_size;
+	entry.committed = 0;
+	return callback(&entry, context);
+}
+
+//! Walk all spans of the heap
+static int
+heap_walk(heap_t* heap, unsigned int flags, rpmalloc_walk_callback_t callback, void* context) {
+	for (int itype = 0; itype < 3; ++itype) {
+		for (span_t* span = heap->span_partial[itype]; span; span = span->next) {
+			if (span_walk(heap, span, flags, callback, context))
+				return 1;
+		}
+		for (span_t* span = heap->span_used[itype]; span; span = span->next) {
+			if (span_walk(heap, span, flags, callback, context))
+				return 1;
+		}
+	}
+	int result = 0;
+	heap_shared_lock_acquire(heap->shared);
+	for (span_t* span = heap->span_used[PAGE_HUGE]; span && !result; span = span->next)
+		result = span_walk_huge(heap, span, flags, callback, context);
+	heap_shared_lock_release(heap->shared);
+	return result;
+}
+
+//! Check if a heap in use can be walked by the calling thread, heaps owned by other threads are only walked if the
+//  caller guarantees the threads do not use them during the walk
+static inline int
+heap_walk_is_allowed(heap_t* heap, unsigned int flags) {
+	return !heap->owner_thread || (heap->owner_thread == get_thread_id()) || (flags & RPMALLOC_WALK_ALL_THREADS);
+}
+
+//! Walk the heaps of the instance that can be walked by the calling thread and all released heaps, holding the
+//  heap lock
+static int
+instance_walk(instance_t* instance, unsigned int flags, rpmalloc_walk_callback_t callback, void* context) {
+	int result = 0;
+	heap_lock_acquire(instance);
+	for (heap_t* heap = instance->heap_used; heap && !result; heap = heap->next) {
+		if (heap_walk_is_allowed(heap, flags))
+			result = heap_walk(heap, flags, callback, context);
+	}
+	for (heap_t* heap = instance->heap_queue; heap && !result; heap = heap->next)
+		result = heap_walk(heap, flags, callback, context);
+	heap_lock_release(instance);
+	return result;
+}
+
+//! Heap walk callback accumulating the fragmentation report given as context
+static int
+heap_fragmentation_walk(const rpmalloc_walk_entry_t* entry, void* context) {
+	rpmalloc_fragmentation_t* report = context;
+	if (entry->type == RPMALLOC_WALK_SPAN) {
+		report->mapped += entry->size;
+		return 0;
+	}
+	report->committed += entry->committed;
+	if (entry->page_type == PAGE_HUGE) {
+		++report->huge_count;
+		report->huge_committed += entry->committed;
+		report->live += entry->block_size;
+		return 0;
+	}
+	if (entry->flags & RPMALLOC_WALK_PAGE_FREE) {
+		++report->page_free;
+		report->page_free_committed += entry->committed;
+		return 0;
+	}
+	if (!entry->block_used) {
+		++report->page_empty;
+		report->page_empty_committed += entry->committed;
+		return 0;
+	}
+	size_t live = (size_t)entry->block_used * entry->block_size;
+	report->live += live;
+	report->size_class[entry->size_class].block_size = entry->block_size;
+	++report->size_class[entry->size_class].page_count;
+	report->size_class[entry->size_class].committed += entry->committed;
+	report->size_class[entry->size_class].live += live;
+	// Pages with at most a quarter of the blocks live are candidates for the RSS not explained by live data
+	if (entry->block_used * 4 <= entry->block_count) {
+		++report->page_sparse;
+		report->page_sparse_committed += entry->committed;
+		++report->size_class[entry->size_class].page_sparse;
+	}
+	return 0;
+}
+
+//! Add the fragmentation of the heap to the report
+static void
+heap_fragmentation(heap_t* heap, rpmalloc_fragmentation_t* report) {
+	++report->heap_count;
+	heap_walk(heap, 0, heap_fragmentation_walk, report);
+#if ENABLE_STATISTICS
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		if (!heap->alloc_total[iclass])
+			continue;
+		report->size_class[iclass].block_size = global_size_class[iclass].block_size;
+		report->size_class[iclass].alloc_total += heap->alloc_total[iclass];
+		report->size_class[iclass].requested_total += heap->requested_total[iclass];
+	}
+	report->huge_alloc_total += heap->alloc_total[SIZE_CLASS_COUNT];
+	report->huge_requested_total += heap->requested_total[SIZE_CLASS_COUNT];
+	report->huge_allocated_total += heap->huge_allocated_total;
+#endif
+}
+
+//! Counters of a page type collected for the statistics dump
+typedef struct page_type_statistics_t {
+	//! Number of spans
+	size_t span_count;
+	//! Number of pages in spans
+	size_t page_count;
+	//! Number of initialized pages in spans
+	size_t page_initialized;
+	//! Number of pages in heap free lists
+	size_t page_free;
+	//! Number of decommitted pages
+	size_t page_decommitted;
+	//! Number of bytes mapped
+	size_t mapped;
+	//! Number of bytes committed
+	size_t committed;
+	//! Number of bytes in live blocks
+	size_t live;
+} page_type_statistics_t;
+
+//! Counters of a size class collected for the statistics dump
+typedef struct size_class_statistics_t {
+	//! Number of pages not in heap free lists
+	size_t page_count;
+	//! Number of blocks in pages
+	size_t block_count;
+	//! Number of live blocks in pages
+	size_t block_used;
+	//! Number of bytes committed in pages
+	size_t committed;
+} size_class_statistics_t;
+
+//! Counters collected by walking heaps for the statistics dump
+typedef struct heap_statistics_t {
+	//! Per page type counters of the current heap
+	page_type_statistics_t page_type[4];
+	//! Per page type counters of all heaps
+	page_type_statistics_t page_type_total[4];
+	//! Per size class counters of all heaps
+	size_class_statistics_t size_class[SIZE_CLASS_COUNT];
+} heap_statistics_t;
+
+//! Heap walk callback accumulating the statistics given as context
+static int
+heap_statistics_walk(const rpmalloc_walk_entry_t* entry, void* context) {
+	heap_statistics_t* statistics = context;
+	page_type_statistics_t* page_type = statistics->page_type + entry->page_type;
+	if (entry->type == RPMALLOC_WALK_SPAN) {
+		++page_type->span_count;
+		page_type->page_count += entry->page_count;
+		page_type->page_initialized += entry->page_initialized;
+		page_type->mapped += entry->size;
+		page_type->committed += entry->committed;
+		return 0;
+	}
+	page_type->live += (size_t)entry->block_used * entry->block_size;
+	if (entry->flags & RPMALLOC_WALK_PAGE_DECOMMITTED)
+		++page_type->page_decommitted;
+	if (entry->flags & RPMALLOC_WALK_PAGE_FREE) {
+		++page_type->page_free;
+	} else if (entry->page_type != PAGE_HUGE) {
+		size_class_statistics_t* size_class = statistics->size_class + entry->size_class;
+		++size_class->page_count;
+		size_class->block_count += entry->block_count;
+		size_class->block_used += entry->block_used;
+		size_class->committed += entry->committed;
+	}
+	return 0;
+}
+
+//! Statistics writer into a caller provided buffer, formatting JSON objects or key=value lines
+typedef struct statistics_writer_t {
+	//! Output buffer
+	char* buffer;
+	//! Capacity of output buffer
+	size_t capacity;
+	//! Length of complete output, can exceed capacity
+	size_t length;
+	//! Output format
+	unsigned int format;
+	//! Flag set if no member has been written in the current JSON object
+	int first;
+	//! Key prefix of the current object in key=value format
+	char prefix[64];
+	//! Length of key prefix
+	size_t prefix_length;
+} statistics_writer_t;
+
+static void
+statistics_write(statistics_writer_t* writer, const char* string, size_t length) {
+	// Keep room for the terminator
+	if (writer->length + 1 < writer->capacity) {
+		size_t available = writer->capacity - writer->length - 1;
+		memcpy(writer->buffer + writer->length, string, (length < available) ? length : available);
+	}
+	writer->length += length;
+}
+
+static void
+statistics_write_string(statistics_writer_t* writer, const char* string) {
+	statistics_write(writer, string, strlen(string));
+}
+
+//! Format the value as a decimal number in the given buffer of at least 21 characters, returns the length
+static size_t
+statistics_format_uint(char* buffer, unsigned long long value) {
+	char digits[20];
+	size_t count = 0;
+	do {
+		digits[count++] = (char)('0' + (value % 10));
+		value /= 10;
+	} while (value);
+	for (size_t idigit = 0; idigit < count; ++idigit)
+		buffer[idigit] = digits[count - idigit - 1];
+	buffer[count] = 0;
+	return count;
+}
+
+//! Begin a nested object with the given key
+static void
+statistics_begin(statistics_writer_t* writer, const char* key) {
+	if (writer->format == RPMALLOC_STATISTICS_JSON) {
+		if (!writer->first)
+			statistics_write(writer, ",", 1);
+		statistics_write(writer, "\"", 1);
+		statistics_write_string(writer, key);
+		statistics_write(writer, "\":{", 3);
+		writer->first = 1;
+	} else {
+		size_t length = strlen(key);
+		if (writer->prefix_length + length + 1 < sizeof(writer->prefix)) {
+			memcpy(writer->prefix + writer->prefix_length, key, length);
+			writer->prefix[writer->prefix_length + length] = '.';
+		}
+		writer->prefix_length += length + 1;
+	}
+}
+
+//! End the nested object with the given key
+static void
+statistics_end(statistics_writer_t* writer, const char* key) {
+	if (writer->format == RPMALLOC_STATISTICS_JSON) {
+		statistics_write(writer, "}", 1);
+		writer->first = 0;
+	} else {
+		writer->prefix_length -= strlen(key) + 1;
+	}
+}
+
+//! Write a numeric member of the current object
+static void
+statistics_value(statistics_writer_t* writer, const char* key, unsigned long long value) {
+	char number[24];
+	size_t number_length = statistics_format_uint(number, value);
+	if (writer->format == RPMALLOC_STATISTICS_JSON) {
+		if (!writer->first)
+			statistics_write(writer, ",", 1);
+		statistics_write(writer, "\"", 1);
+		statistics_write_string(writer, key);
+		statistics_write(writer, "\":", 2);
+		statistics_write(writer, number, number_length);
+		writer->first = 0;
+	} else {
+		size_t prefix_length =
+		    (writer->prefix_length < sizeof(writer->prefix)) ? writer->prefix_length : sizeof(writer->prefix);
+		statistics_write(writer, writer->prefix, prefix_length);
+		statistics_write_string(writer, key);
+		statistics_write(writer, "=", 1);
+		statistics_write(writer, number, number_length);
+		statistics_write(writer, "\n", 1);
+	}
+}
+
+static const char* statistics_page_type_name[4] = {"small", "medium", "large", "huge"};
+
+//! Write the per page type counters
+static void
+statistics_write_page_types(statistics_writer_t* writer, const page_type_statistics_t* page_type) {
+	statistics_begin(writer, "page_types");
+	for (int itype = 0; itype < 4; ++itype) {
+		statistics_begin(writer, statistics_page_type_name[itype]);
+		statistics_value(writer, "spans", page_type[itype].span_count);
+		statistics_value(writer, "pages", page_type[itype].page_count);
+		statistics_value(writer, "pages_initialized", page_type[itype].page_initialized);
+		statistics_value(writer, "pages_free", page_type[itype].page_free);
+		statistics_value(writer, "pages_decommitted", page_type[itype].page_decommitted);
+		statistics_value(writer, "mapped", page_type[itype].mapped);
+		statistics_value(writer, "committed", page_type[itype].committed);
+		statistics_value(writer, "live", page_type[itype].live);
+		statistics_end(writer, statistics_page_type_name[itype]);
+	}
+	statistics_end(writer, "page_types");
+}
+
+#if ENABLE_STATISTICS
+
+//! Write the non-empty buckets of a histogram of blocks adopted from page thread free lists
+static void
+statistics_write_adopt_batches(statistics_writer_t* writer, const size_t* adopt_batch) {
+	statistics_begin(writer, "adopt_batches");
+	for (uint32_t ibucket = 0; ibucket < ADOPT_BATCH_BUCKET_COUNT; ++ibucket) {
+		if (adopt_batch[ibucket]) {
+			char name[24];
+			statistics_format_uint(name, ibucket);
+			statistics_value(writer, name, adopt_batch[ibucket]);
+		}
+	}
+	statistics_end(writer, "adopt_batches");
+}
+
+//! Write the sampled cross thread free counts by heap pair, scaled by the sample period
+static void
+statistics_write_remote_frees(statistics_writer_t* writer) {
+	statistics_begin(writer, "remote_free_pairs");
+	statistics_value(writer, "sample_period", REMOTE_FREE_SAMPLE_PERIOD);
+	uintptr_t lock = 0;
+	while (!atomic_compare_exchange_strong(&global_statistics_remote_free_lock, &lock, 1)) {
+		lock = 0;
+		wait_spin();
+	}
+	for (uint32_t ipair = 0; ipair < REMOTE_FREE_PAIR_COUNT; ++ipair) {
+		statistics_remote_free_t* entry = global_statistics_remote_free + ipair;
+		if (!entry->heap_free)
+			continue;
+		char name[48];
+		size_t length = statistics_format_uint(name, entry->heap_free);
+		name[length++] = '-';
+		statistics_format_uint(name + length, entry->heap_owner);
+		statistics_value(writer, name, entry->count * REMOTE_FREE_SAMPLE_PERIOD);
+	}
+	statistics_value(writer, "other", global_statistics_remote_free_other * REMOTE_FREE_SAMPLE_PERIOD);
+	atomic_store_explicit(&global_statistics_remote_free_lock, 0, memory_order_release);
+	statistics_end(writer, "remote_free_pairs");
+}
+
+#endif
+
+//! Write the counters of the heap and add its page type counters to the totals
+static void
+statistics_write_heap(statistics_writer_t* writer, heap_t* heap, heap_statistics_t* statistics) {
+	memset(statistics->page_type, 0, sizeof(statistics->page_type));
+	heap_walk(heap, 0, heap_statistics_walk, statistics);
+	size_t committed = 0;
+	size_t live = 0;
+	for (int itype = 0; itype < 4; ++itype) {
+		page_type_statistics_t* total = statistics->page_type_total + itype;
+		page_type_statistics_t* page_type = statistics->page_type + itype;
+		total->span_count += page_type->span_count;
+		total->page_count += page_type->page_count;
+		total->page_initialized += page_type->page_initialized;
+		total->page_free += page_type->page_free;
+		total->page_decommitted += page_type->page_decommitted;
+		total->mapped += page_type->mapped;
+		total->committed += page_type->committed;
+		total->live += page_type->live;
+		committed += page_type->committed;
+		live += page_type->live;
+	}
+	char id[24];
+	statistics_format_uint(id, heap->id);
+	statistics_begin(writer, id);
+	statistics_value(writer, "first_class", heap->first_class);
+	statistics_value(writer, "mapped", atomic_load_explicit(&heap->memory_usage, memory_order_relaxed));
+	statistics_value(writer, "committed", committed);
+	statistics_value(writer, "live", live);
+	statistics_value(writer, "map_calls", heap->map_count);
+	statistics_value(writer, "unmap_calls", atomic_load_explicit(&heap->unmap_count, memory_order_relaxed));
+	statistics_value(writer, "commit_calls", heap->commit_count);
+	statistics_value(writer, "decommit_calls", heap->decommit_count);
+#if ENABLE_STATISTICS
+	statistics_value(writer, "remote_frees", heap->remote_free_count);
+	statistics_write_adopt_batches(writer, heap->adopt_batch);
+#endif
+	statistics_write_page_types(writer, statistics->page_type);
+	statistics_end(writer, id);
+}
+
+#if ENABLE_LATENCY
+
+static const char* latency_path_name[LATENCY_PATH_COUNT] = {"span_map",   "page_commit", "page_decommit",
+                                                            "huge_map",   "huge_unmap",  "thread_free_adopt"};
+
+//! Write the latency histograms of the slow paths, skipping paths never taken
+static void
+latency_write_paths(statistics_writer_t* writer, const latency_histogram_t* latency) {
+	for (uint32_t ipath = 0; ipath < LATENCY_PATH_COUNT; ++ipath) {
+		const latency_histogram_t* histogram = latency + ipath;
+		if (!histogram->count)
+			continue;
+		statistics_begin(writer, latency_path_name[ipath]);
+		statistics_value(writer, "count", histogram->count);
+		statistics_value(writer, "ticks", histogram->ticks);
+		statistics_begin(writer, "buckets");
+		for (uint32_t ibucket = 0; ibucket < LATENCY_BUCKET_COUNT; ++ibucket) {
+			if (histogram->bucket[ibucket]) {
+				char name[24];
+				statistics_format_uint(name, ibucket);
+				statistics_value(writer, name, histogram->bucket[ibucket]);
+			}
+		}
+		statistics_end(writer, "buckets");
+		statistics_end(writer, latency_path_name[ipath]);
+	}
+}
+
+#endif
+
+#if ENABLE_SAMPLING
+
+//! Write the live and accumulated counts and sizes of a heap profile record
+static void
+sample_write_counts(statistics_writer_t* writer, size_t live_count, size_t live_size, size_t alloc_count,
+                    size_t alloc_size) {
+	char number[24];
+	statistics_write(writer, number, statistics_format_uint(number, live_count));
+	statistics_write(writer, ": ", 2);
+	statistics_write(writer, number, statistics_format_uint(number, live_size));
+	statistics_write(writer, " [", 2);
+	statistics_write(writer, number, statistics_format_uint(number, alloc_count));
+	statistics_write(writer, ": ", 2);
+	statistics_write(writer, number, statistics_format_uint(number, alloc_size));
+	statistics_write(writer, "] @", 3);
+}
+
+//! Write the address as a hexadecimal number with a leading space and 0x prefix
+static void
+sample_write_address(statistics_writer_t* writer, const void* address) {
+	char digits[2 + (sizeof(uintptr_t) * 2)];
+	uintptr_t value = (uintptr_t)address;
+	size_t count = sizeof(digits);
+	do {
+		digits[--count] = "0123456789abcdef"[value & 0xF];
+		value >>= 4;
+	} while (value);
+	statistics_write(writer, " 0x", 3);
+	statistics_write(writer, digits + count, sizeof(digits) - count);
+}
+
+//! Write the non-empty buckets of a lifetime histogram
+static void
+sample_write_lifetime(statistics_writer_t* writer, const size_t* lifetime) {
+	statistics_begin(writer, "lifetime");
+	for (uint32_t ibucket = 0; ibucket < SAMPLE_LIFETIME_BUCKET_COUNT; ++ibucket) {
+		if (lifetime[ibucket]) {
+			char name[24];
+			statistics_format_uint(name, ibucket);
+			statistics_value(writer, name, lifetime[ibucket]);
+		}
+	}
+	statistics_end(writer, "lifetime");
+}
+
+//! Append the content of the file, used for the mapped libraries section needed to symbolize the profile
+static void
+sample_write_file(statistics_writer_t* writer, const char* path) {
+#if PLATFORM_POSIX
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	char buffer[4096];
+	ssize_t read_size;
+	while ((read_size = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (read_size < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		statistics_write(writer, buffer, (size_t)read_size);
+	}
+	close(fd);
+#else
+	(void)sizeof(writer);
+	(void)sizeof(path);
+#endif
+}
+
+#endif
+
+#if defined(__linux__) || defined(__ANDROID__)
+
+//! State when parsing /proc/<pid>/smaps
+typedef struct smaps_parser_t {
+	//! Report being accumulated
+	rpmalloc_smaps_t* report;
+	//! Region name prefix
+	const char* prefix;
+	//! Length of region name prefix
+	size_t prefix_length;
+	//! Usage records the current region is accounted to, all null if not an allocator region
+	rpmalloc_smaps_usage_t* usage[3];
+} smaps_parser_t;
+
+//! Get the usage record of the given label, or the overflow record if the label table is full
+static rpmalloc_smaps_usage_t*
+smaps_label_usage(rpmalloc_smaps_t* report, const char* label, size_t length) {
+	if (length >= sizeof(report->label[0].label))
+		length = sizeof(report->label[0].label) - 1;
+	for (size_t ilabel = 0; ilabel < report->label_count; ++ilabel) {
+		if (!strncmp(report->label[ilabel].label, label, length) && !report->label[ilabel].label[length])
+			return &report->label[ilabel].usage;
+	}
+	if (report->label_count == RPMALLOC_SMAPS_LABEL_COUNT)
+		return &report->label_other;
+	memcpy(report->label[report->label_count].label, label, length);
+	report->label[report->label_count].label[length] = 0;
+	return &report->label[report->label_count++].usage;
+}
+
+//! Parse a region header line, selecting the usage records the following attribute lines are accounted to
+static void
+smaps_parse_region(smaps_parser_t* parser, const char* line) {
+	parser->usage[0] = parser->usage[1] = parser->usage[2] = 0;
+	const char* name = strstr(line, "[anon:");
+	if (!name)
+		return;
+	name += 6;
+	if (strncmp(name, parser->prefix, parser->prefix_length) || (name[parser->prefix_length] != '-'))
+		return;
+	name += parser->prefix_length + 1;
+	size_t length = 0;
+	while (name[length] && (name[length] != ':') && (name[length] != ']'))
+		++length;
+	unsigned int category = 0;
+	while ((category < RPMALLOC_SMAPS_CATEGORY_COUNT) &&
+	       ((strlen(os_page_category_name[category]) != length) ||
+	        strncmp(name, os_page_category_name[category], length)))
+		++category;
+	if (category == RPMALLOC_SMAPS_CATEGORY_COUNT)
+		return;
+	parser->usage[0] = &parser->report->total;
+	parser->usage[1] = &parser->report->category[category];
+	if (name[length] == ':') {
+		const char* label = name + length + 1;
+		length = 0;
+		while (label[length] && (label[length] != ']'))
+			++length;
+		parser->usage[2] = smaps_label_usage(parser->report, label, length);
+	}
+	for (int iusage = 0; iusage < 3; ++iusage) {
+		if (parser->usage[iusage])
+			++parser->usage[iusage]->regions;
+	}
+}
+
+//! Parse a line of the smaps file, either a region header or an attribute of the current region
+static void
+smaps_parse_line(smaps_parser_t* parser, const char* line) {
+	// Region header lines start with the hexadecimal address range
+	const char* address = line;
+	while (((*address >= '0') && (*address <= '9')) || ((*address >= 'a') && (*address <= 'f')))
+		++address;
+	if ((address != line) && (*address == '-')) {
+		smaps_parse_region(parser, line);
+		return;
+	}
+	if (!parser->usage[0])
+		return;
+	size_t field;
+	if (!strncmp(line, "Size:", 5))
+		field = offsetof(rpmalloc_smaps_usage_t, size);
+	else if (!strncmp(line, "Rss:", 4))
+		field = offsetof(rpmalloc_smaps_usage_t, rss);
+	else if (!strncmp(line, "Pss:", 4))
+		field = offsetof(rpmalloc_smaps_usage_t, pss);
+	else if (!strncmp(line, "Swap:", 5))
+		field = offsetof(rpmalloc_smaps_usage_t, swap);
+	else
+		return;
+	const char* value = strchr(line, ':') + 1;
+	while (*value == ' ')
+		++value;
+	size_t kilobytes = 0;
+	for (; (*value >= '0') && (*value <= '9'); ++value)
+		kilobytes = (kilobytes * 10) + (size_t)(*value - '0');
+	for (int iusage = 0; iusage < 3; ++iusage) {
+		if (parser->usage[iusage])
+			*(size_t*)pointer_offset(parser->usage[iusage], field) += kilobytes * 1024;
+	}
+}
+
+#endif
+
+#if PLATFORM_POSIX
+
+//! Update the statistics export segment with the current counters, using the sequence counter as a seqlock
+static void
+statistics_export_update(rpmalloc_statistics_export_t* segment) {
+	// Only counters that are safe to read while other threads use their heaps, pages are never walked
+	unsigned long long heaps = 0;
+	unsigned long long heaps_active = 0;
+	unsigned long long mapped = 0;
+	unsigned long long map_calls = 0;
+	unsigned long long unmap_calls = 0;
+	unsigned long long commit_calls = 0;
+	unsigned long long decommit_calls = 0;
+	heap_lock_acquire(&global_instance);
+	for (int ilist = 0; ilist < 2; ++ilist) {
+		heap_t* heap = ilist ? global_instance.heap_queue : global_instance.heap_used;
+		for (; heap; heap = heap->next) {
+			++heaps;
+			if (!ilist)
+				++heaps_active;
+			mapped += atomic_load_explicit(&heap->memory_usage, memory_order_relaxed);
+			map_calls += heap->map_count;
+			unmap_calls += atomic_load_explicit(&heap->unmap_count, memory_order_relaxed);
+			commit_calls += heap->commit_count;
+			decommit_calls += heap->decommit_count;
+		}
+	}
+	heap_lock_release(&global_instance);
+	unsigned long long spans = 0;
+	for (size_t iword = 0; iword < SPAN_MAP_WORD_COUNT; ++iword) {
+		uintptr_t word = atomic_load_explicit(&global_span_map[iword], memory_order_relaxed);
+		if (word)
+			spans += (unsigned long long)__builtin_popcountll((unsigned long long)word);
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	atomic_ullong* sequence = (atomic_ullong*)&segment->sequence;
+	unsigned long long sequence_value = atomic_load_explicit(sequence, memory_order_relaxed);
+	atomic_store_explicit(sequence, sequence_value + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	segment->timestamp = (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+	++segment->update_count;
+	segment->heaps = heaps;
+	segment->heaps_active = heaps_active;
+	segment->spans = spans;
+	segment->mapped = mapped;
+	segment->map_calls = map_calls;
+	segment->unmap_calls = unmap_calls;
+	segment->commit_calls = commit_calls;
+	segment->decommit_calls = decommit_calls;
+#if ENABLE_STATISTICS
+	segment->os_pages_mapped = atomic_load_explicit(&global_statistics.page_mapped, memory_order_relaxed);
+	segment->os_pages_mapped_peak = atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed);
+	segment->os_pages_active = atomic_load_explicit(&global_statistics.page_active, memory_order_relaxed);
+	segment->os_pages_active_peak = atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed);
+	segment->os_pages_committed = atomic_load_explicit(&global_statistics.page_commit, memory_order_relaxed);
+	segment->os_pages_decommitted = atomic_load_explicit(&global_statistics.page_decommit, memory_order_relaxed);
+	segment->heaps_created = atomic_load_explicit(&global_statistics.heap_count, memory_order_relaxed);
+#endif
+	atomic_store_explicit(sequence, sequence_value + 2, memory_order_release);
+}
+
+//! Statistics export thread, updates the segment at the configured interval until stopped
+static void*
+statistics_export_thread(void* argument) {
+	rpmalloc_statistics_export_t* segment = argument;
+	pthread_mutex_lock(&global_statistics_export_lock);
+	while (!global_statistics_export_stop) {
+		statistics_export_update(segment);
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		unsigned long long nanoseconds =
+		    (unsigned long long)deadline.tv_nsec + (segment->interval * 1000000ULL);
+		deadline.tv_sec += (time_t)(nanoseconds / 1000000000ULL);
+		deadline.tv_nsec = (long)(nanoseconds % 1000000000ULL);
+		while (!global_statistics_export_stop &&
+		       (pthread_cond_timedwait(&global_statistics_export_signal, &global_statistics_export_lock,
+		                               &deadline) == 0)) {
+		}
+	}
+	pthread_mutex_unlock(&global_statistics_export_lock);
+	return 0;
+}
+
+
+//! Check if the shared memory segment with the given name is a statistics export left by a process that
+//  terminated without stopping the export
+static int
+statistics_export_is_stale(const char* name) {
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	struct stat segment_stat;
+	void* address = MAP_FAILED;
+	size_t size = sizeof(rpmalloc_statistics_export_t);
+	if (!fstat(fd, &segment_stat) && ((size_t)segment_stat.st_size == size))
+		address = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED)
+		return 0;
+	const rpmalloc_statistics_export_t* segment = address;
+	unsigned long long magic = atomic_load_explicit((const atomic_ullong*)&segment->magic, memory_order_acquire);
+	int stale = 0;
+	if ((magic == RPMALLOC_STATISTICS_EXPORT_MAGIC) && segment->pid)
+		stale = (kill((pid_t)segment->pid, 0) != 0) && (errno == ESRCH);
+	munmap(address, size);
+	return stale;
+}
+
+#endif
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+#if PLATFORM_POSIX
+
+//! Claim a run of free span slots for the given size, first fit in the slots following the header span.
+//  Returns the first slot of the run, or zero if there is no run of free slots large enough
+static uint32_t
+span_slot_claim(uint32_t* slot, uint32_t span_count, size_t size) {
+	uint32_t count = (uint32_t)((size + (SPAN_SIZE - 1)) / SPAN_SIZE);
+	uint32_t first = 1;
+	while (first + count <= span_count) {
+		uint32_t islot = 0;
+		while ((islot < count) && !slot[first + islot])
+			++islot;
+		if (islot == count) {
+			slot[first] = count;
+			for (islot = 1; islot < count; ++islot)
+				slot[first + islot] = PERSISTENT_SLOT_CONTINUED;
+			return first;
+		}
+		first += islot + 1;
+	}
+	return 0;
+}
+
+//! Release the run of span slots mapped at the given address in a shared file mapping
+static void
+span_slot_release(uint32_t* slot, uint32_t first, void* address, size_t mapped_size) {
+	uint32_t count = slot[first];
+	// Free the file blocks so the range reads back as zero when mapped again, like anonymous memory
+#if defined(MADV_REMOVE)
+	if (madvise(address, mapped_size, MADV_REMOVE))
+#endif
+		memset(address, 0, mapped_size);
+	for (uint32_t islot = 0; islot < count; ++islot)
+		slot[first + islot] = 0;
+}
+
+//! Remove the spans of a region from the span map before the region is unmapped
+static void
+span_map_remove_region(void* region, size_t size) {
+	for (size_t offset = SPAN_SIZE; offset < size; offset += SPAN_SIZE)
+		span_map_remove(pointer_offset(region, offset));
+#if ENABLE_SAMPLING
+	sample_purge(0, 0, region, size);
+#endif
 }
 
+//! Map spans from the persistent heap region
 static void*
-heap_reallocate_block_aligned(heap_t* heap, void* block, size_t alignment, size_t size, size_t old_size,
-                              unsigned int flags) {
-	if (alignment <= SMALL_GRANULARITY)
-		return heap_reallocate_block(heap, block, size, old_size, flags);
+persistent_memory_map(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	(void)sizeof(alignment);
+	heap_persistent_t* region = global_persistent_region;
+	uint32_t first = span_slot_claim(region->slot, region->span_count, size);
+	if (!first)
+		return 0;
+	*offset = 0;
+	*mapped_size = (size_t)region->slot[first] * SPAN_SIZE;
+	return pointer_offset(region, (size_t)first * SPAN_SIZE);
+}
 
-	int no_alloc = !!(flags & RPMALLOC_GROW_OR_FAIL);
-	size_t usable_size = (block ? block_usable_size(block) : 0);
-	if ((usable_size >= size) && !((uintptr_t)block & (alignment - 1))) {
-		if (no_alloc || (size >= (usable_size / 2)))
-			return block;
-	}
-	// Aligned alloc marks span as having aligned blocks
-	void* old_block = block;
-	block = (!no_alloc ? heap_allocate_block_aligned(heap, alignment, size, 0) : 0);
-	if (EXPECTED(block != 0)) {
-		if (!(flags & RPMALLOC_NO_PRESERVE) && old_block) {
-			if (!old_size)
-				old_size = usable_size;
-			memcpy(block, old_block, old_size < size ? old_size : size);
-		}
-		if (EXPECTED(old_block != 0))
-			block_deallocate(old_block);
-	}
-	return block;
+//! Return spans to the persistent heap region
+static void
+persistent_memory_unmap(void* address, size_t offset, size_t mapped_size) {
+	(void)sizeof(offset);
+	heap_persistent_t* region = global_persistent_region;
+	uint32_t first = (uint32_t)((uintptr_t)pointer_diff(address, region) / SPAN_SIZE);
+	span_slot_release(region->slot, first, address, mapped_size);
 }
 
+//! Persistent memory is never decommitted, decommitted file pages would not read back as zero
 static void
-heap_free_all(heap_t* heap) {
+persistent_memory_commit(void* address, size_t size) {
+	(void)sizeof(address);
+	(void)sizeof(size);
+}
+
+//! Set the process local state of the heap in the persistent region for the calling process
+static void
+persistent_heap_bind(heap_t* heap) {
+	heap->id = 1 + atomic_fetch_add_explicit(&global_heap_id, 1, memory_order_relaxed);
+	heap->owner_thread = 0;
+	heap->finalize = 0;
+	heap->next = 0;
+	heap->prev = 0;
+#if ENABLE_STATISTICS
+	memset(heap->alloc_total, 0, sizeof(heap->alloc_total));
+	memset(heap->requested_total, 0, sizeof(heap->requested_total));
+	heap->huge_allocated_total = 0;
+#endif
+	heap_reset_process_state(heap, &global_persistent_instance, 1);
+	// Spans store the index of the memory interface, which is only valid in the process that mapped the span
 	for (int itype = 0; itype < 3; ++itype) {
-		span_t* span = heap->span_partial[itype];
-		while (span) {
-			span_t* span_next = span->next;
-			global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
-			span = span_next;
+		for (span_t* span = heap->span_partial[itype]; span; span = span->next) {
+			span->memory_interface = heap->memory_interface;
+			span_map_insert(span);
 		}
-		heap->span_partial[itype] = 0;
-		heap->page_free[itype] = 0;
-		heap->page_free_commit_count[itype] = 0;
-		atomic_store_explicit(&heap->page_free_thread[itype], 0, memory_order_relaxed);
 	}
 	for (int itype = 0; itype < 4; ++itype) {
-		span_t* span = heap->span_used[itype];
-		while (span) {
-			span_t* span_next = span->next;
-			global_memory_interface->memory_unmap(span, span->offset, span->mapped_size);
-			span = span_next;
+		for (span_t* span = heap->span_used[itype]; span; span = span->next) {
+			span->memory_interface = heap->memory_interface;
+			span_map_insert(span);
 		}
-		heap->span_used[itype] = 0;
 	}
-	memset(heap->local_free, 0, sizeof(heap->local_free));
-	memset(heap->page_available, 0, sizeof(heap->page_available));
+}
 
-#if ENABLE_STATISTICS
-	// TODO: Fix
-#endif
+//! Write the persistent region back to the file, then set the given state
+static int
+persistent_sync(heap_persistent_t* region, uint32_t state) {
+	region->state = PERSISTENT_STATE_CLEAN;
+	++region->checkpoint;
+	if (msync(region, region->size, MS_SYNC))
+		return -1;
+	if (state != PERSISTENT_STATE_CLEAN) {
+		region->state = state;
+		if (msync(region, os_page_size, MS_SYNC))
+			return -1;
+	}
+	return 0;
+}
+
+//! Map spans from the cross process heap region
+static void*
+ipc_memory_map(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	(void)sizeof(alignment);
+	heap_ipc_t* region = global_ipc_region;
+	heap_shared_lock_acquire(&region->shared);
+	uint32_t first = span_slot_claim(region->slot, region->span_count, size);
+	heap_shared_lock_release(&region->shared);
+	if (!first)
+		return 0;
+	*offset = 0;
+	*mapped_size = (size_t)region->slot[first] * SPAN_SIZE;
+	return pointer_offset(region, (size_t)first * SPAN_SIZE);
+}
+
+//! Return spans to the cross process heap region, can be called by any process for huge blocks
+static void
+ipc_memory_unmap(void* address, size_t offset, size_t mapped_size) {
+	(void)sizeof(offset);
+	heap_ipc_t* region = global_ipc_region;
+	uint32_t first = (uint32_t)((uintptr_t)pointer_diff(address, region) / SPAN_SIZE);
+	heap_shared_lock_acquire(&region->shared);
+	span_slot_release(region->slot, first, address, mapped_size);
+	heap_shared_lock_release(&region->shared);
+}
+
+//! Check if the pointer is in a span mapped from the cross process heap region by any process
+static int
+ipc_span_is_mapped(heap_ipc_t* region, const void* ptr) {
+	uintptr_t offset = (uintptr_t)ptr - (uintptr_t)region;
+	if (((uintptr_t)ptr < (uintptr_t)region) || (offset >= region->size) || (offset < SPAN_SIZE))
+		return 0;
+	uint32_t slot = region->slot[offset / SPAN_SIZE];
+	return (slot != 0) && (slot != PERSISTENT_SLOT_CONTINUED);
+}
+
+//! Update the process ID in the child process after fork
+static void
+ipc_atfork_child(void) {
+	global_process_id = (uint32_t)getpid();
+}
+
+//! Map the cross process heap region from the given shared memory file and set up the process local state
+static heap_ipc_t*
+ipc_map(int fd, void* base, size_t size, int create) {
+	void* address = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED)
+		return 0;
+	heap_ipc_t* region = address;
+	if ((address != base) ||
+	    (!create && ((region->magic != IPC_MAGIC) || (region->version != IPC_VERSION) ||
+	                 (region->heap_size != sizeof(heap_t)) || (region->base != (uintptr_t)base)))) {
+		munmap(address, size);
+		return 0;
+	}
+	if (create) {
+		region->magic = IPC_MAGIC;
+		region->version = IPC_VERSION;
+		region->heap_size = sizeof(heap_t);
+		region->span_count = (uint32_t)(size / SPAN_SIZE);
+		region->base = (uintptr_t)base;
+		region->size = size;
+		region->slot[0] = 1;
+	}
+
+	if (!global_process_id)
+		pthread_atfork(0, 0, ipc_atfork_child);
+	global_process_id = (uint32_t)getpid();
+	global_memory_interface_ipc.memory_map = ipc_memory_map;
+	global_memory_interface_ipc.memory_commit = persistent_memory_commit;
+	global_memory_interface_ipc.memory_decommit = persistent_memory_commit;
+	global_memory_interface_ipc.memory_unmap = ipc_memory_unmap;
+	global_memory_interface_table[MEMORY_INTERFACE_IPC] = &global_memory_interface_ipc;
+	memset(&global_ipc_instance, 0, sizeof(instance_t));
+	global_ipc_instance.config.page_size = global_instance.config.page_size;
+	global_ipc_instance.config.disable_decommit = 1;
+	global_ipc_instance.memory_interface = &global_memory_interface_ipc;
+	global_ipc_instance.memory_interface_index = MEMORY_INTERFACE_IPC;
+	global_ipc_region = region;
+	return region;
 }
 
+#endif
+
+#endif
+
 ////////////
 ///
 /// Extern interface
@@ -1809,6 +4934,7 @@ extern inline void
 rpfree(void* ptr) {
 	if (UNEXPECTED(ptr == 0))
 		return;
+	rpmalloc_assert(rpmalloc_owns(ptr), "Pointer not owned by allocator");
 	block_deallocate(ptr);
 }
 
@@ -1917,6 +5043,19 @@ rpmalloc_usable_size(void* ptr) {
 	return (ptr ? block_usable_size(ptr) : 0);
 }
 
+extern inline int
+rpmalloc_owns(const void* ptr) {
+	if (span_map_contains(ptr))
+		return 1;
+#if RPMALLOC_FIRST_CLASS_HEAPS && PLATFORM_POSIX
+	// Spans in the cross process heap region can be mapped by other processes
+	heap_ipc_t* region = global_ipc_region;
+	if (UNEXPECTED(region != 0))
+		return ipc_span_is_mapped(region, ptr);
+#endif
+	return 0;
+}
+
 ////////////
 ///
 /// Initialization and finalization
@@ -1938,21 +5077,69 @@ rpmalloc_initialize_config(rpmalloc_interface_t* memory_interface, rpmalloc_conf
 	if (global_rpmalloc_initialized) {
 		rpmalloc_thread_initialize();
 		if (config)
-			*config = global_config;
+			*config = global_instance.config;
 		return 0;
 	}
 
 	if (config)
-		global_config = *config;
+		global_instance.config = *config;
 
 	int result = rpmalloc_initialize(memory_interface);
 
 	if (config)
-		*config = global_config;
+		*config = global_instance.config;
 
 	return result;
 }
 
+//! Detect huge page support, acquiring the privileges needed to map huge pages if required. Returns the huge
+//  page size, or zero if huge pages are not supported
+static size_t
+os_huge_page_detect(void) {
+	size_t huge_page_size = 0;
+#if PLATFORM_WINDOWS
+	HANDLE token = 0;
+	size_t large_page_minimum = GetLargePageMinimum();
+	if (large_page_minimum)
+		OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token);
+	if (token) {
+		LUID luid;
+		if (LookupPrivilegeValue(0, SE_LOCK_MEMORY_NAME, &luid)) {
+			TOKEN_PRIVILEGES token_privileges;
+			memset(&token_privileges, 0, sizeof(token_privileges));
+			token_privileges.PrivilegeCount = 1;
+			token_privileges.Privileges[0].Luid = luid;
+			token_privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+			if (AdjustTokenPrivileges(token, FALSE, &token_privileges, 0, 0, 0)) {
+				if (GetLastError() == ERROR_SUCCESS)
+					huge_page_size = large_page_minimum;
+			}
+		}
+		CloseHandle(token);
+	}
+#elif defined(__linux__)
+	FILE* meminfo = fopen("/proc/meminfo", "r");
+	if (meminfo) {
+		char line[128];
+		while (!huge_page_size && fgets(line, sizeof(line) - 1, meminfo)) {
+			line[sizeof(line) - 1] = 0;
+			if (strstr(line, "Hugepagesize:"))
+				huge_page_size = (size_t)strtol(line + 13, 0, 10) * 1024;
+		}
+		fclose(meminfo);
+	}
+#elif defined(__FreeBSD__)
+	int rc;
+	size_t sz = sizeof(rc);
+
+	if (sysctlbyname("vm.pmap.pg_ps_enabled", &rc, &sz, NULL, 0) == 0 && rc == 1)
+		huge_page_size = 2 * 1024 * 1024;
+#elif defined(__APPLE__) || defined(__NetBSD__)
+	huge_page_size = 2 * 1024 * 1024;
+#endif
+	return huge_page_size;
+}
+
 extern int
 rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 	if (global_rpmalloc_initialized) {
@@ -1961,14 +5148,30 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 	}
 
 	global_rpmalloc_initialized = 1;
+#if ENABLE_LATENCY
+	global_latency_start_ticks = cpu_ticks();
+	global_latency_start_time = monotonic_time();
+#endif
+
+	global_memory_interface_default.memory_map = os_mmap;
+	global_memory_interface_default.memory_commit = os_mcommit;
+	global_memory_interface_default.memory_decommit = os_mdecommit;
+	global_memory_interface_default.memory_unmap = os_munmap;
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	global_memory_interface_huge = global_memory_interface_default;
+	global_memory_interface_huge.memory_map = os_mmap_huge;
+#endif
 
-	global_memory_interface = memory_interface ? memory_interface : &global_memory_interface_default;
-	if (!global_memory_interface->memory_map || !global_memory_interface->memory_unmap) {
-		global_memory_interface->memory_map = os_mmap;
-		global_memory_interface->memory_commit = os_mcommit;
-		global_memory_interface->memory_decommit = os_mdecommit;
-		global_memory_interface->memory_unmap = os_munmap;
+	global_instance.memory_interface = memory_interface ? memory_interface : &global_memory_interface_default;
+	if (!global_instance.memory_interface->memory_map || !global_instance.memory_interface->memory_unmap) {
+		global_instance.memory_interface->memory_map = os_mmap;
+		global_instance.memory_interface->memory_commit = os_mcommit;
+		global_instance.memory_interface->memory_decommit = os_mdecommit;
+		global_instance.memory_interface->memory_unmap = os_munmap;
 	}
+	global_memory_interface_table[0] = global_instance.memory_interface;
+	global_instance.memory_interface_index = 0;
+	atomic_store_explicit(&global_memory_interface_count, 1, memory_order_relaxed);
 
 #if PLATFORM_WINDOWS
 	SYSTEM_INFO system_info;
@@ -1984,75 +5187,23 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 #else
 	os_page_size = os_map_granularity;
 #endif
-	if (global_config.enable_huge_pages) {
-#if PLATFORM_WINDOWS
-		HANDLE token = 0;
-		size_t large_page_minimum = GetLargePageMinimum();
-		if (large_page_minimum)
-			OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token);
-		if (token) {
-			LUID luid;
-			if (LookupPrivilegeValue(0, SE_LOCK_MEMORY_NAME, &luid)) {
-				TOKEN_PRIVILEGES token_privileges;
-				memset(&token_privileges, 0, sizeof(token_privileges));
-				token_privileges.PrivilegeCount = 1;
-				token_privileges.Privileges[0].Luid = luid;
-				token_privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-				if (AdjustTokenPrivileges(token, FALSE, &token_privileges, 0, 0, 0)) {
-					if (GetLastError() == ERROR_SUCCESS)
-						os_huge_pages = 1;
-				}
-			}
-			CloseHandle(token);
-		}
-		if (os_huge_pages) {
-			if (large_page_minimum > os_page_size)
-				os_page_size = large_page_minimum;
-			if (large_page_minimum > os_map_granularity)
-				os_map_granularity = large_page_minimum;
-		}
-#elif defined(__linux__)
-		size_t huge_page_size = 0;
-		FILE* meminfo = fopen("/proc/meminfo", "r");
-		if (meminfo) {
-			char line[128];
-			while (!huge_page_size && fgets(line, sizeof(line) - 1, meminfo)) {
-				line[sizeof(line) - 1] = 0;
-				if (strstr(line, "Hugepagesize:"))
-					huge_page_size = (size_t)strtol(line + 13, 0, 10) * 1024;
-			}
-			fclose(meminfo);
-		}
-		if (huge_page_size) {
-			os_huge_pages = 1;
-			os_page_size = huge_page_size;
-			os_map_granularity = huge_page_size;
-		}
-#elif defined(__FreeBSD__)
-		int rc;
-		size_t sz = sizeof(rc);
-
-		if (sysctlbyname("vm.pmap.pg_ps_enabled", &rc, &sz, NULL, 0) == 0 && rc == 1) {
-			os_huge_pages = 1;
-			os_page_size = 2 * 1024 * 1024;
-			os_map_granularity = os_page_size;
-		}
-#elif defined(__APPLE__) || defined(__NetBSD__)
-		os_huge_pages = 1;
-		os_page_size = 2 * 1024 * 1024;
-		os_map_granularity = os_page_size;
-#endif
-	} else {
-		os_huge_pages = 0;
+	if (global_instance.config.enable_huge_pages)
+		os_huge_page_size = os_huge_page_detect();
+	os_huge_pages = os_huge_page_size ? 1 : 0;
+	if (os_huge_pages) {
+		if (os_huge_page_size > os_page_size)
+			os_page_size = os_huge_page_size;
+		if (os_huge_page_size > os_map_granularity)
+			os_map_granularity = os_huge_page_size;
 	}
 
-	global_config.enable_huge_pages = os_huge_pages;
+	global_instance.config.enable_huge_pages = os_huge_pages;
 
-	if (!memory_interface || (global_config.page_size < os_page_size))
-		global_config.page_size = os_page_size;
+	if (!memory_interface || (global_instance.config.page_size < os_page_size))
+		global_instance.config.page_size = os_page_size;
 
-	if (global_config.enable_huge_pages || global_config.page_size > (256 * 1024))
-		global_config.disable_decommit = 1;
+	if (global_instance.config.enable_huge_pages || global_instance.config.page_size > (256 * 1024))
+		global_instance.config.disable_decommit = 1;
 
 #ifdef _WIN32
 	fls_key = FlsAlloc(&rpmalloc_thread_destructor);
@@ -2069,32 +5220,22 @@ rpmalloc_initialize(rpmalloc_interface_t* memory_interface) {
 
 extern const rpmalloc_config_t*
 rpmalloc_config(void) {
-	return &global_config;
+	return &global_instance.config;
 }
 
 extern void
 rpmalloc_finalize(void) {
+	rpmalloc_statistics_export_stop();
+	rpmalloc_sampling_stop();
+	rpmalloc_sampling_hooks(0, 0);
 	rpmalloc_thread_finalize();
 
-	if (global_config.unmap_on_finalize) {
-		heap_t* heap = global_heap_queue;
-		global_heap_queue = 0;
-		while (heap) {
-			heap_t* heap_next = heap->next;
-			heap_free_all(heap);
-			heap_unmap(heap);
-			heap = heap_next;
-		}
-		heap = global_heap_used;
-		global_heap_used = 0;
-		while (heap) {
-			heap_t* heap_next = heap->next;
-			heap_free_all(heap);
-			heap_unmap(heap);
-			heap = heap_next;
-		}
+	if (global_instance.config.unmap_on_finalize) {
+		instance_free_heaps(&global_instance);
 #if ENABLE_STATISTICS
 		memset(&global_statistics, 0, sizeof(global_statistics));
+		memset(global_statistics_remote_free, 0, sizeof(global_statistics_remote_free));
+		global_statistics_remote_free_other = 0;
 #endif
 	}
 
@@ -2123,32 +5264,681 @@ rpmalloc_thread_finalize(void) {
 		heap_release(heap);
 		set_thread_heap(global_heap_default);
 	}
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	global_thread_shared_heap = 0;
+#endif
+}
+
+extern void
+rpmalloc_thread_collect(void) {
+}
+
+extern int
+rpmalloc_thread_warmup(const size_t* sizes, const size_t* counts, size_t count, unsigned int flags) {
+	heap_t* heap = get_thread_heap();
+	if (heap->id == 0) {
+		rpmalloc_initialize(0);
+		heap = get_thread_heap();
+	}
+	return heap_warmup_sizes(heap, sizes, counts, count, flags);
+}
+
+void
+rpmalloc_dump_statistics(void* file) {
+#if ENABLE_STATISTICS
+	fprintf(file, "Mapped pages:        %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.page_mapped, memory_order_relaxed));
+	fprintf(file, "Mapped pages (peak): %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed));
+	fprintf(file, "Active pages:        %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.page_active, memory_order_relaxed));
+	fprintf(file, "Active pages (peak): %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed));
+	fprintf(file, "Pages committed:     %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.page_commit, memory_order_relaxed));
+	fprintf(file, "Pages decommitted:   %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.page_decommit, memory_order_relaxed));
+	fprintf(file, "Heaps created:       %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.heap_count, memory_order_relaxed));
+	fprintf(file, "Thread free retries: %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.thread_free_retry, memory_order_relaxed));
+	fprintf(file, "Adopt retries:       %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.adopt_retry, memory_order_relaxed));
+	fprintf(file, "Page free retries:   %llu\n",
+	        (unsigned long long)atomic_load_explicit(&global_statistics.page_free_thread_retry, memory_order_relaxed));
+#else
+	(void)sizeof(file);
+#endif
+}
+
+size_t
+rpmalloc_dump_statistics_buffer(char* buffer, size_t capacity, unsigned int format) {
+	heap_statistics_t statistics;
+	statistics_writer_t writer;
+	memset(&statistics, 0, sizeof(statistics));
+	memset(&writer, 0, sizeof(writer));
+	writer.buffer = buffer;
+	writer.capacity = buffer ? capacity : 0;
+	writer.format = format;
+	writer.first = 1;
+	if (format == RPMALLOC_STATISTICS_JSON)
+		statistics_write(&writer, "{", 1);
+
+	size_t heap_count = 0;
+	size_t mapped = 0;
+	size_t map_calls = 0;
+	size_t unmap_calls = 0;
+	size_t commit_calls = 0;
+	size_t decommit_calls = 0;
+#if ENABLE_STATISTICS
+	size_t remote_frees = 0;
+	size_t adopt_batch[ADOPT_BATCH_BUCKET_COUNT];
+	memset(adopt_batch, 0, sizeof(adopt_batch));
+#endif
+	statistics_begin(&writer, "heaps");
+	heap_lock_acquire(&global_instance);
+	for (int ilist = 0; ilist < 2; ++ilist) {
+		heap_t* heap = ilist ? global_instance.heap_queue : global_instance.heap_used;
+		for (; heap; heap = heap->next) {
+			if (!ilist && !heap_walk_is_allowed(heap, 0))
+				continue;
+			statistics_write_heap(&writer, heap, &statistics);
+			++heap_count;
+			mapped += atomic_load_explicit(&heap->memory_usage, memory_order_relaxed);
+			map_calls += heap->map_count;
+			unmap_calls += atomic_load_explicit(&heap->unmap_count, memory_order_relaxed);
+			commit_calls += heap->commit_count;
+			decommit_calls += heap->decommit_count;
+#if ENABLE_STATISTICS
+			remote_frees += heap->remote_free_count;
+			for (uint32_t ibucket = 0; ibucket < ADOPT_BATCH_BUCKET_COUNT; ++ibucket)
+				adopt_batch[ibucket] += heap->adopt_batch[ibucket];
+#endif
+		}
+	}
+	heap_lock_release(&global_instance);
+	statistics_end(&writer, "heaps");
+
+	statistics_write_page_types(&writer, statistics.page_type_total);
+
+	statistics_begin(&writer, "size_classes");
+	for (uint32_t iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		size_class_statistics_t* size_class = statistics.size_class + iclass;
+		if (!size_class->page_count)
+			continue;
+		char name[24];
+		statistics_format_uint(name, iclass);
+		statistics_begin(&writer, name);
+		statistics_value(&writer, "block_size", global_size_class[iclass].block_size);
+		statistics_value(&writer, "pages", size_class->page_count);
+		statistics_value(&writer, "blocks", size_class->block_count);
+		statistics_value(&writer, "blocks_used", size_class->block_used);
+		statistics_value(&writer, "committed", size_class->committed);
+		statistics_value(&writer, "live", size_class->block_used * global_size_class[iclass].block_size);
+		statistics_end(&writer, name);
+	}
+	statistics_end(&writer, "size_classes");
+
+	size_t committed = 0;
+	size_t live = 0;
+	for (int itype = 0; itype < 4; ++itype) {
+		committed += statistics.page_type_total[itype].committed;
+		live += statistics.page_type_total[itype].live;
+	}
+	statistics_begin(&writer, "global");
+	statistics_value(&writer, "heaps", heap_count);
+	statistics_value(&writer, "mapped", mapped);
+	statistics_value(&writer, "committed", committed);
+	statistics_value(&writer, "live", live);
+	statistics_value(&writer, "huge_blocks", statistics.page_type_total[PAGE_HUGE].span_count);
+	statistics_value(&writer, "huge_mapped", statistics.page_type_total[PAGE_HUGE].mapped);
+	statistics_value(&writer, "map_calls", map_calls);
+	statistics_value(&writer, "unmap_calls", unmap_calls);
+	statistics_value(&writer, "commit_calls", commit_calls);
+	statistics_value(&writer, "decommit_calls", decommit_calls);
+#if ENABLE_STATISTICS
+	statistics_value(&writer, "os_pages_mapped",
+	                 atomic_load_explicit(&global_statistics.page_mapped, memory_order_relaxed));
+	statistics_value(&writer, "os_pages_mapped_peak",
+	                 atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed));
+	statistics_value(&writer, "os_pages_active",
+	                 atomic_load_explicit(&global_statistics.page_active, memory_order_relaxed));
+	statistics_value(&writer, "os_pages_active_peak",
+	                 atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed));
+	statistics_value(&writer, "os_pages_committed",
+	                 atomic_load_explicit(&global_statistics.page_commit, memory_order_relaxed));
+	statistics_value(&writer, "os_pages_decommitted",
+	                 atomic_load_explicit(&global_statistics.page_decommit, memory_order_relaxed));
+	statistics_value(&writer, "heaps_created",
+	                 atomic_load_explicit(&global_statistics.heap_count, memory_order_relaxed));
+	statistics_value(&writer, "remote_frees", remote_frees);
+	statistics_value(&writer, "thread_free_retries",
+	                 atomic_load_explicit(&global_statistics.thread_free_retry, memory_order_relaxed));
+	statistics_value(&writer, "adopt_retries",
+	                 atomic_load_explicit(&global_statistics.adopt_retry, memory_order_relaxed));
+	statistics_value(&writer, "page_free_thread_retries",
+	                 atomic_load_explicit(&global_statistics.page_free_thread_retry, memory_order_relaxed));
+	statistics_write_adopt_batches(&writer, adopt_batch);
+	statistics_write_remote_frees(&writer);
+#endif
+	statistics_end(&writer, "global");
+
+	if (format == RPMALLOC_STATISTICS_JSON)
+		statistics_write(&writer, "}", 1);
+	if (writer.capacity)
+		buffer[(writer.length < writer.capacity) ? writer.length : (writer.capacity - 1)] = 0;
+	return writer.length;
+}
+
+int
+rpmalloc_sampling_start(size_t interval) {
+#if ENABLE_SAMPLING
+	if (!global_rpmalloc_initialized)
+		rpmalloc_initialize(0);
+	if (!interval)
+		interval = SAMPLE_INTERVAL_DEFAULT;
+	// Capture a stack trace before sampling starts, the first capture can load libraries and allocate
+	void* frame[SAMPLE_STACK_DEPTH];
+	(void)sample_capture_stack(frame);
+	sample_lock_acquire();
+	sample_table_t* table = global_sample_table;
+	if (!table) {
+		size_t table_size = get_page_aligned_size(sizeof(sample_table_t));
+		size_t offset = 0;
+		size_t mapped_size = 0;
+		table = memory_interface_map(global_instance.memory_interface, table_size, 0, &offset, &mapped_size);
+		if (table) {
+			memset(table, 0, sizeof(sample_table_t));
+			table->offset = offset;
+			table->mapped_size = mapped_size;
+			table->start_ticks = cpu_ticks();
+			table->start_time = monotonic_time();
+			global_sample_table = table;
+		}
+	}
+	if (table)
+		table->interval = interval;
+	sample_lock_release();
+	if (!table)
+		return -1;
+	atomic_store_explicit(&global_sample_interval, interval, memory_order_relaxed);
+	return 0;
+#else
+	(void)sizeof(interval);
+	return -1;
+#endif
+}
+
+void
+rpmalloc_sampling_stop(void) {
+#if ENABLE_SAMPLING
+	atomic_store_explicit(&global_sample_interval, 0, memory_order_relaxed);
+#endif
+}
+
+int
+rpmalloc_sampling_hooks(const rpmalloc_sampling_hooks_t* hooks, size_t interval) {
+#if ENABLE_SAMPLING
+	if (hooks && rpmalloc_sampling_start(interval))
+		return -1;
+	sample_lock_acquire();
+	if (hooks)
+		global_sample_hooks = *hooks;
+	else
+		memset(&global_sample_hooks, 0, sizeof(global_sample_hooks));
+	sample_lock_release();
+	// Wait for calls of the previous hooks prepared before the swap to return, except a call made by this thread
+	// if the hooks are changed from inside a hook
+	unsigned int own_calls = global_thread_sample_hook ? 1 : 0;
+	while (atomic_load_explicit(&global_sample_hook_calls, memory_order_acquire) > own_calls)
+		wait_spin();
+	return 0;
+#else
+	(void)sizeof(hooks);
+	(void)sizeof(interval);
+	return -1;
+#endif
+}
+
+size_t
+rpmalloc_sampling_dump(char* buffer, size_t capacity) {
+	statistics_writer_t writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.buffer = buffer;
+	writer.capacity = buffer ? capacity : 0;
+#if ENABLE_SAMPLING
+	sample_lock_acquire();
+	sample_table_t* table = global_sample_table;
+	if (table) {
+		size_t live_count = 0;
+		size_t live_size = 0;
+		size_t alloc_count = 0;
+		size_t alloc_size = 0;
+		for (uint32_t istack = 1; istack <= table->stack_count; ++istack) {
+			live_count += table->stack[istack].live_count;
+			live_size += table->stack[istack].live_size;
+			alloc_count += table->stack[istack].alloc_count;
+			alloc_size += table->stack[istack].alloc_size;
+		}
+		char number[24];
+		statistics_write_string(&writer, "heap profile: ");
+		sample_write_counts(&writer, live_count, live_size, alloc_count, alloc_size);
+		statistics_write_string(&writer, " heap_v2/");
+		statistics_write(&writer, number, statistics_format_uint(number, table->interval));
+		statistics_write(&writer, "\n", 1);
+		for (uint32_t istack = 1; istack <= table->stack_count; ++istack) {
+			sample_stack_t* stack = table->stack + istack;
+			statistics_write(&writer, " ", 1);
+			sample_write_counts(&writer, stack->live_count, stack->live_size, stack->alloc_count, stack->alloc_size);
+			for (uint32_t iframe = 0; iframe < stack->depth; ++iframe)
+				sample_write_address(&writer, stack->frame[iframe]);
+			statistics_write(&writer, "\n", 1);
+		}
+	}
+	sample_lock_release();
+	if (table) {
+		statistics_write_string(&writer, "\nMAPPED_LIBRARIES:\n");
+		sample_write_file(&writer, "/proc/self/maps");
+	}
+#endif
+	if (writer.capacity)
+		buffer[(writer.length < writer.capacity) ? writer.length : (writer.capacity - 1)] = 0;
+	return writer.length;
+}
+
+size_t
+rpmalloc_lifetime_dump(char* buffer, size_t capacity, unsigned int format) {
+	statistics_writer_t writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.buffer = buffer;
+	writer.capacity = buffer ? capacity : 0;
+	writer.format = format;
+	writer.first = 1;
+	if (format == RPMALLOC_STATISTICS_JSON)
+		statistics_write(&writer, "{", 1);
+#if ENABLE_SAMPLING
+	uint64_t ticks = cpu_ticks();
+	uint64_t current_time = monotonic_time();
+	sample_lock_acquire();
+	sample_table_t* table = global_sample_table;
+	if (table) {
+		uint64_t elapsed_time = current_time - table->start_time;
+		uint64_t ticks_per_second =
+		    elapsed_time ? (uint64_t)(((double)(ticks - table->start_ticks) * 1000000000.0) / (double)elapsed_time)
+		                 : 0;
+		statistics_value(&writer, "ticks_per_second", ticks_per_second);
+		statistics_value(&writer, "interval", table->interval);
+		size_t total = 0;
+		statistics_begin(&writer, "size_classes");
+		for (uint32_t iclass = 0; iclass <= SIZE_CLASS_COUNT; ++iclass) {
+			size_t count = 0;
+			for (uint32_t ibucket = 0; ibucket < SAMPLE_LIFETIME_BUCKET_COUNT; ++ibucket)
+				count += table->lifetime[iclass][ibucket];
+			if (!count)
+				continue;
+			total += count;
+			char name[24];
+			if (iclass < SIZE_CLASS_COUNT)
+				statistics_format_uint(name, iclass);
+			else
+				memcpy(name, "huge", 5);
+			statistics_begin(&writer, name);
+			if (iclass < SIZE_CLASS_COUNT)
+				statistics_value(&writer, "block_size", global_size_class[iclass].block_size);
+			statistics_value(&writer, "samples", count);
+			sample_write_lifetime(&writer, table->lifetime[iclass]);
+			statistics_end(&writer, name);
+		}
+		statistics_end(&writer, "size_classes");
+		statistics_begin(&writer, "heaps");
+		for (uint32_t islot = 0; islot < table->heap_count; ++islot) {
+			sample_heap_t* heap = table->heap + islot;
+			if (!heap->count)
+				continue;
+			char name[24];
+			if (islot)
+				statistics_format_uint(name, heap->id);
+			else
+				memcpy(name, "other", 6);
+			statistics_begin(&writer, name);
+			statistics_value(&writer, "samples", heap->count);
+			sample_write_lifetime(&writer, heap->lifetime);
+			statistics_end(&writer, name);
+		}
+		statistics_end(&writer, "heaps");
+		statistics_value(&writer, "samples", total);
+	}
+	sample_lock_release();
+#endif
+	if (format == RPMALLOC_STATISTICS_JSON)
+		statistics_write(&writer, "}", 1);
+	if (writer.capacity)
+		buffer[(writer.length < writer.capacity) ? writer.length : (writer.capacity - 1)] = 0;
+	return writer.length;
+}
+
+size_t
+rpmalloc_latency_dump(char* buffer, size_t capacity, unsigned int format) {
+	statistics_writer_t writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.buffer = buffer;
+	writer.capacity = buffer ? capacity : 0;
+	writer.format = format;
+	writer.first = 1;
+	if (format == RPMALLOC_STATISTICS_JSON)
+		statistics_write(&writer, "{", 1);
+#if ENABLE_LATENCY
+	uint64_t elapsed_ticks = cpu_ticks() - global_latency_start_ticks;
+	uint64_t elapsed_time = monotonic_time() - global_latency_start_time;
+	uint64_t ticks_per_second =
+	    elapsed_time ? (uint64_t)(((double)elapsed_ticks * 1000000000.0) / (double)elapsed_time) : 0;
+	statistics_value(&writer, "ticks_per_second", ticks_per_second);
+	latency_histogram_t total[LATENCY_PATH_COUNT];
+	memset(total, 0, sizeof(total));
+	statistics_begin(&writer, "heaps");
+	heap_lock_acquire(&global_instance);
+	for (int ilist = 0; ilist < 2; ++ilist) {
+		heap_t* heap = ilist ? global_instance.heap_queue : global_instance.heap_used;
+		for (; heap; heap = heap->next) {
+			size_t count = 0;
+			for (uint32_t ipath = 0; ipath < LATENCY_PATH_COUNT; ++ipath) {
+				latency_histogram_t* histogram = heap->latency + ipath;
+				count += histogram->count;
+				total[ipath].count += histogram->count;
+				total[ipath].ticks += histogram->ticks;
+				for (uint32_t ibucket = 0; ibucket < LATENCY_BUCKET_COUNT; ++ibucket)
+					total[ipath].bucket[ibucket] += histogram->bucket[ibucket];
+			}
+			if (!count)
+				continue;
+			char id[24];
+			statistics_format_uint(id, heap->id);
+			statistics_begin(&writer, id);
+			latency_write_paths(&writer, heap->latency);
+			statistics_end(&writer, id);
+		}
+	}
+	heap_lock_release(&global_instance);
+	statistics_end(&writer, "heaps");
+	statistics_begin(&writer, "total");
+	latency_write_paths(&writer, total);
+	statistics_end(&writer, "total");
+#endif
+	if (format == RPMALLOC_STATISTICS_JSON)
+		statistics_write(&writer, "}", 1);
+	if (writer.capacity)
+		buffer[(writer.length < writer.capacity) ? writer.length : (writer.capacity - 1)] = 0;
+	return writer.length;
+}
+
+int
+rpmalloc_statistics_export_start(const char* name, unsigned int interval) {
+#if PLATFORM_POSIX
+	size_t name_length = name ? strlen(name) : 0;
+	if (global_statistics_export || !name_length || (name_length >= sizeof(global_statistics_export_name)))
+		return -1;
+	if (!global_rpmalloc_initialized)
+		rpmalloc_initialize(0);
+	// Never truncate a segment in use by another process, only replace one left by a terminated process
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if ((fd < 0) && (errno == EEXIST) && statistics_export_is_stale(name)) {
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+	if (fd < 0)
+		return -1;
+	size_t size = sizeof(rpmalloc_statistics_export_t);
+	void* address = MAP_FAILED;
+	if (!ftruncate(fd, (off_t)size))
+		address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED) {
+		shm_unlink(name);
+		return -1;
+	}
+	rpmalloc_statistics_export_t* segment = address;
+	segment->version = RPMALLOC_STATISTICS_EXPORT_VERSION;
+	segment->size = (unsigned int)size;
+	segment->pid = (unsigned long long)getpid();
+	segment->interval = interval ? interval : 1000;
+	segment->statistics_enabled = ENABLE_STATISTICS;
+	segment->page_size = global_instance.config.page_size;
+	statistics_export_update(segment);
+	// Readers check the magic last, the segment is complete when it is set
+	atomic_store_explicit((atomic_ullong*)&segment->magic, RPMALLOC_STATISTICS_EXPORT_MAGIC, memory_order_release);
+
+	memcpy(global_statistics_export_name, name, name_length + 1);
+	global_statistics_export_stop = 0;
+	if (pthread_create(&global_statistics_export_thread, 0, statistics_export_thread, segment)) {
+		munmap(segment, size);
+		shm_unlink(name);
+		return -1;
+	}
+	global_statistics_export = segment;
+	return 0;
+#else
+	(void)sizeof(name);
+	(void)sizeof(interval);
+	return -1;
+#endif
+}
+
+void
+rpmalloc_statistics_export_stop(void) {
+#if PLATFORM_POSIX
+	rpmalloc_statistics_export_t* segment = global_statistics_export;
+	if (!segment)
+		return;
+	pthread_mutex_lock(&global_statistics_export_lock);
+	global_statistics_export_stop = 1;
+	pthread_cond_signal(&global_statistics_export_signal);
+	pthread_mutex_unlock(&global_statistics_export_lock);
+	pthread_join(global_statistics_export_thread, 0);
+	global_statistics_export = 0;
+	munmap(segment, sizeof(rpmalloc_statistics_export_t));
+	shm_unlink(global_statistics_export_name);
+#endif
+}
+
+int
+rpmalloc_statistics_export_read(const rpmalloc_statistics_export_t* segment, rpmalloc_statistics_export_t* snapshot) {
+	if (atomic_load_explicit((const atomic_ullong*)&segment->magic, memory_order_acquire) !=
+	    RPMALLOC_STATISTICS_EXPORT_MAGIC)
+		return -1;
+	const atomic_ullong* sequence = (const atomic_ullong*)&segment->sequence;
+	for (int iretry = 0; iretry < 1024; ++iretry) {
+		unsigned long long sequence_value = atomic_load_explicit(sequence, memory_order_acquire);
+		if (!(sequence_value & 1)) {
+			memcpy(snapshot, segment, sizeof(rpmalloc_statistics_export_t));
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(sequence, memory_order_relaxed) == sequence_value)
+				return (snapshot->version == RPMALLOC_STATISTICS_EXPORT_VERSION) ? 0 : -1;
+		}
+		wait_spin();
+	}
+	return -1;
+}
+
+int
+rpmalloc_smaps_parse(int pid, const char* prefix, rpmalloc_smaps_t* report) {
+	memset(report, 0, sizeof(rpmalloc_smaps_t));
+#if defined(__linux__) || defined(__ANDROID__)
+	char path[64] = "/proc/self/smaps";
+	if (pid > 0) {
+		size_t length = 6;
+		length += statistics_format_uint(path + length, (unsigned long long)pid);
+		memcpy(path + length, "/smaps", 7);
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	smaps_parser_t parser;
+	parser.report = report;
+	parser.prefix = prefix ? prefix : "rpmalloc";
+	parser.prefix_length = strlen(parser.prefix);
+	parser.usage[0] = parser.usage[1] = parser.usage[2] = 0;
+	char buffer[4096];
+	char line[512];
+	size_t line_length = 0;
+	ssize_t read_size;
+	while ((read_size = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (read_size < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (ssize_t ichar = 0; ichar < read_size; ++ichar) {
+			if (buffer[ichar] == '\n') {
+				line[line_length] = 0;
+				smaps_parse_line(&parser, line);
+				line_length = 0;
+			} else if (line_length + 1 < sizeof(line)) {
+				line[line_length++] = buffer[ichar];
+			}
+		}
+	}
+	close(fd);
+	return (read_size < 0) ? -1 : 0;
+#else
+	(void)sizeof(pid);
+	(void)sizeof(prefix);
+	return -1;
+#endif
+}
+
+int
+rpmalloc_walk(unsigned int flags, rpmalloc_walk_callback_t callback, void* context) {
+	return instance_walk(&global_instance, flags, callback, context);
+}
+
+void
+rpmalloc_fragmentation(rpmalloc_fragmentation_t* report) {
+	memset(report, 0, sizeof(rpmalloc_fragmentation_t));
+	heap_lock_acquire(&global_instance);
+	for (heap_t* heap = global_instance.heap_used; heap; heap = heap->next) {
+		if (heap_walk_is_allowed(heap, 0))
+			heap_fragmentation(heap, report);
+	}
+	for (heap_t* heap = global_instance.heap_queue; heap; heap = heap->next)
+		heap_fragmentation(heap, report);
+	heap_lock_release(&global_instance);
 }
 
-extern void
-rpmalloc_thread_collect(void) {
+//! Fragmentation of a single heap in the fragmentation dump
+typedef struct heap_fragmentation_row_t {
+	uint32_t heap_id;
+	size_t mapped;
+	size_t committed;
+	size_t live;
+	size_t page_free;
+	size_t page_free_committed;
+	size_t page_empty;
+	size_t page_sparse;
+} heap_fragmentation_row_t;
+
+//! Gather the fragmentation of each heap included in rpmalloc_fragmentation with mapped memory, holding the heap
+//  lock. Returns the number of rows filled in, at most the given capacity
+static size_t
+heap_fragmentation_rows(heap_fragmentation_row_t* rows, size_t capacity, rpmalloc_fragmentation_t* report) {
+	size_t count = 0;
+	heap_lock_acquire(&global_instance);
+	for (int ilist = 0; ilist < 2; ++ilist) {
+		heap_t* heap = ilist ? global_instance.heap_queue : global_instance.heap_used;
+		for (; heap && (count < capacity); heap = heap->next) {
+			if (!ilist && !heap_walk_is_allowed(heap, 0))
+				continue;
+			memset(report, 0, sizeof(rpmalloc_fragmentation_t));
+			heap_fragmentation(heap, report);
+			if (!report->mapped)
+				continue;
+			heap_fragmentation_row_t* row = rows + count++;
+			row->heap_id = heap->id;
+			row->mapped = report->mapped;
+			row->committed = report->committed;
+			row->live = report->live;
+			row->page_free = report->page_free;
+			row->page_free_committed = report->page_free_committed;
+			row->page_empty = report->page_empty;
+			row->page_sparse = report->page_sparse;
+		}
+	}
+	heap_lock_release(&global_instance);
+	return count;
 }
 
 void
-rpmalloc_dump_statistics(void* file) {
+rpmalloc_dump_fragmentation(void* file) {
+	rpmalloc_fragmentation_t report;
+	// Output can allocate, make sure the thread heap exists before the heap list is locked
+	rpmalloc_thread_initialize();
+	rpmalloc_fragmentation(&report);
+	fprintf(file, "Heaps:               %llu\n", (unsigned long long)report.heap_count);
+	fprintf(file, "Mapped (KiB):        %llu\n", (unsigned long long)(report.mapped / 1024));
+	fprintf(file, "Committed (KiB):     %llu\n", (unsigned long long)(report.committed / 1024));
+	fprintf(file, "Live (KiB):          %llu\n", (unsigned long long)(report.live / 1024));
+	fprintf(file, "Free pages:          %llu (%llu KiB committed)\n", (unsigned long long)report.page_free,
+	        (unsigned long long)(report.page_free_committed / 1024));
+	fprintf(file, "Empty pages:         %llu (%llu KiB committed)\n", (unsigned long long)report.page_empty,
+	        (unsigned long long)(report.page_empty_committed / 1024));
+	fprintf(file, "Sparse pages:        %llu (%llu KiB committed)\n", (unsigned long long)report.page_sparse,
+	        (unsigned long long)(report.page_sparse_committed / 1024));
+	fprintf(file, "Huge blocks:         %llu (%llu KiB committed)\n", (unsigned long long)report.huge_count,
+	        (unsigned long long)(report.huge_committed / 1024));
+	fprintf(file, "Class  Block size  Pages  Sparse  Committed KiB  Live KiB  Live %%\n");
+	for (int iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		if (!report.size_class[iclass].page_count)
+			continue;
+		fprintf(file, "%5d  %10llu  %5llu  %6llu  %13llu  %8llu  %5.1f\n", iclass,
+		        (unsigned long long)report.size_class[iclass].block_size,
+		        (unsigned long long)report.size_class[iclass].page_count,
+		        (unsigned long long)report.size_class[iclass].page_sparse,
+		        (unsigned long long)(report.size_class[iclass].committed / 1024),
+		        (unsigned long long)(report.size_class[iclass].live / 1024),
+		        100.0 * (double)report.size_class[iclass].live / (double)report.size_class[iclass].committed);
+	}
 #if ENABLE_STATISTICS
-	fprintf(file, "Mapped pages:        %llu\n",
-	        (unsigned long long)atomic_load_explicit(&global_statistics.page_mapped, memory_order_relaxed));
-	fprintf(file, "Mapped pages (peak): %llu\n",
-	        (unsigned long long)atomic_load_explicit(&global_statistics.page_mapped_peak, memory_order_relaxed));
-	fprintf(file, "Active pages:        %llu\n",
-	        (unsigned long long)atomic_load_explicit(&global_statistics.page_active, memory_order_relaxed));
-	fprintf(file, "Active pages (peak): %llu\n",
-	        (unsigned long long)atomic_load_explicit(&global_statistics.page_active_peak, memory_order_relaxed));
-	fprintf(file, "Pages committed:     %llu\n",
-	        (unsigned long long)atomic_load_explicit(&global_statistics.page_commit, memory_order_relaxed));
-	fprintf(file, "Pages decommitted:   %llu\n",
-	        (unsigned long long)atomic_load_explicit(&global_statistics.page_decommit, memory_order_relaxed));
-	fprintf(file, "Heaps created:       %llu\n",
-	        (unsigned long long)atomic_load_explicit(&global_statistics.heap_count, memory_order_relaxed));
-#else
-	(void)sizeof(file);
+	size_t requested = report.huge_requested_total;
+	size_t allocated = report.huge_allocated_total;
+	fprintf(file, "Class  Block size  Allocations  Requested KiB  Wasted KiB  Wasted %%\n");
+	for (int iclass = 0; iclass < SIZE_CLASS_COUNT; ++iclass) {
+		if (!report.size_class[iclass].alloc_total)
+			continue;
+		size_t class_allocated = report.size_class[iclass].alloc_total * report.size_class[iclass].block_size;
+		size_t class_requested = report.size_class[iclass].requested_total;
+		requested += class_requested;
+		allocated += class_allocated;
+		fprintf(file, "%5d  %10llu  %11llu  %13llu  %10llu  %8.1f\n", iclass,
+		        (unsigned long long)report.size_class[iclass].block_size,
+		        (unsigned long long)report.size_class[iclass].alloc_total,
+		        (unsigned long long)(class_requested / 1024),
+		        (unsigned long long)((class_allocated - class_requested) / 1024),
+		        100.0 * (double)(class_allocated - class_requested) / (double)class_allocated);
+	}
+	if (report.huge_alloc_total)
+		fprintf(file, " huge  %10s  %11llu  %13llu  %10llu  %8.1f\n", "-",
+		        (unsigned long long)report.huge_alloc_total, (unsigned long long)(report.huge_requested_total / 1024),
+		        (unsigned long long)((report.huge_allocated_total - report.huge_requested_total) / 1024),
+		        100.0 * (double)(report.huge_allocated_total - report.huge_requested_total) /
+		            (double)report.huge_allocated_total);
+	if (allocated)
+		fprintf(file, "Wasted to size class rounding: %llu KiB of %llu KiB allocated (%.1f%%)\n",
+		        (unsigned long long)((allocated - requested) / 1024), (unsigned long long)(allocated / 1024),
+		        100.0 * (double)(allocated - requested) / (double)allocated);
 #endif
+	// Gather the rows with the heap list locked and print them after, output can allocate and block
+	size_t capacity = report.heap_count;
+	heap_fragmentation_row_t* rows = capacity ? rpmalloc(sizeof(heap_fragmentation_row_t) * capacity) : 0;
+	size_t count = rows ? heap_fragmentation_rows(rows, capacity, &report) : 0;
+	fprintf(file, "Heap  Mapped KiB  Committed KiB  Live KiB  Free pages  Free KiB  Empty pages  Sparse pages\n");
+	for (size_t irow = 0; irow < count; ++irow) {
+		const heap_fragmentation_row_t* row = rows + irow;
+		fprintf(file, "%4u  %10llu  %13llu  %8llu  %10llu  %8llu  %11llu  %12llu\n", row->heap_id,
+		        (unsigned long long)(row->mapped / 1024), (unsigned long long)(row->committed / 1024),
+		        (unsigned long long)(row->live / 1024), (unsigned long long)row->page_free,
+		        (unsigned long long)(row->page_free_committed / 1024), (unsigned long long)row->page_empty,
+		        (unsigned long long)row->page_sparse);
+	}
+	rpfree(rows);
 }
 
 #if RPMALLOC_FIRST_CLASS_HEAPS
@@ -2159,12 +5949,35 @@ rpmalloc_heap_acquire(void) {
 	// could already be allocated from the heap which would (wrongly) be released when
 	// heap is cleared with rpmalloc_heap_free_all(). Also heaps guaranteed to be
 	// pristine from the dedicated orphan list can be used.
-	heap_t* heap = heap_allocate(1);
+	heap_t* heap = heap_allocate(&global_instance, 1);
 	rpmalloc_assume(heap != 0);
 	heap->owner_thread = 0;
 	return heap;
 }
 
+rpmalloc_heap_t*
+rpmalloc_heap_acquire_thread(void) {
+	// Same as rpmalloc_heap_acquire but keep the owner thread, making deallocations
+	// from other threads go through the deferred thread free lists
+	heap_t* heap = heap_allocate(&global_instance, 1);
+	rpmalloc_assume(heap != 0);
+	return heap;
+}
+
+void
+rpmalloc_heap_thread_adopt(rpmalloc_heap_t* heap) {
+	rpmalloc_assert(heap->first_class, "Adopting a thread heap");
+	heap->owner_thread = get_thread_id();
+}
+
+void
+rpmalloc_heap_thread_orphan(rpmalloc_heap_t* heap) {
+	rpmalloc_assert(heap->first_class, "Orphaning a thread heap");
+	// The ID of a terminated thread can be reused by a new thread, defer deallocations from all threads
+	// until the heap is adopted again
+	heap->owner_thread = HEAP_OWNER_ORPHAN;
+}
+
 void
 rpmalloc_heap_release(rpmalloc_heap_t* heap) {
 	if (heap)
@@ -2273,6 +6086,256 @@ rpmalloc_heap_free_all(rpmalloc_heap_t* heap) {
 	heap_free_all(heap);
 }
 
+void
+rpmalloc_heap_reset(rpmalloc_heap_t* heap, size_t retain_size) {
+	heap_reset(heap, retain_size);
+}
+
+rpmalloc_heap_mark_t*
+rpmalloc_heap_mark(rpmalloc_heap_t* heap) {
+	return heap_mark(heap);
+}
+
+void
+rpmalloc_heap_rewind(rpmalloc_heap_t* heap, rpmalloc_heap_mark_t* mark) {
+	heap_rewind(heap, mark);
+}
+
+void
+rpmalloc_heap_set_limit(rpmalloc_heap_t* heap, size_t limit, unsigned int policy) {
+	heap->memory_limit = limit;
+	heap->memory_limit_policy = policy;
+}
+
+void
+rpmalloc_heap_set_limit_callback(rpmalloc_heap_t* heap, rpmalloc_heap_limit_callback_fn callback) {
+	heap->memory_limit_callback = callback;
+}
+
+size_t
+rpmalloc_heap_usage(rpmalloc_heap_t* heap) {
+	return atomic_load_explicit(&heap->memory_committed, memory_order_relaxed);
+}
+
+int
+rpmalloc_heap_set_memory_interface(rpmalloc_heap_t* heap, rpmalloc_interface_t* memory_interface) {
+	if (!memory_interface) {
+		heap->memory_interface = heap_instance(heap)->memory_interface_index;
+		return 0;
+	}
+	int index = memory_interface_register(memory_interface);
+	if (index < 0)
+		return -1;
+	heap->memory_interface = (uint32_t)index;
+	return 0;
+}
+
+rpmalloc_instance_t*
+rpmalloc_instance_create(rpmalloc_interface_t* memory_interface, const rpmalloc_config_t* config) {
+	if (!global_rpmalloc_initialized)
+		rpmalloc_initialize(0);
+
+	size_t instance_size = get_page_aligned_size(sizeof(instance_t));
+	size_t offset = 0;
+	size_t mapped_size = 0;
+	instance_t* instance =
+	    memory_interface_map(global_instance.memory_interface, instance_size, 0, &offset, &mapped_size);
+	if (!instance)
+		return 0;
+	memset(instance, 0, sizeof(instance_t));
+	instance->offset = (uint32_t)offset;
+	instance->mapped_size = mapped_size;
+	os_name_mapping(global_instance.memory_interface, instance, offset, mapped_size, RPMALLOC_SMAPS_HEAPMETA, 0);
+
+	if (config)
+		instance->config = *config;
+	// Page size is process wide, blocks and pages are laid out the same in all instances
+	instance->config.page_size = global_instance.config.page_size;
+	// Huge pages are only detected when initializing if the default instance uses them. Detection is idempotent,
+	// so instances created concurrently store the same size
+	if (instance->config.enable_huge_pages && !os_huge_page_size)
+		os_huge_page_size = os_huge_page_detect();
+	if (!os_huge_page_size)
+		instance->config.enable_huge_pages = 0;
+	if (instance->config.enable_huge_pages)
+		instance->config.disable_decommit = 1;
+
+	if (!memory_interface)
+		memory_interface =
+		    instance->config.enable_huge_pages ? &global_memory_interface_huge : &global_memory_interface_default;
+	int index = memory_interface_register(memory_interface);
+	if (index < 0) {
+		global_instance.memory_interface->memory_unmap(instance, offset, mapped_size);
+		return 0;
+	}
+	instance->memory_interface = memory_interface;
+	instance->memory_interface_index = (uint32_t)index;
+	return instance;
+}
+
+void
+rpmalloc_instance_destroy(rpmalloc_instance_t* instance) {
+	if (!instance || (instance == &global_instance))
+		return;
+	instance_free_heaps(instance);
+	global_instance.memory_interface->memory_unmap(instance, instance->offset, instance->mapped_size);
+}
+
+rpmalloc_instance_t*
+rpmalloc_instance_default(void) {
+	return &global_instance;
+}
+
+const rpmalloc_config_t*
+rpmalloc_instance_config(rpmalloc_instance_t* instance) {
+	return &instance->config;
+}
+
+rpmalloc_heap_t*
+rpmalloc_instance_heap_acquire(rpmalloc_instance_t* instance) {
+	heap_t* heap = heap_allocate(instance, 1);
+	if (heap)
+		heap->owner_thread = 0;
+	return heap;
+}
+
+rpmalloc_instance_t*
+rpmalloc_heap_instance(rpmalloc_heap_t* heap) {
+	return heap_instance(heap);
+}
+
+int
+rpmalloc_heap_warmup(rpmalloc_heap_t* heap, const size_t* sizes, const size_t* counts, size_t count,
+                     unsigned int flags) {
+	return heap_warmup_sizes(heap, sizes, counts, count, flags);
+}
+
+rpmalloc_heap_t*
+rpmalloc_heap_acquire_pinned(const rpmalloc_heap_pin_config_t* config) {
+	heap_t* heap = rpmalloc_heap_acquire();
+	heap->pin_flags = config->flags;
+	if (heap_pin_reserve(heap, PAGE_SMALL, config->small_size) ||
+	    heap_pin_reserve(heap, PAGE_MEDIUM, config->medium_size) ||
+	    heap_pin_reserve(heap, PAGE_LARGE, config->large_size)) {
+		heap_free_all(heap);
+		heap_release(heap);
+		return 0;
+	}
+	heap->pinned = 1;
+	return heap;
+}
+
+void
+rpmalloc_heap_statistics(rpmalloc_heap_t* heap, rpmalloc_heap_statistics_t* stats) {
+	memset(stats, 0, sizeof(rpmalloc_heap_statistics_t));
+	stats->mapped = atomic_load_explicit(&heap->memory_usage, memory_order_relaxed);
+	stats->committed = atomic_load_explicit(&heap->memory_committed, memory_order_relaxed);
+	stats->pinned = heap->pin_reserved;
+	stats->map_calls = heap->map_count;
+	stats->unmap_calls = atomic_load_explicit(&heap->unmap_count, memory_order_relaxed);
+	stats->commit_calls = heap->commit_count;
+	stats->decommit_calls = heap->decommit_count;
+	stats->pin_diverted = heap->pin_diverted;
+	stats->pin_failed = heap->pin_failed;
+}
+
+int
+rpmalloc_heap_walk(rpmalloc_heap_t* heap, unsigned int flags, rpmalloc_walk_callback_t callback, void* context) {
+	return heap_walk(heap, flags, callback, context);
+}
+
+void
+rpmalloc_heap_fragmentation(rpmalloc_heap_t* heap, rpmalloc_fragmentation_t* report) {
+	memset(report, 0, sizeof(rpmalloc_fragmentation_t));
+	heap_fragmentation(heap, report);
+}
+
+rpmalloc_heap_shared_t*
+rpmalloc_heap_shared_acquire(void) {
+	return heap_shared_allocate();
+}
+
+void
+rpmalloc_heap_shared_release(rpmalloc_heap_shared_t* shared) {
+	if (!shared)
+		return;
+	heap_t* heap = (heap_t*)atomic_load_explicit(&shared->heap, memory_order_acquire);
+	while (heap) {
+		heap_t* heap_next = heap->shared_next;
+		heap->shared = 0;
+		heap->shared_next = 0;
+		heap_release(heap);
+		heap = heap_next;
+	}
+	for (int itype = 0; itype < 3; ++itype) {
+		span_t* span = shared->span_free[itype];
+		while (span) {
+			span_t* span_next = span->next;
+			span_unmap_memory(span);
+			span = span_next;
+		}
+	}
+	global_instance.memory_interface->memory_unmap(shared, shared->offset, shared->mapped_size);
+}
+
+rpmalloc_heap_t*
+rpmalloc_heap_shared_thread_heap(rpmalloc_heap_shared_t* shared) {
+	return heap_shared_thread_heap(shared);
+}
+
+RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_alloc(rpmalloc_heap_shared_t* shared, size_t size) {
+	heap_t* heap = heap_shared_thread_heap(shared);
+	return heap ? rpmalloc_heap_alloc(heap, size) : 0;
+}
+
+RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_aligned_alloc(rpmalloc_heap_shared_t* shared, size_t alignment, size_t size) {
+	heap_t* heap = heap_shared_thread_heap(shared);
+	return heap ? rpmalloc_heap_aligned_alloc(heap, alignment, size) : 0;
+}
+
+RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_calloc(rpmalloc_heap_shared_t* shared, size_t num, size_t size) {
+	heap_t* heap = heap_shared_thread_heap(shared);
+	return heap ? rpmalloc_heap_calloc(heap, num, size) : 0;
+}
+
+RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_realloc(rpmalloc_heap_shared_t* shared, void* ptr, size_t size, unsigned int flags) {
+	heap_t* heap = heap_shared_thread_heap(shared);
+	return heap ? rpmalloc_heap_realloc(heap, ptr, size, flags) : 0;
+}
+
+void
+rpmalloc_heap_shared_free(rpmalloc_heap_shared_t* shared, void* ptr) {
+	(void)sizeof(shared);
+	block_deallocate(ptr);
+}
+
+void
+rpmalloc_heap_shared_free_all(rpmalloc_heap_shared_t* shared) {
+	heap_t* heap = (heap_t*)atomic_load_explicit(&shared->heap, memory_order_acquire);
+	while (heap) {
+		heap_free_all(heap);
+		heap = heap->shared_next;
+	}
+	for (int itype = 0; itype < 3; ++itype) {
+		span_t* span = shared->span_free[itype];
+		while (span) {
+			span_t* span_next = span->next;
+			span_unmap_memory(span);
+			span = span_next;
+		}
+		shared->span_free[itype] = 0;
+	}
+}
+
+void
+rpmalloc_heap_shared_reset(rpmalloc_heap_shared_t* shared, size_t retain_size) {
+	heap_shared_reset(shared, retain_size);
+}
+
 extern inline void
 rpmalloc_heap_thread_set_current(rpmalloc_heap_t* heap) {
 	heap_t* prev_heap = get_thread_heap();
@@ -2283,6 +6346,40 @@ rpmalloc_heap_thread_set_current(rpmalloc_heap_t* heap) {
 	}
 }
 
+void
+rpmalloc_heap_set_user_data(rpmalloc_heap_t* heap, void* user_data) {
+	heap->user_data = user_data;
+}
+
+void*
+rpmalloc_heap_user_data(rpmalloc_heap_t* heap) {
+	return heap->user_data;
+}
+
+void
+rpmalloc_heap_set_label(rpmalloc_heap_t* heap, const char* label) {
+	size_t length = 0;
+	while (label && label[length] && (length + 1 < HEAP_LABEL_SIZE)) {
+		heap->label[length] = label[length];
+		++length;
+	}
+	heap->label[length] = 0;
+	// Rename the regions already mapped by the heap
+	os_name_mapping(heap_instance(heap)->memory_interface, heap, heap->offset, heap->mapped_size,
+	                RPMALLOC_SMAPS_HEAPMETA, heap->label);
+	rpmalloc_interface_t* memory_interface = heap_memory_interface(heap);
+	for (unsigned int itype = 0; itype < 3; ++itype) {
+		for (span_t* span = heap->span_partial[itype]; span; span = span->next)
+			os_name_mapping(memory_interface, span, span->offset, span->mapped_size, itype, heap->label);
+		for (span_t* span = heap->span_used[itype]; span; span = span->next)
+			os_name_mapping(memory_interface, span, span->offset, span->mapped_size, itype, heap->label);
+	}
+	heap_shared_lock_acquire(heap->shared);
+	for (span_t* span = heap->span_used[PAGE_HUGE]; span; span = span->next)
+		os_name_mapping(memory_interface, span, span->offset, span->mapped_size, PAGE_HUGE, heap->label);
+	heap_shared_lock_release(heap->shared);
+}
+
 rpmalloc_heap_t*
 rpmalloc_get_heap_for_ptr(void* ptr) {
 	// Grab the span, and then the heap from the span
@@ -2292,6 +6389,254 @@ rpmalloc_get_heap_for_ptr(void* ptr) {
 	return 0;
 }
 
+rpmalloc_heap_t*
+rpmalloc_heap_persistent_acquire(const char* path, void* base, size_t size, int* status) {
+#if PLATFORM_POSIX
+	if (global_persistent_region || ((uintptr_t)base & (SPAN_SIZE - 1)))
+		return 0;
+	if (!global_rpmalloc_initialized)
+		rpmalloc_initialize(0);
+
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return 0;
+	struct stat file_stat;
+	if (fstat(fd, &file_stat)) {
+		close(fd);
+		return 0;
+	}
+	int created = (file_stat.st_size == 0);
+	if (created) {
+		size &= ~(size_t)(SPAN_SIZE - 1);
+		int invalid_size = (size < 2 * SPAN_SIZE) || (size / SPAN_SIZE > PERSISTENT_SPAN_COUNT);
+		if (invalid_size || ftruncate(fd, (off_t)size)) {
+			close(fd);
+			return 0;
+		}
+	} else {
+		size = (size_t)file_stat.st_size;
+	}
+
+	void* address = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if (address == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	heap_persistent_t* region = address;
+	if ((address != base) ||
+	    (!created && ((region->magic != PERSISTENT_MAGIC) || (region->version != PERSISTENT_VERSION) ||
+	                  (region->heap_size != sizeof(heap_t)) || (region->base != (uintptr_t)base) ||
+	                  (region->size != size)))) {
+		munmap(address, size);
+		close(fd);
+		return 0;
+	}
+
+	global_memory_interface_persistent.memory_map = persistent_memory_map;
+	global_memory_interface_persistent.memory_commit = persistent_memory_commit;
+	global_memory_interface_persistent.memory_decommit = persistent_memory_commit;
+	global_memory_interface_persistent.memory_unmap = persistent_memory_unmap;
+	int index = memory_interface_register(&global_memory_interface_persistent);
+	if (index < 0) {
+		munmap(address, size);
+		close(fd);
+		return 0;
+	}
+	memset(&global_persistent_instance, 0, sizeof(instance_t));
+	global_persistent_instance.config.page_size = global_instance.config.page_size;
+	global_persistent_instance.config.disable_decommit = 1;
+	global_persistent_instance.memory_interface = &global_memory_interface_persistent;
+	global_persistent_instance.memory_interface_index = (uint32_t)index;
+	global_persistent_region = region;
+	global_persistent_fd = fd;
+
+	if (created) {
+		region->magic = PERSISTENT_MAGIC;
+		region->version = PERSISTENT_VERSION;
+		region->heap_size = sizeof(heap_t);
+		region->span_count = (uint32_t)(size / SPAN_SIZE);
+		region->base = (uintptr_t)base;
+		region->size = size;
+		region->slot[0] = 1;
+		heap_initialize(&region->heap);
+	}
+	if (status)
+		*status = created ? RPMALLOC_PERSISTENT_CREATED :
+		                    ((region->state == PERSISTENT_STATE_CLEAN) ? RPMALLOC_PERSISTENT_ATTACHED :
+		                                                                 RPMALLOC_PERSISTENT_ATTACHED_UNCLEAN);
+	persistent_heap_bind(&region->heap);
+	region->state = PERSISTENT_STATE_OPEN;
+	msync(region, os_page_size, MS_SYNC);
+	return &region->heap;
+#else
+	(void)sizeof(path);
+	(void)sizeof(base);
+	(void)sizeof(size);
+	(void)sizeof(status);
+	return 0;
+#endif
+}
+
+int
+rpmalloc_heap_persistent_checkpoint(rpmalloc_heap_t* heap) {
+#if PLATFORM_POSIX
+	if (!global_persistent_region || (heap != &global_persistent_region->heap))
+		return -1;
+	return persistent_sync(global_persistent_region, PERSISTENT_STATE_OPEN);
+#else
+	(void)sizeof(heap);
+	return -1;
+#endif
+}
+
+int
+rpmalloc_heap_persistent_detach(rpmalloc_heap_t* heap) {
+#if PLATFORM_POSIX
+	heap_persistent_t* region = global_persistent_region;
+	if (!region || (heap != &region->heap))
+		return -1;
+	int result = persistent_sync(region, PERSISTENT_STATE_CLEAN);
+	span_map_remove_region(region, region->size);
+	munmap(region, region->size);
+	close(global_persistent_fd);
+	global_persistent_region = 0;
+	return result;
+#else
+	(void)sizeof(heap);
+	return -1;
+#endif
+}
+
+void
+rpmalloc_heap_persistent_set_root(rpmalloc_heap_t* heap, void* root) {
+	heap_persistent_t* region = global_persistent_region;
+	if (region && (heap == &region->heap))
+		region->root = root;
+}
+
+void*
+rpmalloc_heap_persistent_root(rpmalloc_heap_t* heap) {
+	heap_persistent_t* region = global_persistent_region;
+	if (region && (heap == &region->heap))
+		return region->root;
+	return 0;
+}
+
+rpmalloc_heap_ipc_t*
+rpmalloc_heap_ipc_create(const char* name, void* base, size_t size) {
+#if PLATFORM_POSIX
+	size &= ~(size_t)(SPAN_SIZE - 1);
+	if (global_ipc_region || ((uintptr_t)base & (SPAN_SIZE - 1)) || (size < 2 * SPAN_SIZE) ||
+	    (size / SPAN_SIZE > IPC_SPAN_COUNT))
+		return 0;
+	if (!global_rpmalloc_initialized)
+		rpmalloc_initialize(0);
+	int fd = -1;
+	if (name) {
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	} else {
+#if defined(__linux__) && defined(SYS_memfd_create)
+		fd = (int)syscall(SYS_memfd_create, "rpmalloc", 0);
+#else
+		char temp_name[64];
+		snprintf(temp_name, sizeof(temp_name), "/rpmalloc-%u-%p", (unsigned int)getpid(), base);
+		fd = shm_open(temp_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0)
+			shm_unlink(temp_name);
+#endif
+	}
+	if (fd < 0)
+		return 0;
+	if (ftruncate(fd, (off_t)size)) {
+		close(fd);
+		if (name)
+			shm_unlink(name);
+		return 0;
+	}
+	heap_ipc_t* region = ipc_map(fd, base, size, 1);
+	if (!region && name)
+		shm_unlink(name);
+	return region;
+#else
+	(void)sizeof(name);
+	(void)sizeof(base);
+	(void)sizeof(size);
+	return 0;
+#endif
+}
+
+rpmalloc_heap_ipc_t*
+rpmalloc_heap_ipc_attach(const char* name, void* base) {
+#if PLATFORM_POSIX
+	if (global_ipc_region || !name)
+		return 0;
+	if (!global_rpmalloc_initialized)
+		rpmalloc_initialize(0);
+	int fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0)
+		return 0;
+	struct stat file_stat;
+	if (fstat(fd, &file_stat)) {
+		close(fd);
+		return 0;
+	}
+	return ipc_map(fd, base, (size_t)file_stat.st_size, 0);
+#else
+	(void)sizeof(name);
+	(void)sizeof(base);
+	return 0;
+#endif
+}
+
+void
+rpmalloc_heap_ipc_detach(rpmalloc_heap_ipc_t* ipc) {
+#if PLATFORM_POSIX
+	if (!ipc || (ipc != global_ipc_region))
+		return;
+	global_ipc_region = 0;
+	span_map_remove_region(ipc, ipc->size);
+	munmap(ipc, ipc->size);
+#else
+	(void)sizeof(ipc);
+#endif
+}
+
+rpmalloc_heap_t*
+rpmalloc_heap_ipc_acquire(rpmalloc_heap_ipc_t* ipc) {
+	if (!ipc || (ipc != global_ipc_region))
+		return 0;
+	heap_t* heap = 0;
+	heap_shared_lock_acquire(&ipc->shared);
+	for (int iheap = 0; iheap < IPC_HEAP_COUNT; ++iheap) {
+		if (!ipc->heap[iheap].owner_process) {
+			heap = heap_initialize(&ipc->heap[iheap]);
+			heap->owner_process = global_process_id;
+			break;
+		}
+	}
+	heap_shared_lock_release(&ipc->shared);
+	if (heap) {
+		// The region is mapped at the same base address in all processes, so pointers into the region such as
+		// the shared lock are valid in every process. The instance is resolved by heap_instance in each process
+		heap->first_class = 1;
+		heap->shared = &ipc->shared;
+		heap->instance = 0;
+		heap->memory_interface = MEMORY_INTERFACE_IPC;
+	}
+	return heap;
+}
+
+void
+rpmalloc_heap_ipc_release(rpmalloc_heap_t* heap) {
+	heap_ipc_t* region = global_ipc_region;
+	if (!heap || !region || (heap->shared != &region->shared))
+		return;
+	heap_free_all(heap);
+	heap_shared_lock_acquire(&region->shared);
+	heap->owner_process = 0;
+	heap_shared_lock_release(&region->shared);
+}
+
 #endif
 
 #include "malloc.c"
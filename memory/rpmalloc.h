@@ -64,6 +64,10 @@ extern "C" {
 //  in which case the original pointer is still valid (just like a call to realloc which failes to allocate
 //  a new block).
 #define RPMALLOC_GROW_OR_FAIL 2
+//! Flag to rpaligned_realloc and rpmalloc_heap_realloc to zero initialize the memory from the old size (or the old
+//  usable size if not given) up to the new size. Only memory not already known to be zero is cleared, for example
+//  blocks from freshly mapped pages are not cleared again.
+#define RPMALLOC_ZERO_INIT 4
 
 typedef struct rpmalloc_global_statistics_t {
 	//! Current amount of virtual memory mapped, all of which might not have been committed (only if
@@ -180,8 +184,12 @@ typedef struct rpmalloc_config_t {
 	//  is low and there is enough active pages cached. If set to 1, keep all pages committed.
 	int disable_decommit;
 	//! Allocated pages names for systems supporting it to be able to distinguish among anonymous regions.
+	//  Regions are named <page_name>-<category>, or <page_name>-<category>:<label> for regions of a labelled
+	//  first class heap, where category is one of small, medium, large, huge or heapmeta. If not set only
+	//  regions of labelled heaps are named, with name prefix "rpmalloc".
 	const char* page_name;
 	//! Allocated huge pages names for systems supporting it to be able to distinguish among anonymous regions.
+	//  Used as name prefix in the same way as page_name.
 	const char* huge_page_name;
 	//! Unmap all memory on finalize if set to 1. Normally you can let the OS unmap all pages
 	//  when process exits, but if using rpmalloc in a dynamic library you might want to unmap
@@ -217,6 +225,15 @@ rpmalloc_thread_finalize(void);
 RPMALLOC_EXPORT void
 rpmalloc_thread_collect(void);
 
+//! Flag to rpmalloc_thread_warmup and rpmalloc_heap_warmup to pre-fault the memory of the warmed up blocks
+#define RPMALLOC_WARMUP_PREFAULT 1
+
+//! Make pages available in the calling thread heap for counts[i] blocks of sizes[i] bytes, for i < count, so the
+//  first allocations of these sizes do not need to map, commit or fault in memory. Sizes above the large block
+//  limit are ignored. Returns 0 on success, -1 if memory could not be mapped.
+RPMALLOC_EXPORT int
+rpmalloc_thread_warmup(const size_t* sizes, const size_t* counts, size_t count, unsigned int flags);
+
 //! Query if allocator is initialized for calling thread
 RPMALLOC_EXPORT int
 rpmalloc_is_thread_initialized(void);
@@ -233,6 +250,353 @@ rpmalloc_global_statistics(rpmalloc_global_statistics_t* stats);
 RPMALLOC_EXPORT void
 rpmalloc_dump_statistics(void* file);
 
+//! Statistics dump format writing a JSON object
+#define RPMALLOC_STATISTICS_JSON 0
+//! Statistics dump format writing one key=value line per counter, with keys separated by dots
+#define RPMALLOC_STATISTICS_KEYVALUE 1
+
+//! Dump statistics of all heaps of the default instance in a machine readable format to the given buffer, without
+//  allocating memory or using stdio. Includes counters per heap, per page type and per size class in use, and
+//  global totals of mapped, committed and live bytes, huge blocks and memory map, commit and decommit calls, as
+//  well as the OS page counters if built with ENABLE_STATISTICS. The output is null terminated if the capacity is
+//  non-zero. Returns the length of the complete output excluding the terminator, the output was truncated if
+//  this is not less than the capacity. Heaps are included as walked by rpmalloc_walk without
+//  RPMALLOC_WALK_ALL_THREADS, the heap list is locked while heaps are walked
+RPMALLOC_EXPORT size_t
+rpmalloc_dump_statistics_buffer(char* buffer, size_t capacity, unsigned int format);
+
+//! Start the sampling heap profiler, only available if built with ENABLE_SAMPLING=1. Allocations are sampled
+//  as a Poisson process over allocated bytes with the given mean number of bytes between samples (512KiB if
+//  zero), recording the stack trace of each sampled allocation. Calling again changes the interval.
+//  Allocations not sampled only pay for a byte countdown, frees only consult the sample table for blocks
+//  in pages holding a sampled block with the same block index modulo 16. Returns 0 on success, -1 if sampling
+//  is not available.
+RPMALLOC_EXPORT int
+rpmalloc_sampling_start(size_t interval);
+
+//! Stop sampling new allocations, sampled blocks are still tracked until freed
+RPMALLOC_EXPORT void
+rpmalloc_sampling_stop(void);
+
+//! Size class passed to sampling hooks for huge blocks
+#define RPMALLOC_SAMPLING_HUGE_CLASS 0xFFFFFFFFU
+
+//! Sampling hook, called with the hook context, the sampled block, the requested size, the size class and the
+//  ID of the heap the block was allocated from. The ID is passed rather than the heap since the heap can be
+//  released or reused before a free hook is called for its blocks
+typedef void (*rpmalloc_sampling_hook_t)(void* context, void* block, size_t size, unsigned int size_class,
+                                         unsigned int heap_id);
+
+//! Hooks called for sampled blocks, see rpmalloc_sampling_hooks
+typedef struct rpmalloc_sampling_hooks_t {
+	//! Called after a sampled block is allocated, can be null
+	rpmalloc_sampling_hook_t alloc;
+	//! Called before a sampled block is freed or released by a heap reset, rewind or release, can be null
+	rpmalloc_sampling_hook_t free;
+	//! Context passed to the hooks
+	void* context;
+} rpmalloc_sampling_hooks_t;
+
+//! Install hooks called for sampled allocations and start sampling with the given mean number of bytes between
+//  samples (512KiB if zero) as rpmalloc_sampling_start, only available if built with ENABLE_SAMPLING=1. Hooks are
+//  called in the allocating and freeing threads without allocator locks held. Frees of blocks in pages without a
+//  sampled block stay on the fast path, which only branches on a page flag. The block is the start of the
+//  allocated block, which differs from the returned pointer for aligned allocations. Blocks allocated and freed
+//  inside a hook are never reported, so hooks can allocate without recursing. Pass null to remove the hooks,
+//  sampling continues until rpmalloc_sampling_stop. Calls of the previous hooks in other threads have returned
+//  when this returns, so hook context can be released after removing the hooks, a hook must not wait for a
+//  thread changing the hooks. Returns 0 on success, -1 if sampling is not available.
+RPMALLOC_EXPORT int
+rpmalloc_sampling_hooks(const rpmalloc_sampling_hooks_t* hooks, size_t interval);
+
+//! Write the sampled heap profile to the given buffer as a null terminated string in the pprof legacy heap
+//  profile format (heap_v2), with live (in use) and accumulated (allocated) sample counts and sizes for each
+//  stack trace, followed by the mapped libraries needed for symbolization. Returns the length of the full
+//  profile excluding the terminator, if larger than or equal to capacity the output was truncated.
+RPMALLOC_EXPORT size_t
+rpmalloc_sampling_dump(char* buffer, size_t capacity);
+
+//! Write the lifetime histograms of sampled blocks to the given buffer as a null terminated string in the given
+//  format (RPMALLOC_STATISTICS_JSON or RPMALLOC_STATISTICS_KEYVALUE), only available if built with
+//  ENABLE_SAMPLING=1. Sampled allocations are timestamped with a cycle counter and the lifetime is recorded
+//  when freed, in log2 histograms per size class and per heap where bucket N counts lifetimes of [2^N, 2^(N+1))
+//  ticks. The measured ticks_per_second converts ticks to time. Returns the length of the full output excluding
+//  the terminator, if larger than or equal to capacity the output was truncated.
+RPMALLOC_EXPORT size_t
+rpmalloc_lifetime_dump(char* buffer, size_t capacity, unsigned int format);
+
+//! Write the latency histograms of the allocator slow paths to the given buffer as a null terminated string in
+//  the given format (RPMALLOC_STATISTICS_JSON or RPMALLOC_STATISTICS_KEYVALUE), only available if built with
+//  ENABLE_LATENCY=1. Span mapping, page commit and decommit, huge block map and unmap and thread free list
+//  adoption are timed with a cycle counter into log2 histograms per heap, where bucket N counts latencies of
+//  [2^N, 2^(N+1)) ticks, together with the count and total ticks per path. The measured ticks_per_second converts
+//  ticks to time. Returns the length of the full output excluding the terminator, if larger than or equal to
+//  capacity the output was truncated.
+RPMALLOC_EXPORT size_t
+rpmalloc_latency_dump(char* buffer, size_t capacity, unsigned int format);
+
+//! Magic identifier of a statistics export segment
+#define RPMALLOC_STATISTICS_EXPORT_MAGIC 0x3154525058454d52ULL
+//! Layout version of a statistics export segment
+#define RPMALLOC_STATISTICS_EXPORT_VERSION 1
+
+//! Layout of the shared memory segment of the statistics export. The sequence counter is odd while the
+//  counters are being updated, use rpmalloc_statistics_export_read to get a consistent snapshot.
+typedef struct rpmalloc_statistics_export_t {
+	//! Magic identifier, set when the segment is initialized
+	unsigned long long magic;
+	//! Layout version
+	unsigned int version;
+	//! Size of the segment
+	unsigned int size;
+	//! Process ID of the exporting process
+	unsigned long long pid;
+	//! Update interval in milliseconds
+	unsigned long long interval;
+	//! Non-zero if the OS page counters are maintained (built with ENABLE_STATISTICS)
+	unsigned long long statistics_enabled;
+	//! Size in bytes of the memory pages counted by the OS page counters (the configured page size)
+	unsigned long long page_size;
+	//! Sequence counter, incremented before and after each update
+	unsigned long long sequence;
+	//! Time of last update in nanoseconds since the epoch
+	unsigned long long timestamp;
+	//! Number of updates
+	unsigned long long update_count;
+	//! Number of heaps, including released heaps
+	unsigned long long heaps;
+	//! Number of heaps in use
+	unsigned long long heaps_active;
+	//! Number of mapped spans
+	unsigned long long spans;
+	//! Number of bytes mapped by heaps
+	unsigned long long mapped;
+	//! Number of memory map calls
+	unsigned long long map_calls;
+	//! Number of memory unmap calls
+	unsigned long long unmap_calls;
+	//! Number of memory commit calls
+	unsigned long long commit_calls;
+	//! Number of memory decommit calls
+	unsigned long long decommit_calls;
+	//! Number of OS memory pages mapped (only if ENABLE_STATISTICS=1)
+	unsigned long long os_pages_mapped;
+	//! Peak number of OS memory pages mapped (only if ENABLE_STATISTICS=1)
+	unsigned long long os_pages_mapped_peak;
+	//! Number of OS memory pages active (only if ENABLE_STATISTICS=1)
+	unsigned long long os_pages_active;
+	//! Peak number of OS memory pages active (only if ENABLE_STATISTICS=1)
+	unsigned long long os_pages_active_peak;
+	//! Total number of OS memory pages committed (only if ENABLE_STATISTICS=1)
+	unsigned long long os_pages_committed;
+	//! Total number of OS memory pages decommitted (only if ENABLE_STATISTICS=1)
+	unsigned long long os_pages_decommitted;
+	//! Total number of heaps created (only if ENABLE_STATISTICS=1)
+	unsigned long long heaps_created;
+} rpmalloc_statistics_export_t;
+
+//! Start publishing aggregated allocator counters of the default instance to a POSIX shared memory segment with
+//  the given name, updated by a background thread at the given interval in milliseconds (1000 if zero). The
+//  allocation paths are not affected, counters are only read by the background thread. The segment is removed
+//  when the export is stopped or the allocator is finalized. A segment with the same name is only replaced if
+//  left by a process that terminated. Returns 0 on success, -1 if the segment could not be created or is in
+//  use, an export is already running or POSIX shared memory is not available.
+RPMALLOC_EXPORT int
+rpmalloc_statistics_export_start(const char* name, unsigned int interval);
+
+//! Stop publishing allocator counters and remove the shared memory segment
+RPMALLOC_EXPORT void
+rpmalloc_statistics_export_stop(void);
+
+//! Copy a consistent snapshot of the counters in a mapped statistics export segment, retrying while the
+//  segment is being updated. Returns 0 on success, -1 if the segment is not initialized, has a different
+//  layout version or could not be read consistently.
+RPMALLOC_EXPORT int
+rpmalloc_statistics_export_read(const rpmalloc_statistics_export_t* segment, rpmalloc_statistics_export_t* snapshot);
+
+//! Mapped memory region categories in rpmalloc_smaps_t, small/medium/large page spans, huge blocks and heap metadata
+#define RPMALLOC_SMAPS_SMALL 0
+#define RPMALLOC_SMAPS_MEDIUM 1
+#define RPMALLOC_SMAPS_LARGE 2
+#define RPMALLOC_SMAPS_HUGE 3
+#define RPMALLOC_SMAPS_HEAPMETA 4
+#define RPMALLOC_SMAPS_CATEGORY_COUNT 5
+//! Number of heap labels tracked in rpmalloc_smaps_t
+#define RPMALLOC_SMAPS_LABEL_COUNT 16
+//! Size of a heap label including terminator, longer labels are truncated
+#define RPMALLOC_HEAP_LABEL_SIZE 32
+
+//! Memory usage of named regions, in bytes
+typedef struct rpmalloc_smaps_usage_t {
+	//! Number of regions
+	size_t regions;
+	//! Mapped size
+	size_t size;
+	//! Resident set size
+	size_t rss;
+	//! Proportional set size
+	size_t pss;
+	//! Swapped out size
+	size_t swap;
+} rpmalloc_smaps_usage_t;
+
+//! Memory usage of named allocator regions parsed from /proc/<pid>/smaps
+typedef struct rpmalloc_smaps_t {
+	//! Usage of all allocator regions
+	rpmalloc_smaps_usage_t total;
+	//! Usage per region category (RPMALLOC_SMAPS_*)
+	rpmalloc_smaps_usage_t category[RPMALLOC_SMAPS_CATEGORY_COUNT];
+	//! Usage per heap label, for regions of labelled first class heaps
+	struct {
+		//! Heap label
+		char label[RPMALLOC_HEAP_LABEL_SIZE];
+		//! Usage of regions with the label
+		rpmalloc_smaps_usage_t usage;
+	} label[RPMALLOC_SMAPS_LABEL_COUNT];
+	//! Number of used entries in the label array
+	size_t label_count;
+	//! Usage of labelled regions not fitting in the label array
+	rpmalloc_smaps_usage_t label_other;
+} rpmalloc_smaps_t;
+
+//! Parse /proc/<pid>/smaps (the calling process if pid is zero) into a report of memory usage per region
+//  category and heap label, for regions named with the given prefix (rpmalloc if null, see page_name in
+//  rpmalloc_config_t). Requires a kernel with CONFIG_ANON_VMA_NAME for regions to be named. Returns 0 on
+//  success, -1 if the file could not be read or the platform has no smaps.
+RPMALLOC_EXPORT int
+rpmalloc_smaps_parse(int pid, const char* prefix, rpmalloc_smaps_t* report);
+
+//! Heap walk entry is a span
+#define RPMALLOC_WALK_SPAN 0
+//! Heap walk entry is a page
+#define RPMALLOC_WALK_PAGE 1
+//! Heap walk entry is a used block
+#define RPMALLOC_WALK_BLOCK 2
+
+//! Flag to heap walk functions to visit used blocks in addition to spans and pages
+#define RPMALLOC_WALK_BLOCKS 1
+//! Flag to rpmalloc_walk to also visit heaps owned by other threads, which must not use their heaps during the walk
+#define RPMALLOC_WALK_ALL_THREADS 2
+
+//! Flag set in walk entry if the page is in the free page list of the heap
+#define RPMALLOC_WALK_PAGE_FREE 1
+//! Flag set in walk entry if all blocks in the page are allocated
+#define RPMALLOC_WALK_PAGE_FULL 2
+//! Flag set in walk entry if the memory pages of the page except the first have been decommitted
+#define RPMALLOC_WALK_PAGE_DECOMMITTED 4
+
+//! Span, page or block visited by a heap walk
+typedef struct rpmalloc_walk_entry_t {
+	//! Entry type, RPMALLOC_WALK_SPAN, RPMALLOC_WALK_PAGE or RPMALLOC_WALK_BLOCK
+	unsigned int type;
+	//! Page type, 0 for small (64KiB pages), 1 for medium (4MiB), 2 for large (64MiB) and 3 for huge blocks
+	unsigned int page_type;
+	//! Owning heap
+	struct heap_t* heap;
+	//! Start of the span, page or block
+	void* address;
+	//! Size of the span mapping, page or block in bytes
+	size_t size;
+	//! Number of bytes committed in the span or page, zero for blocks
+	size_t committed;
+	//! Size class of the page or block, zero for huge blocks
+	unsigned int size_class;
+	//! Block size of the page or block
+	size_t block_size;
+	//! Number of blocks in the page
+	unsigned int block_count;
+	//! Number of blocks in the page that have ever been handed out
+	unsigned int block_initialized;
+	//! Number of live blocks in the page, not counting blocks in free lists or waiting to be freed by other threads
+	unsigned int block_used;
+	//! Number of pages in the span
+	unsigned int page_count;
+	//! Number of pages initialized in the span, the remaining pages have never been touched
+	unsigned int page_initialized;
+	//! Combination of RPMALLOC_WALK_PAGE_* flags for pages
+	unsigned int flags;
+} rpmalloc_walk_entry_t;
+
+//! Heap walk callback, return non-zero to stop the walk
+typedef int (*rpmalloc_walk_callback_t)(const rpmalloc_walk_entry_t* entry, void* context);
+
+//! Number of size classes of small, medium and large blocks
+#define RPMALLOC_SIZE_CLASS_COUNT 117
+
+//! Fragmentation report of committed versus live bytes, see rpmalloc_heap_fragmentation
+typedef struct rpmalloc_fragmentation_t {
+	//! Number of heaps included in the report
+	size_t heap_count;
+	//! Number of bytes mapped in spans
+	size_t mapped;
+	//! Number of bytes committed in initialized pages and huge blocks
+	size_t committed;
+	//! Number of bytes in live blocks, counted with the block size of the size class
+	size_t live;
+	//! Number of pages in heap free lists, all blocks freed but page memory kept by the heap
+	size_t page_free;
+	//! Number of bytes still committed in free pages
+	size_t page_free_committed;
+	//! Number of pages not in heap free lists without live blocks, waiting for the owning heap to adopt blocks
+	//! freed by other threads
+	size_t page_empty;
+	//! Number of bytes committed in empty pages
+	size_t page_empty_committed;
+	//! Number of pages with live blocks where at most a quarter of the blocks are live
+	size_t page_sparse;
+	//! Number of bytes committed in sparse pages
+	size_t page_sparse_committed;
+	//! Number of huge blocks
+	size_t huge_count;
+	//! Number of bytes committed in huge blocks
+	size_t huge_committed;
+	//! Number of huge block allocations since the heaps were created (only if ENABLE_STATISTICS=1)
+	size_t huge_alloc_total;
+	//! Number of bytes requested by huge block allocations (only if ENABLE_STATISTICS=1)
+	size_t huge_requested_total;
+	//! Number of bytes in huge blocks allocated, rounded to the page size (only if ENABLE_STATISTICS=1)
+	size_t huge_allocated_total;
+	//! Per size class fragmentation, indexed by size class
+	struct {
+		//! Block size of the size class, zero for unused entries
+		size_t block_size;
+		//! Number of pages with live blocks
+		size_t page_count;
+		//! Number of sparse pages
+		size_t page_sparse;
+		//! Number of bytes committed in pages with live blocks
+		size_t committed;
+		//! Number of bytes in live blocks
+		size_t live;
+		//! Number of allocations since the heaps were created, each using block_size bytes (only if
+		//! ENABLE_STATISTICS=1)
+		size_t alloc_total;
+		//! Number of bytes requested by the allocations, the bytes lost to size class rounding and alignment
+		//! padding are alloc_total * block_size - requested_total (only if ENABLE_STATISTICS=1)
+		size_t requested_total;
+	} size_class[RPMALLOC_SIZE_CLASS_COUNT];
+} rpmalloc_fragmentation_t;
+
+//! Walk the heaps of the default instance that are safe to walk from the calling thread, see rpmalloc_heap_walk:
+//  the calling thread heap, released heaps and first class heaps not owned by a thread. Heaps owned by other
+//  threads are only walked if RPMALLOC_WALK_ALL_THREADS is set in flags, in which case the caller must ensure
+//  those threads do not allocate or free during the walk. The heap list is locked during the walk, the callback
+//  must not acquire or release heaps, or allocate from a thread that has not allocated before. Returns non-zero
+//  if the walk was stopped by the callback.
+RPMALLOC_EXPORT int
+rpmalloc_walk(unsigned int flags, rpmalloc_walk_callback_t callback, void* context);
+
+//! Get the fragmentation report of the heaps of the default instance walked by rpmalloc_walk without
+//  RPMALLOC_WALK_ALL_THREADS
+RPMALLOC_EXPORT void
+rpmalloc_fragmentation(rpmalloc_fragmentation_t* report);
+
+//! Dump the fragmentation report of the heaps included by rpmalloc_fragmentation to the given file, with the
+//  totals, the size classes in use, the bytes lost to size class rounding if built with ENABLE_STATISTICS=1 and
+//  the free and sparse pages of each heap
+RPMALLOC_EXPORT void
+rpmalloc_dump_fragmentation(void* file);
+
 //! Allocate a memory block of at least the given size
 RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
 rpmalloc(size_t size) RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(1);
@@ -250,7 +614,7 @@ RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
 rprealloc(void* ptr, size_t size) RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(2);
 
 //! Reallocate the given block to at least the given size and alignment,
-//  with optional control flags (see RPMALLOC_NO_PRESERVE).
+//  with optional control flags (see RPMALLOC_NO_PRESERVE, RPMALLOC_GROW_OR_FAIL and RPMALLOC_ZERO_INIT).
 //  Alignment must be a power of two and a multiple of sizeof(void*),
 //  and should ideally be less than memory page size. A caveat of rpmalloc
 //  internals is that this must also be strictly less than the span size (default 64KiB)
@@ -301,6 +665,13 @@ rpfree(void* ptr);
 RPMALLOC_EXPORT size_t
 rpmalloc_usable_size(void* ptr);
 
+//! Query if the pointer is in memory mapped by the allocator for blocks, without locking. Returns non-zero for
+//  all pointers returned by allocation functions and pointers into small, medium and large blocks, and zero
+//  for pointers to memory from other allocators. Only the first 256MiB of a huge block are covered. Spans in a
+//  cross process heap region are covered in all processes mapping the region.
+RPMALLOC_EXPORT int
+rpmalloc_owns(const void* ptr);
+
 //! Dummy empty function for forcing linker symbol inclusion
 RPMALLOC_EXPORT void
 rpmalloc_linker_reference(void);
@@ -310,12 +681,92 @@ rpmalloc_linker_reference(void);
 //! Heap type
 typedef struct heap_t rpmalloc_heap_t;
 
+//! Heap mark type
+typedef struct heap_mark_t rpmalloc_heap_mark_t;
+
+//! Shared heap type
+typedef struct heap_shared_t rpmalloc_heap_shared_t;
+
+//! Allocator instance type
+typedef struct instance_t rpmalloc_instance_t;
+
+//! Cross process heap region type
+typedef struct heap_ipc_t rpmalloc_heap_ipc_t;
+
+//! Callback when a heap limit is reached, called with the heap and the number of bytes the heap needs to commit.
+//  Return non-zero to retry the limit check, for example after raising the limit or releasing memory, or
+//  zero to fail the allocation.
+typedef int (*rpmalloc_heap_limit_callback_fn)(rpmalloc_heap_t* heap, size_t size);
+
+//! Heap limit policy to fail the allocation when the limit is reached (default)
+#define RPMALLOC_HEAP_LIMIT_FAIL 0
+//! Heap limit policy flag to unmap spans retained by the heap without any used pages when the limit is reached
+#define RPMALLOC_HEAP_LIMIT_TRIM 1
+//! Heap limit policy flag to call the heap limit callback when the limit is reached (after trimming if also set)
+#define RPMALLOC_HEAP_LIMIT_CALLBACK 2
+
+//! Pinned heap flag to lock the reserved memory in physical memory
+#define RPMALLOC_HEAP_PIN_LOCK 1
+//! Pinned heap flag to divert allocations exceeding the reserve to the calling thread heap instead of failing
+#define RPMALLOC_HEAP_PIN_DIVERT 2
+
+//! Configuration of a pinned heap. Sizes are rounded up to whole pages of the corresponding type.
+typedef struct rpmalloc_heap_pin_config_t {
+	//! Number of bytes to reserve for blocks up to 4KiB, in 64KiB pages
+	size_t small_size;
+	//! Number of bytes to reserve for blocks up to 256KiB, in 4MiB pages
+	size_t medium_size;
+	//! Number of bytes to reserve for blocks up to 8MiB, in 64MiB pages
+	size_t large_size;
+	//! Combination of RPMALLOC_HEAP_PIN_LOCK and RPMALLOC_HEAP_PIN_DIVERT flags
+	unsigned int flags;
+} rpmalloc_heap_pin_config_t;
+
+//! Memory operation counters of a heap
+typedef struct rpmalloc_heap_statistics_t {
+	//! Number of bytes currently mapped by the heap
+	size_t mapped;
+	//! Number of bytes currently committed by the heap in initialized pages and huge blocks
+	size_t committed;
+	//! Number of bytes reserved and pre-faulted for a pinned heap
+	size_t pinned;
+	//! Number of memory map calls made by the heap
+	size_t map_calls;
+	//! Number of memory unmap calls made for memory of the heap
+	size_t unmap_calls;
+	//! Number of memory commit calls made by the heap
+	size_t commit_calls;
+	//! Number of memory decommit calls made by the heap
+	size_t decommit_calls;
+	//! Number of allocations diverted to the thread heap when the pinned heap reserve was exhausted
+	size_t pin_diverted;
+	//! Number of allocations that failed when the pinned heap reserve was exhausted
+	size_t pin_failed;
+} rpmalloc_heap_statistics_t;
+
 //! Acquire a new heap. Will reuse existing released heaps or allocate memory for a new heap
 //  if none available. Heap API is implemented with the strict assumption that only one single
 //  thread will call heap functions for a given heap at any given time, no functions are thread safe.
 RPMALLOC_EXPORT rpmalloc_heap_t*
 rpmalloc_heap_acquire(void);
 
+//! Acquire a new heap owned by the calling thread. Only the owning thread may allocate from the heap, but
+//  blocks allocated from the heap can be freed from any thread with rpfree. Deallocations from other threads
+//  are deferred to the owning thread in the same way as for thread heaps.
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_heap_acquire_thread(void);
+
+//! Transfer ownership of a heap acquired with rpmalloc_heap_acquire_thread to the calling thread. The previous
+//  owning thread must no longer use the heap, for example when it has terminated.
+RPMALLOC_EXPORT void
+rpmalloc_heap_thread_adopt(rpmalloc_heap_t* heap);
+
+//! Leave a heap acquired with rpmalloc_heap_acquire_thread without an owning thread, for example before the
+//  owning thread terminates. Deallocations from all threads are deferred until the heap is adopted again with
+//  rpmalloc_heap_thread_adopt. No thread may allocate from an orphaned heap.
+RPMALLOC_EXPORT void
+rpmalloc_heap_thread_orphan(rpmalloc_heap_t* heap);
+
 //! Release a heap (does NOT free the memory allocated by the heap, use rpmalloc_heap_free_all before destroying the
 //! heap).
 //  Releasing a heap will enable it to be reused by other threads. Safe to pass a null pointer.
@@ -371,12 +822,266 @@ rpmalloc_heap_free(rpmalloc_heap_t* heap, void* ptr);
 RPMALLOC_EXPORT void
 rpmalloc_heap_free_all(rpmalloc_heap_t* heap);
 
+//! Free all memory allocated by the heap but keep spans mapped for reuse by the heap, up to the given number of
+//  bytes of previously used memory pages. Spans exceeding the limit and huge blocks are unmapped. Unlike
+//  rpmalloc_heap_free_all, following allocations from the heap do not need to map memory until the retained
+//  spans are used up.
+RPMALLOC_EXPORT void
+rpmalloc_heap_reset(rpmalloc_heap_t* heap, size_t retain_size);
+
+//! Mark the current allocation state of the heap. All blocks allocated from the heap after the mark is
+//  taken are released with rpmalloc_heap_rewind. Blocks allocated before the mark must not be freed until
+//  the heap is rewound to the mark. Marks can be nested, rewinding to a mark also releases all later marks.
+//  Returns null if the mark could not be allocated.
+RPMALLOC_EXPORT rpmalloc_heap_mark_t*
+rpmalloc_heap_mark(rpmalloc_heap_t* heap);
+
+//! Release all blocks allocated from the heap after the given mark was taken, keeping the memory mapped
+//  for reuse by the heap. Huge blocks are only released for heaps acquired with rpmalloc_heap_acquire.
+RPMALLOC_EXPORT void
+rpmalloc_heap_rewind(rpmalloc_heap_t* heap, rpmalloc_heap_mark_t* mark);
+
+//! Limit the memory committed by the heap in initialized pages and huge blocks to the given number of bytes, zero
+//  for no limit. Address space reserved for spans is not counted. The limit is checked when the heap initializes
+//  or recommits a page, takes a span from a shared heap pool and maps a huge block, not for each allocated block.
+//  The policy is either RPMALLOC_HEAP_LIMIT_FAIL or a combination of RPMALLOC_HEAP_LIMIT_TRIM, which unmaps
+//  spans without used pages, and RPMALLOC_HEAP_LIMIT_CALLBACK. Allocations that would exceed the limit return a
+//  null pointer.
+RPMALLOC_EXPORT void
+rpmalloc_heap_set_limit(rpmalloc_heap_t* heap, size_t limit, unsigned int policy);
+
+//! Set the callback used by the RPMALLOC_HEAP_LIMIT_CALLBACK policy
+RPMALLOC_EXPORT void
+rpmalloc_heap_set_limit_callback(rpmalloc_heap_t* heap, rpmalloc_heap_limit_callback_fn callback);
+
+//! Get the number of bytes currently committed by the heap in initialized pages and huge blocks, the quantity
+//  checked against the heap limit. Cheap to call from any thread.
+RPMALLOC_EXPORT size_t
+rpmalloc_heap_usage(rpmalloc_heap_t* heap);
+
+//! Set the memory interface used by the heap to map spans and huge blocks, or null to use the memory interface
+//  of the allocator instance of the heap. Spans keep the interface they were mapped with, so the interface can
+//  be changed at any time and must remain valid until all memory mapped with it is unmapped. Missing functions
+//  are set to the default implementation in the same way as for rpmalloc_initialize. At most 14 interfaces
+//  besides the global memory interface can be in use. Returns 0 on success, -1 if too many interfaces are in use.
+RPMALLOC_EXPORT int
+rpmalloc_heap_set_memory_interface(rpmalloc_heap_t* heap, rpmalloc_interface_t* memory_interface);
+
+//! Create an allocator instance with its own configuration, memory interface and heaps. The global allocator
+//  is the default instance. Heaps acquired from the instance map memory with the instance memory interface,
+//  or the default implementation using huge pages if enabled in the configuration, and decommit memory as
+//  configured for the instance. The page size is process wide and the page_size field is ignored. The memory
+//  interface uses one of the interface slots described in rpmalloc_heap_set_memory_interface. Huge pages are
+//  disabled for the instance if the OS does not support them. The allocator is initialized if needed. Thread
+//  heaps used by rpmalloc, rpfree and the other global functions, and the sub heaps of shared heaps, always
+//  belong to the default instance. Returns null if the instance could not be created.
+RPMALLOC_EXPORT rpmalloc_instance_t*
+rpmalloc_instance_create(rpmalloc_interface_t* memory_interface, const rpmalloc_config_t* config);
+
+//! Destroy an allocator instance, freeing all memory of all heaps acquired from it, including released heaps.
+//  The default instance cannot be destroyed.
+RPMALLOC_EXPORT void
+rpmalloc_instance_destroy(rpmalloc_instance_t* instance);
+
+//! Get the default instance used by the global allocator and rpmalloc_heap_acquire
+RPMALLOC_EXPORT rpmalloc_instance_t*
+rpmalloc_instance_default(void);
+
+//! Get the configuration of an allocator instance
+RPMALLOC_EXPORT const rpmalloc_config_t*
+rpmalloc_instance_config(rpmalloc_instance_t* instance);
+
+//! Acquire a new heap from an allocator instance, see rpmalloc_heap_acquire. Released heaps keep their memory
+//  until the instance is destroyed.
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_instance_heap_acquire(rpmalloc_instance_t* instance);
+
+//! Get the allocator instance a heap was acquired from
+RPMALLOC_EXPORT rpmalloc_instance_t*
+rpmalloc_heap_instance(rpmalloc_heap_t* heap);
+
+//! Persistent heap region was created
+#define RPMALLOC_PERSISTENT_CREATED 0
+//! Persistent heap region was attached after being detached
+#define RPMALLOC_PERSISTENT_ATTACHED 1
+//! Persistent heap region was attached but was not detached by the process that last mapped it
+#define RPMALLOC_PERSISTENT_ATTACHED_UNCLEAN 2
+
+//! Acquire a heap persisted in the given file, mapped at the given base address which must be aligned to 256MiB.
+//  The file is created with the given size, rounded down to whole 256MiB spans of which the first holds the
+//  heap metadata, or reattached if it exists. The heap, pages and free lists live in the file, so blocks keep
+//  their content and addresses across restarts. Store a pointer to the root of the persisted data with
+//  rpmalloc_heap_persistent_set_root. The file is a shared mapping updated in place by every call using the
+//  heap, there is no journal and no snapshot is taken. If the status is RPMALLOC_PERSISTENT_ATTACHED_UNCLEAN,
+//  the heap metadata is consistent only if the previous process did not terminate inside a call using the
+//  heap and the system did not crash while the heap was mapped. After a system crash the file holds an
+//  unspecified mix of old and new pages and must be discarded. Only one persistent heap can be mapped by a
+//  process, and memory is never decommitted. Use rpmalloc_heap_persistent_detach instead of
+//  rpmalloc_heap_release. Requires POSIX file mappings, returns null if the file could not be mapped at the
+//  base address or has a different layout.
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_heap_persistent_acquire(const char* path, void* base, size_t size, int* status);
+
+//! Write the modified pages of the persistent heap back to the file. This only makes the current state
+//  durable, it is not an atomic snapshot and the file can not be rolled back to it. Call it when no other
+//  thread is using the heap. Returns 0 on success, -1 on failure
+RPMALLOC_EXPORT int
+rpmalloc_heap_persistent_checkpoint(rpmalloc_heap_t* heap);
+
+//! Write the persistent heap back to the file, mark it as cleanly detached and unmap it. Returns 0 on success,
+//  -1 on failure
+RPMALLOC_EXPORT int
+rpmalloc_heap_persistent_detach(rpmalloc_heap_t* heap);
+
+//! Set the root pointer stored in the persistent heap
+RPMALLOC_EXPORT void
+rpmalloc_heap_persistent_set_root(rpmalloc_heap_t* heap, void* root);
+
+//! Get the root pointer stored in the persistent heap
+RPMALLOC_EXPORT void*
+rpmalloc_heap_persistent_root(rpmalloc_heap_t* heap);
+
+//! Create a cross process heap region in a new POSIX shared memory object with the given name, or in an
+//  anonymous memory file inherited by child processes if name is null. The region is mapped at the given base
+//  address which must be aligned to 256MiB and must be free in all processes using the region, and the size is
+//  rounded down to whole 256MiB spans of which the first holds the region metadata. Blocks are allocated from
+//  heaps acquired from the region with rpmalloc_heap_ipc_acquire and can be read, written and freed with
+//  rpfree by any process mapping the region. Only one region can be mapped by a process, and memory in the
+//  region is never decommitted. If a process terminates while holding the region lock, the lock is taken over
+//  by the next process waiting for it, but the region is only consistent if the process did not terminate
+//  inside a call using the region. Heaps of a terminated process are not returned to the region. Requires
+//  POSIX shared memory, returns null if the region could not be created.
+RPMALLOC_EXPORT rpmalloc_heap_ipc_t*
+rpmalloc_heap_ipc_create(const char* name, void* base, size_t size);
+
+//! Attach to a cross process heap region created by another process with the given name and base address.
+//  Returns null if the region could not be mapped at the base address or has a different layout.
+RPMALLOC_EXPORT rpmalloc_heap_ipc_t*
+rpmalloc_heap_ipc_attach(const char* name, void* base);
+
+//! Unmap a cross process heap region from the calling process. Heaps acquired by the process must be released
+//  first. The shared memory object is not removed, use shm_unlink once all processes are done with it.
+RPMALLOC_EXPORT void
+rpmalloc_heap_ipc_detach(rpmalloc_heap_ipc_t* ipc);
+
+//! Acquire a heap in the cross process heap region, owned by the calling process. Blocks freed by other
+//  processes are deferred to the heap and reused by the next allocation that needs a page. Returns null if
+//  all heaps in the region are in use. A child process created by fork must acquire its own heap.
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_heap_ipc_acquire(rpmalloc_heap_ipc_t* ipc);
+
+//! Free all memory of a heap in the cross process heap region and return it to the region
+RPMALLOC_EXPORT void
+rpmalloc_heap_ipc_release(rpmalloc_heap_t* heap);
+
+//! Make pages available in the heap for counts[i] blocks of sizes[i] bytes, for i < count, see
+//  rpmalloc_thread_warmup. Returns 0 on success, -1 if memory could not be mapped.
+RPMALLOC_EXPORT int
+rpmalloc_heap_warmup(rpmalloc_heap_t* heap, const size_t* sizes, const size_t* counts, size_t count,
+                     unsigned int flags);
+
+//! Acquire a new pinned heap. The reserved memory is mapped and pre-faulted when the heap is acquired, and
+//  optionally locked in physical memory. The heap never maps, decommits or unmaps memory afterwards, so
+//  allocations make no system calls and take no page faults. Allocations exceeding the reserve, including all
+//  huge blocks, fail or are diverted to the calling thread heap if RPMALLOC_HEAP_PIN_DIVERT is set.
+//  Use rpmalloc_heap_reset to reuse the reserve, rpmalloc_heap_free_all releases it.
+//  Returns null if the memory could not be reserved or locked.
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_heap_acquire_pinned(const rpmalloc_heap_pin_config_t* config);
+
+//! Get the memory operation counters of the heap
+RPMALLOC_EXPORT void
+rpmalloc_heap_statistics(rpmalloc_heap_t* heap, rpmalloc_heap_statistics_t* stats);
+
+//! Visit the spans of the heap, each followed by its initialized pages, and the used blocks of each page if
+//  RPMALLOC_WALK_BLOCKS is set in flags. Huge blocks are only tracked by first class heaps. The heap must not
+//  be used by other threads during the walk, and the callback must not allocate from or free to the heap.
+//  Returns non-zero if the walk was stopped by the callback.
+RPMALLOC_EXPORT int
+rpmalloc_heap_walk(rpmalloc_heap_t* heap, unsigned int flags, rpmalloc_walk_callback_t callback, void* context);
+
+//! Get the fragmentation report of the heap, comparing committed and live bytes per size class and counting
+//  nearly empty pages and free pages kept committed by the heap. Same restrictions as rpmalloc_heap_walk
+RPMALLOC_EXPORT void
+rpmalloc_heap_fragmentation(rpmalloc_heap_t* heap, rpmalloc_fragmentation_t* report);
+
+//! Acquire a new heap shared by a group of threads. Unlike rpmalloc_heap_t, the rpmalloc_heap_shared_alloc,
+//  calloc, realloc and free functions are thread safe. Each calling thread allocates from a sub heap owned by
+//  the thread, and sub heaps use a span pool shared by all threads in the group before mapping more memory.
+//  Blocks can be freed from any thread. Shared heaps and their sub heaps belong to the default instance and map
+//  memory with the global memory interface. Returns null if out of memory.
+RPMALLOC_EXPORT rpmalloc_heap_shared_t*
+rpmalloc_heap_shared_acquire(void);
+
+//! Release a shared heap and all the sub heaps. Does NOT free the memory allocated by the heap, use
+//  rpmalloc_heap_shared_free_all before releasing the heap. Safe to pass a null pointer.
+RPMALLOC_EXPORT void
+rpmalloc_heap_shared_release(rpmalloc_heap_shared_t* shared);
+
+//! Get the sub heap of the shared heap for the calling thread. The sub heap can be used with the
+//  rpmalloc_heap_* functions by the calling thread. Returns null if out of memory.
+RPMALLOC_EXPORT rpmalloc_heap_t*
+rpmalloc_heap_shared_thread_heap(rpmalloc_heap_shared_t* shared);
+
+//! Allocate a memory block of at least the given size using the given shared heap.
+RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_alloc(rpmalloc_heap_shared_t* shared, size_t size) RPMALLOC_ATTRIB_MALLOC
+    RPMALLOC_ATTRIB_ALLOC_SIZE(2);
+
+//! Allocate a memory block of at least the given size using the given shared heap. The returned
+//  block will have the requested alignment, with the same constraints as rpmalloc_heap_aligned_alloc.
+RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_aligned_alloc(rpmalloc_heap_shared_t* shared, size_t alignment, size_t size)
+    RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(3);
+
+//! Allocate a memory block of at least the given size using the given shared heap and zero initialize it.
+RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_calloc(rpmalloc_heap_shared_t* shared, size_t num, size_t size) RPMALLOC_ATTRIB_MALLOC
+    RPMALLOC_ATTRIB_ALLOC_SIZE2(2, 3);
+
+//! Reallocate the given block to at least the given size. The memory block MUST be allocated
+//  by the same shared heap given to this function, but can have been allocated by any thread.
+RPMALLOC_EXPORT RPMALLOC_ALLOCATOR void*
+rpmalloc_heap_shared_realloc(rpmalloc_heap_shared_t* shared, void* ptr, size_t size, unsigned int flags)
+    RPMALLOC_ATTRIB_MALLOC RPMALLOC_ATTRIB_ALLOC_SIZE(3);
+
+//! Free the given memory block from the given shared heap, from any thread. The memory block MUST be
+//  allocated by the same shared heap given to this function.
+RPMALLOC_EXPORT void
+rpmalloc_heap_shared_free(rpmalloc_heap_shared_t* shared, void* ptr);
+
+//! Free all memory allocated by all threads from the shared heap. No thread may use the shared heap
+//  while this function executes.
+RPMALLOC_EXPORT void
+rpmalloc_heap_shared_free_all(rpmalloc_heap_shared_t* shared);
+
+//! Free all memory allocated by all threads from the shared heap but keep spans mapped in the shared span
+//  pool, up to the given number of bytes of previously used memory pages. No thread may use the shared heap
+//  while this function executes.
+RPMALLOC_EXPORT void
+rpmalloc_heap_shared_reset(rpmalloc_heap_shared_t* shared, size_t retain_size);
+
 //! Set the given heap as the current heap for the calling thread. A heap MUST only be current heap
 //  for a single thread, a heap can never be shared between multiple threads. The previous
 //  current heap for the calling thread is released to be reused by other threads.
 RPMALLOC_EXPORT void
 rpmalloc_heap_thread_set_current(rpmalloc_heap_t* heap);
 
+//! Set the user data pointer of the given heap. User data is reset when a released heap is reused.
+RPMALLOC_EXPORT void
+rpmalloc_heap_set_user_data(rpmalloc_heap_t* heap, void* user_data);
+
+//! Set the label of the given heap, used to name the mapped memory regions of the heap on systems supporting
+//  it (see page_name in rpmalloc_config_t). Regions already mapped by the heap are renamed. The label is
+//  truncated to RPMALLOC_HEAP_LABEL_SIZE - 1 characters and reset when a released heap is reused. Pass null to
+//  clear the label.
+RPMALLOC_EXPORT void
+rpmalloc_heap_set_label(rpmalloc_heap_t* heap, const char* label);
+
+//! Get the user data pointer of the given heap, null if not set
+RPMALLOC_EXPORT void*
+rpmalloc_heap_user_data(rpmalloc_heap_t* heap);
+
 //! Returns which heap the given pointer is allocated on
 RPMALLOC_EXPORT rpmalloc_heap_t*
 rpmalloc_get_heap_for_ptr(void* ptr);
@@ -41,3 +41,20 @@
 #define MEMORY_API extern
 #endif
 #endif
+
+typedef struct memory_context_statistics_t memory_context_statistics_t;
+
+/*! Memory statistics for a single allocation context, aggregated over all threads.
+Sizes are usable block sizes, which include size class rounding */
+struct memory_context_statistics_t {
+	/*! Allocation context, zero for blocks not in a context heap */
+	hash_t context;
+	/*! Number of currently allocated blocks */
+	size_t allocations_current;
+	/*! Number of currently allocated bytes */
+	size_t allocated_current;
+	/*! Total number of allocations */
+	size_t allocations_total;
+	/*! Total number of allocated bytes */
+	size_t allocated_total;
+};
@@ -18,9 +18,15 @@
 #include <test/test.h>
 
 #include <memory/memory.h>
+#include <memory/rpmalloc.h>
 
 #include <stdio.h>
 
+#if FOUNDATION_PLATFORM_POSIX
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 static application_t
 test_alloc_application(void) {
 	application_t app;
@@ -509,12 +515,1266 @@ DECLARE_TEST(alloc, threadspam) {
 	return 0;
 }
 
+static void*
+contextallocator_thread(void* argp) {
+	allocator_thread_arg_t arg = *(allocator_thread_arg_t*)argp;
+	memory_system_t memsys = arg.memory_system;
+	unsigned int iloop = 0;
+	unsigned int ipass = 0;
+	unsigned int cursize;
+
+	memsys.thread_initialize();
+
+	for (iloop = 0; iloop < arg.loops; ++iloop) {
+		for (ipass = 0; ipass < arg.passes; ++ipass) {
+			hash_t context = (hash_t)((iloop + ipass) % 13) * 0x9E3779B97F4A7C15ULL;
+			cursize = arg.datasize[(iloop + ipass) % arg.num_datasize] + (iloop % 1024);
+
+			void* addr = memsys.allocate(context, cursize, (ipass % 3) ? 0 : 64, MEMORY_ZERO_INITIALIZED);
+			EXPECT_NE(addr, 0);
+			EXPECT_EQ(((const char*)addr)[cursize - 1], 0);
+			memset(addr, (int)(ipass & 0xFF), cursize);
+
+			arg.pointers[iloop * arg.passes + ipass] = addr;
+		}
+	}
+
+	memsys.thread_finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, context) {
+	thread_t thread[2];
+	allocator_thread_arg_t thread_arg;
+	unsigned int ithread;
+
+	memory_system_t memsys = memory_system_context_heaps();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	thread_arg.memory_system = memsys;
+	thread_arg.loops = 50;
+	thread_arg.passes = 1024;
+	thread_arg.pointers =
+	    memory_allocate(HASH_TEST, sizeof(void*) * thread_arg.loops * thread_arg.passes, 0, MEMORY_PERSISTENT);
+	thread_arg.datasize[0] = 19;
+	thread_arg.datasize[1] = 249;
+	thread_arg.datasize[2] = 797;
+	thread_arg.datasize[3] = 3;
+	thread_arg.datasize[4] = 79;
+	thread_arg.datasize[5] = 34;
+	thread_arg.datasize[6] = 389;
+	thread_arg.num_datasize = 7;
+
+	// Second thread adopts the context heaps orphaned by the first thread
+	for (ithread = 0; ithread < 2; ++ithread) {
+		thread_initialize(&thread[ithread], contextallocator_thread, &thread_arg, STRING_CONST("contextallocator"),
+		                  THREAD_PRIORITY_NORMAL, 0);
+		thread_start(&thread[ithread]);
+
+		test_wait_for_threads_startup(&thread[ithread], 1);
+		test_wait_for_threads_finish(&thread[ithread], 1);
+
+		EXPECT_EQ(thread_join(&thread[ithread]), 0);
+		thread_finalize(&thread[ithread]);
+
+		// Off-thread deallocation
+		for (size_t iptr = 0; iptr < thread_arg.loops * thread_arg.passes; ++iptr)
+			memsys.deallocate(thread_arg.pointers[iptr]);
+	}
+
+	memory_deallocate(thread_arg.pointers);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, zero_realloc) {
+	// Small, medium, large and huge sizes, each one growing the block past the previous size class
+	size_t size[5] = {16, 2000, 100000, 1024 * 1024, 16 * 1024 * 1024};
+	void* dirty[5];
+	unsigned int isize;
+	size_t ibyte;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	// Leave dirty blocks of each size in the heap so the grown block reuses memory which is not zero
+	for (isize = 0; isize < 5; ++isize) {
+		dirty[isize] = memsys.allocate(HASH_TEST, size[isize], 0, MEMORY_PERSISTENT);
+		EXPECT_NE(dirty[isize], 0);
+		memset(dirty[isize], 0xFF, size[isize]);
+	}
+	for (isize = 0; isize < 5; ++isize)
+		memsys.deallocate(dirty[isize]);
+
+	size_t old_size = 8;
+	void* block = memsys.allocate(HASH_TEST, old_size, 0, MEMORY_PERSISTENT);
+	EXPECT_NE(block, 0);
+	memset(block, 0xFF, old_size);
+	for (isize = 0; isize < 5; ++isize) {
+		block = memsys.reallocate(block, size[isize], 0, old_size, MEMORY_PERSISTENT | MEMORY_ZERO_INITIALIZED);
+		EXPECT_NE(block, 0);
+		for (ibyte = 0; ibyte < old_size; ++ibyte) {
+			if (((const unsigned char*)block)[ibyte] != 0xFF)
+				break;
+		}
+		EXPECT_EQ(ibyte, old_size);
+		for (; ibyte < size[isize]; ++ibyte) {
+			if (((const unsigned char*)block)[ibyte])
+				break;
+		}
+		EXPECT_EQ(ibyte, size[isize]);
+		memset(block, 0xFF, size[isize]);
+		old_size = size[isize];
+	}
+	memsys.deallocate(block);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, context_statistics) {
+	void* addr[1024];
+	memory_context_statistics_t statistics[8];
+	size_t count, istat;
+	unsigned int ipass;
+
+	memory_system_t memsys = memory_system_context_heaps();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	for (ipass = 0; ipass < 1024; ++ipass)
+		addr[ipass] = memsys.allocate(HASH_TEST + (ipass % 2), 100 + ipass, 0, MEMORY_PERSISTENT);
+
+	count = memory_context_statistics(statistics, 8);
+#if BUILD_ENABLE_MEMORY_CONTEXT_STATISTICS
+	EXPECT_EQ(count, 3);
+	for (istat = 0; istat < count; ++istat) {
+		if (statistics[istat].context) {
+			EXPECT_EQ(statistics[istat].allocations_current, 512);
+			EXPECT_EQ(statistics[istat].allocations_total, 512);
+			EXPECT_GE(statistics[istat].allocated_current, 512 * 100);
+		} else {
+			EXPECT_EQ(statistics[istat].allocations_current, 0);
+		}
+	}
+#endif
+
+	for (ipass = 0; ipass < 1024; ++ipass)
+		memsys.deallocate(addr[ipass]);
+
+	count = memory_context_statistics(statistics, 8);
+	for (istat = 0; istat < count; ++istat) {
+		EXPECT_EQ(statistics[istat].allocations_current, 0);
+		EXPECT_EQ(statistics[istat].allocated_current, 0);
+	}
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, profiled) {
+	void* addr[1024];
+	unsigned int ipass;
+
+	memory_system_t memsys = memory_system_profiled();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	for (ipass = 0; ipass < 1024; ++ipass) {
+		addr[ipass] = memsys.allocate(HASH_TEST, 16 << (ipass % 12), 0, MEMORY_PERSISTENT);
+		EXPECT_NE(addr[ipass], 0);
+	}
+	for (ipass = 0; ipass < 1024; ipass += 2) {
+		addr[ipass] = memsys.reallocate(addr[ipass], 1000, 0, 16 << (ipass % 12), MEMORY_PERSISTENT);
+		EXPECT_NE(addr[ipass], 0);
+	}
+	for (ipass = 0; ipass < 1024; ++ipass)
+		memsys.deallocate(addr[ipass]);
+
+	memory_profile_dump();
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+static int owns_static_data;
+
+DECLARE_TEST(alloc, owns) {
+	size_t size[4] = {16, 20000, 1024 * 1024, 16 * 1024 * 1024};
+	void* addr[4];
+	unsigned int iblock;
+	int stack_data = 0;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	// Small, medium, large and huge blocks are owned, including pointers into the block
+	for (iblock = 0; iblock < 4; ++iblock) {
+		addr[iblock] = memsys.allocate(HASH_TEST, size[iblock], 0, MEMORY_PERSISTENT);
+		EXPECT_NE(addr[iblock], 0);
+		EXPECT_NE(rpmalloc_owns(addr[iblock]), 0);
+		EXPECT_NE(rpmalloc_owns(pointer_offset(addr[iblock], size[iblock] - 1)), 0);
+	}
+
+	// Memory from other sources is not owned
+	EXPECT_EQ(rpmalloc_owns(0), 0);
+	EXPECT_EQ(rpmalloc_owns(&stack_data), 0);
+	EXPECT_EQ(rpmalloc_owns(&owns_static_data), 0);
+
+	// Unmapped huge blocks are no longer owned
+	memsys.deallocate(addr[3]);
+	EXPECT_EQ(rpmalloc_owns(addr[3]), 0);
+	for (iblock = 0; iblock < 3; ++iblock)
+		memsys.deallocate(addr[iblock]);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, statistics_buffer) {
+	char truncated[16];
+	char* buffer;
+	size_t length;
+	size_t capacity;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	void* addr = memsys.allocate(HASH_TEST, 100, 0, MEMORY_PERSISTENT);
+	EXPECT_NE(addr, 0);
+
+	// Null buffer returns the length of the complete output
+	length = rpmalloc_dump_statistics_buffer(0, 0, RPMALLOC_STATISTICS_JSON);
+	EXPECT_GT(length, 0);
+	capacity = rpmalloc_dump_statistics_buffer(0, 0, RPMALLOC_STATISTICS_KEYVALUE);
+	EXPECT_GT(capacity, length);
+
+	// Margin for the counters changing by the buffer allocation itself
+	capacity += 4096;
+	buffer = memsys.allocate(HASH_TEST, capacity, 0, MEMORY_PERSISTENT);
+	length = rpmalloc_dump_statistics_buffer(buffer, capacity, RPMALLOC_STATISTICS_JSON);
+	EXPECT_LT(length, capacity);
+	EXPECT_EQ(strlen(buffer), length);
+	EXPECT_EQ(buffer[0], '{');
+	EXPECT_EQ(buffer[length - 1], '}');
+	EXPECT_NE(strstr(buffer, "\"heaps\":{"), 0);
+	EXPECT_NE(strstr(buffer, "\"size_classes\":{"), 0);
+	EXPECT_NE(strstr(buffer, "\"global\":{\"heaps\":"), 0);
+
+	length = rpmalloc_dump_statistics_buffer(buffer, capacity, RPMALLOC_STATISTICS_KEYVALUE);
+	EXPECT_LT(length, capacity);
+	EXPECT_EQ(strlen(buffer), length);
+	EXPECT_NE(strstr(buffer, "global.heaps="), 0);
+	EXPECT_NE(strstr(buffer, "global.mapped="), 0);
+
+	// Truncated output is null terminated and still returns the complete length
+	memset(truncated, 0xFF, sizeof(truncated));
+	length = rpmalloc_dump_statistics_buffer(truncated, sizeof(truncated), RPMALLOC_STATISTICS_JSON);
+	EXPECT_GE(length, sizeof(truncated));
+	EXPECT_EQ(strlen(truncated), sizeof(truncated) - 1);
+	EXPECT_EQ(truncated[0], '{');
+
+	memsys.deallocate(buffer);
+	memsys.deallocate(addr);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, lifetime) {
+	void* addr[1024];
+	char buffer[8192];
+	const char* total;
+	const char* next;
+	size_t length;
+	unsigned int iloop;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	if (rpmalloc_sampling_start(1024) != 0) {
+		// Without sampling the dump is an empty object
+		length = rpmalloc_lifetime_dump(buffer, sizeof(buffer), RPMALLOC_STATISTICS_JSON);
+		EXPECT_EQ(length, 2);
+		EXPECT_EQ(strcmp(buffer, "{}"), 0);
+		memsys.thread_finalize();
+		memsys.finalize();
+		return 0;
+	}
+
+	// Sample a mean of one in sixteen blocks and record lifetimes when freed
+	for (iloop = 0; iloop < 1024; ++iloop)
+		addr[iloop] = memsys.allocate(HASH_TEST, 64, 0, MEMORY_PERSISTENT);
+	for (iloop = 0; iloop < 1024; ++iloop)
+		memsys.deallocate(addr[iloop]);
+	rpmalloc_sampling_stop();
+
+	length = rpmalloc_lifetime_dump(buffer, sizeof(buffer), RPMALLOC_STATISTICS_JSON);
+	EXPECT_LT(length, sizeof(buffer));
+	EXPECT_EQ(buffer[0], '{');
+	EXPECT_EQ(buffer[length - 1], '}');
+	EXPECT_NE(strstr(buffer, "\"ticks_per_second\":"), 0);
+	EXPECT_NE(strstr(buffer, "\"size_classes\":{"), 0);
+	EXPECT_NE(strstr(buffer, "\"heaps\":{"), 0);
+
+	// Total number of sampled lifetimes is the last value
+	total = strstr(buffer, "\"samples\":");
+	EXPECT_NE(total, 0);
+	while ((next = strstr(total + 1, "\"samples\":")) != 0)
+		total = next;
+	EXPECT_NE(total[10], '0');
+
+	length = rpmalloc_lifetime_dump(buffer, sizeof(buffer), RPMALLOC_STATISTICS_KEYVALUE);
+	EXPECT_LT(length, sizeof(buffer));
+	EXPECT_NE(strstr(buffer, "size_classes."), 0);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+typedef struct sampling_hook_state_t {
+	memory_system_t* memsys;
+	size_t alloc_count;
+	size_t free_count;
+	unsigned int depth;
+	unsigned int depth_max;
+	void* hook_block[64];
+	size_t hook_block_count;
+	int reported_hook_block;
+} sampling_hook_state_t;
+
+static void
+sampling_hook_alloc(void* context, void* block, size_t size, unsigned int size_class, unsigned int heap_id) {
+	sampling_hook_state_t* state = context;
+	FOUNDATION_UNUSED(block);
+	FOUNDATION_UNUSED(size);
+	FOUNDATION_UNUSED(size_class);
+	FOUNDATION_UNUSED(heap_id);
+	if (++state->depth > state->depth_max)
+		state->depth_max = state->depth;
+	++state->alloc_count;
+	// Allocations from inside a hook must not be reported to the hooks
+	void* hook_block = state->memsys->allocate(HASH_TEST, 64, 0, MEMORY_PERSISTENT);
+	if (state->hook_block_count < 64)
+		state->hook_block[state->hook_block_count++] = hook_block;
+	else
+		state->memsys->deallocate(hook_block);
+	--state->depth;
+}
+
+static void
+sampling_hook_free(void* context, void* block, size_t size, unsigned int size_class, unsigned int heap_id) {
+	sampling_hook_state_t* state = context;
+	size_t iblock;
+	FOUNDATION_UNUSED(size);
+	FOUNDATION_UNUSED(size_class);
+	FOUNDATION_UNUSED(heap_id);
+	++state->free_count;
+	for (iblock = 0; iblock < state->hook_block_count; ++iblock) {
+		if (state->hook_block[iblock] == block)
+			state->reported_hook_block = 1;
+	}
+}
+
+DECLARE_TEST(alloc, sampling_hooks) {
+	void* addr[1024];
+	sampling_hook_state_t state;
+	rpmalloc_sampling_hooks_t hooks;
+	size_t iblock;
+	unsigned int iloop;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	memset(&state, 0, sizeof(state));
+	state.memsys = &memsys;
+	hooks.alloc = sampling_hook_alloc;
+	hooks.free = sampling_hook_free;
+	hooks.context = &state;
+	if (rpmalloc_sampling_hooks(&hooks, 1024) != 0) {
+		memsys.thread_finalize();
+		memsys.finalize();
+		return 0;
+	}
+
+	for (iloop = 0; iloop < 1024; ++iloop)
+		addr[iloop] = memsys.allocate(HASH_TEST, 64, 0, MEMORY_PERSISTENT);
+	for (iloop = 0; iloop < 1024; ++iloop)
+		memsys.deallocate(addr[iloop]);
+	for (iblock = 0; iblock < state.hook_block_count; ++iblock)
+		memsys.deallocate(state.hook_block[iblock]);
+
+	// Hooks allocating memory do not recurse, and every reported block is reported freed
+	EXPECT_GT(state.alloc_count, 0);
+	EXPECT_EQ(state.depth_max, 1);
+	EXPECT_EQ(state.free_count, state.alloc_count);
+	EXPECT_EQ(state.reported_hook_block, 0);
+
+	// Removed hooks are never called again
+	EXPECT_EQ(rpmalloc_sampling_hooks(0, 0), 0);
+	state.alloc_count = 0;
+	state.free_count = 0;
+	for (iloop = 0; iloop < 1024; ++iloop)
+		addr[iloop] = memsys.allocate(HASH_TEST, 64, 0, MEMORY_PERSISTENT);
+	for (iloop = 0; iloop < 1024; ++iloop)
+		memsys.deallocate(addr[iloop]);
+	rpmalloc_sampling_stop();
+	EXPECT_EQ(state.alloc_count, 0);
+	EXPECT_EQ(state.free_count, 0);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+static void
+rounding_totals(size_t* alloc_total, size_t* requested_total) {
+	static rpmalloc_fragmentation_t report;
+	unsigned int iclass;
+	rpmalloc_fragmentation(&report);
+	*alloc_total = report.huge_alloc_total;
+	*requested_total = report.huge_requested_total;
+	for (iclass = 0; iclass < RPMALLOC_SIZE_CLASS_COUNT; ++iclass) {
+		*alloc_total += report.size_class[iclass].alloc_total;
+		*requested_total += report.size_class[iclass].requested_total;
+	}
+}
+
+DECLARE_TEST(alloc, rounding) {
+	void* addr[64];
+	size_t alloc_before, requested_before;
+	size_t alloc_after, requested_after;
+	unsigned int iloop;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	rounding_totals(&alloc_before, &requested_before);
+	// Requested sizes are accounted, not the block size of the size class or the alignment padding
+	for (iloop = 0; iloop < 32; ++iloop)
+		addr[iloop] = memsys.allocate(HASH_TEST, 100, 0, MEMORY_PERSISTENT);
+	for (; iloop < 64; ++iloop) {
+		addr[iloop] = memsys.allocate(HASH_TEST, 100, 256, MEMORY_PERSISTENT);
+		EXPECT_EQ((uintptr_t)addr[iloop] & 255, 0);
+	}
+	rounding_totals(&alloc_after, &requested_after);
+	for (iloop = 0; iloop < 64; ++iloop)
+		memsys.deallocate(addr[iloop]);
+
+	// Counters are only maintained if built with statistics
+	if (alloc_after != alloc_before) {
+		EXPECT_EQ(alloc_after - alloc_before, 64);
+		EXPECT_EQ(requested_after - requested_before, 64 * 100);
+	} else {
+		EXPECT_EQ(requested_after, requested_before);
+	}
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+#if RPMALLOC_FIRST_CLASS_HEAPS
+
+DECLARE_TEST(alloc, heap_mark) {
+	void* addr[256];
+	void* marked[256];
+	unsigned int ipass;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	EXPECT_NE(heap, 0);
+	for (ipass = 0; ipass < 256; ++ipass) {
+		addr[ipass] = rpmalloc_heap_alloc(heap, 16 + ipass);
+		EXPECT_NE(addr[ipass], 0);
+		memset(addr[ipass], (int)ipass, 16 + ipass);
+	}
+
+	// Blocks allocated after the mark are released by the rewind and handed out again in the same order
+	rpmalloc_heap_mark_t* mark = rpmalloc_heap_mark(heap);
+	EXPECT_NE(mark, 0);
+	for (ipass = 0; ipass < 256; ++ipass) {
+		marked[ipass] = rpmalloc_heap_alloc(heap, 100 + ipass * 16);
+		EXPECT_NE(marked[ipass], 0);
+		memset(marked[ipass], 0xFF, 100 + ipass * 16);
+	}
+	rpmalloc_heap_rewind(heap, mark);
+
+	mark = rpmalloc_heap_mark(heap);
+	EXPECT_NE(mark, 0);
+	for (ipass = 0; ipass < 256; ++ipass)
+		EXPECT_EQ(rpmalloc_heap_alloc(heap, 100 + ipass * 16), marked[ipass]);
+	rpmalloc_heap_rewind(heap, mark);
+
+	// Blocks allocated before the mark are untouched
+	for (ipass = 0; ipass < 256; ++ipass) {
+		EXPECT_EQ(((const unsigned char*)addr[ipass])[0], ipass);
+		EXPECT_EQ(((const unsigned char*)addr[ipass])[15 + ipass], ipass);
+	}
+
+	// Reset keeps the spans mapped up to the retained size
+	size_t usage = rpmalloc_heap_usage(heap);
+	EXPECT_NE(usage, 0);
+	rpmalloc_heap_reset(heap, usage);
+	EXPECT_EQ(rpmalloc_heap_usage(heap), usage);
+	EXPECT_EQ(rpmalloc_heap_alloc(heap, 16), addr[0]);
+	rpmalloc_heap_reset(heap, 0);
+	EXPECT_EQ(rpmalloc_heap_usage(heap), 0);
+
+	rpmalloc_heap_release(heap);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+static rpmalloc_interface_t heap_interface_default;
+static size_t heap_interface_calls[4];
+
+static void*
+heap_interface_map(size_t size, size_t alignment, size_t* offset, size_t* mapped_size) {
+	++heap_interface_calls[0];
+	return heap_interface_default.memory_map(size, alignment, offset, mapped_size);
+}
+
+static void
+heap_interface_commit(void* address, size_t size) {
+	++heap_interface_calls[1];
+	heap_interface_default.memory_commit(address, size);
+}
+
+static void
+heap_interface_decommit(void* address, size_t size) {
+	++heap_interface_calls[2];
+	heap_interface_default.memory_decommit(address, size);
+}
+
+static void
+heap_interface_unmap(void* address, size_t offset, size_t mapped_size) {
+	++heap_interface_calls[3];
+	heap_interface_default.memory_unmap(address, offset, mapped_size);
+}
+
+DECLARE_TEST(alloc, heap_interface) {
+	void* addr[1024];
+	unsigned int ipass;
+	rpmalloc_interface_t counting_interface;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	EXPECT_NE(heap, 0);
+
+	// Setting an interface without map and unmap functions fills in the default implementation to forward to
+	memset(&heap_interface_default, 0, sizeof(heap_interface_default));
+	EXPECT_EQ(rpmalloc_heap_set_memory_interface(heap, &heap_interface_default), 0);
+	EXPECT_NE(heap_interface_default.memory_map, 0);
+
+	memset(&counting_interface, 0, sizeof(counting_interface));
+	memset(heap_interface_calls, 0, sizeof(heap_interface_calls));
+	counting_interface.memory_map = heap_interface_map;
+	counting_interface.memory_commit = heap_interface_commit;
+	counting_interface.memory_decommit = heap_interface_decommit;
+	counting_interface.memory_unmap = heap_interface_unmap;
+	EXPECT_EQ(rpmalloc_heap_set_memory_interface(heap, &counting_interface), 0);
+
+	// Spans are mapped through the heap interface, and enough free pages are decommitted and recommitted
+	for (ipass = 0; ipass < 1024; ++ipass) {
+		addr[ipass] = rpmalloc_heap_alloc(heap, 4000);
+		EXPECT_NE(addr[ipass], 0);
+	}
+	EXPECT_EQ(heap_interface_calls[0], 1);
+	for (ipass = 0; ipass < 1024; ++ipass)
+		rpmalloc_heap_free(heap, addr[ipass]);
+	EXPECT_GT(heap_interface_calls[2], 0);
+	for (ipass = 0; ipass < 1024; ++ipass) {
+		addr[ipass] = rpmalloc_heap_alloc(heap, 4000);
+		EXPECT_NE(addr[ipass], 0);
+	}
+	EXPECT_GT(heap_interface_calls[1], 0);
+	EXPECT_EQ(heap_interface_calls[0], 1);
+
+	// Huge blocks are mapped and unmapped through the heap interface
+	void* block = rpmalloc_heap_alloc(heap, 16 * 1024 * 1024);
+	EXPECT_NE(block, 0);
+	EXPECT_EQ(heap_interface_calls[0], 2);
+	rpmalloc_heap_free(heap, block);
+	EXPECT_EQ(heap_interface_calls[3], 1);
+
+	// Null restores the default interface, spans mapped earlier are still unmapped through the heap interface
+	EXPECT_EQ(rpmalloc_heap_set_memory_interface(heap, 0), 0);
+	block = rpmalloc_heap_alloc(heap, 16 * 1024 * 1024);
+	EXPECT_NE(block, 0);
+	rpmalloc_heap_free(heap, block);
+	EXPECT_EQ(heap_interface_calls[0], 2);
+	EXPECT_EQ(heap_interface_calls[3], 1);
+	rpmalloc_heap_free_all(heap);
+	EXPECT_EQ(heap_interface_calls[3], 2);
+	rpmalloc_heap_release(heap);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, heap_pinned) {
+	// A small page of 64KiB holds 63 blocks of 1KiB after the page header
+	const unsigned int page_blocks = 63;
+	void* block;
+	unsigned int count, ipass;
+	void* pinned_block = 0;
+	rpmalloc_heap_statistics_t stats;
+	rpmalloc_heap_pin_config_t config;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	// The reserve is rounded up to whole pages, the span mapped for it is capped to the reserved page count
+	memset(&config, 0, sizeof(config));
+	config.small_size = 3 * 64 * 1024 + 1;
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire_pinned(&config);
+	EXPECT_NE(heap, 0);
+	rpmalloc_heap_statistics(heap, &stats);
+	EXPECT_EQ(stats.pinned, 4 * 64 * 1024);
+	EXPECT_EQ(stats.map_calls, 1);
+
+	for (ipass = 0; ipass < 2; ++ipass) {
+		for (count = 0; count < 8 * page_blocks; ++count) {
+			block = rpmalloc_heap_alloc(heap, 1024);
+			if (!block)
+				break;
+			memset(block, 0xFF, 1024);
+		}
+		EXPECT_EQ(count, 4 * page_blocks);
+		rpmalloc_heap_statistics(heap, &stats);
+		EXPECT_EQ(stats.pin_failed, ipass + 1);
+		EXPECT_EQ(stats.pin_diverted, 0);
+
+		// Reset keeps the full reserve for reuse without mapping memory
+		rpmalloc_heap_reset(heap, 0);
+		rpmalloc_heap_statistics(heap, &stats);
+		EXPECT_EQ(stats.pinned, 4 * 64 * 1024);
+		EXPECT_EQ(stats.map_calls, 1);
+		EXPECT_EQ(stats.unmap_calls, 0);
+	}
+
+	// Page types without a reserve and huge blocks fail
+	EXPECT_EQ(rpmalloc_heap_alloc(heap, 100 * 1024), 0);
+	EXPECT_EQ(rpmalloc_heap_alloc(heap, 16 * 1024 * 1024), 0);
+	rpmalloc_heap_statistics(heap, &stats);
+	EXPECT_EQ(stats.pin_failed, 4);
+	EXPECT_EQ(stats.map_calls, 1);
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+
+	// Allocations exceeding the reserve are diverted to the thread heap
+	config.small_size = 64 * 1024;
+	config.flags = RPMALLOC_HEAP_PIN_DIVERT;
+	heap = rpmalloc_heap_acquire_pinned(&config);
+	EXPECT_NE(heap, 0);
+	for (count = 0; count < page_blocks; ++count) {
+		block = rpmalloc_heap_alloc(heap, 1024);
+		EXPECT_NE(block, 0);
+		EXPECT_EQ(rpmalloc_get_heap_for_ptr(block), heap);
+		memset(block, 0xFF, 1024);
+		pinned_block = block;
+	}
+	block = rpmalloc_heap_alloc(heap, 1024);
+	EXPECT_NE(block, 0);
+	EXPECT_NE(rpmalloc_get_heap_for_ptr(block), heap);
+	rpfree(block);
+	block = rpmalloc_heap_alloc(heap, 16 * 1024 * 1024);
+	EXPECT_NE(block, 0);
+	rpfree(block);
+
+	// Zero initializing reallocation only clears the grown range of the diverted block
+	block = rpmalloc_heap_realloc(heap, pinned_block, 2048, RPMALLOC_ZERO_INIT);
+	EXPECT_NE(block, 0);
+	EXPECT_NE(rpmalloc_get_heap_for_ptr(block), heap);
+	EXPECT_EQ(((const unsigned char*)block)[1023], 0xFF);
+	EXPECT_EQ(((const unsigned char*)block)[1024], 0);
+	EXPECT_EQ(((const unsigned char*)block)[2047], 0);
+	rpfree(block);
+	rpmalloc_heap_statistics(heap, &stats);
+	EXPECT_EQ(stats.pin_diverted, 3);
+	EXPECT_EQ(stats.pin_failed, 0);
+	EXPECT_EQ(stats.map_calls, 1);
+	rpmalloc_heap_free_all(heap);
+	rpmalloc_heap_release(heap);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, heap_warmup) {
+	// Sizes above the large block limit are ignored by the warm-up
+	size_t sizes[5] = {16, 1024, 100 * 1024, 1024 * 1024, 32 * 1024 * 1024};
+	size_t counts[5] = {1000, 200, 20, 4, 1};
+	unsigned int isize, iflags;
+	size_t iblock;
+	rpmalloc_heap_statistics_t stats;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	for (iflags = 0; iflags < 2; ++iflags) {
+		rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+		EXPECT_NE(heap, 0);
+		EXPECT_EQ(rpmalloc_heap_warmup(heap, sizes, counts, 5, iflags ? RPMALLOC_WARMUP_PREFAULT : 0), 0);
+		rpmalloc_heap_statistics(heap, &stats);
+		size_t map_calls = stats.map_calls;
+		size_t commit_calls = stats.commit_calls;
+		EXPECT_EQ(map_calls, 3);
+
+		// Warmed up size classes are served without mapping or committing memory
+		for (isize = 0; isize < 4; ++isize) {
+			for (iblock = 0; iblock < counts[isize]; ++iblock)
+				EXPECT_NE(rpmalloc_heap_alloc(heap, sizes[isize]), 0);
+		}
+		rpmalloc_heap_statistics(heap, &stats);
+		EXPECT_EQ(stats.map_calls, map_calls);
+		EXPECT_EQ(stats.commit_calls, commit_calls);
+
+		rpmalloc_heap_free_all(heap);
+		rpmalloc_heap_release(heap);
+	}
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, instance) {
+	void* addr[256];
+	unsigned int ipass;
+	rpmalloc_interface_t counting_interface;
+	rpmalloc_config_t config;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	// Setting an interface without map and unmap functions fills in the default implementation to forward to
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	EXPECT_NE(heap, 0);
+	memset(&heap_interface_default, 0, sizeof(heap_interface_default));
+	EXPECT_EQ(rpmalloc_heap_set_memory_interface(heap, &heap_interface_default), 0);
+	rpmalloc_heap_release(heap);
+
+	memset(&counting_interface, 0, sizeof(counting_interface));
+	memset(heap_interface_calls, 0, sizeof(heap_interface_calls));
+	counting_interface.memory_map = heap_interface_map;
+	counting_interface.memory_commit = heap_interface_commit;
+	counting_interface.memory_decommit = heap_interface_decommit;
+	counting_interface.memory_unmap = heap_interface_unmap;
+	memset(&config, 0, sizeof(config));
+	config.disable_decommit = 1;
+	rpmalloc_instance_t* instance = rpmalloc_instance_create(&counting_interface, &config);
+	EXPECT_NE(instance, 0);
+	EXPECT_NE(instance, rpmalloc_instance_default());
+	EXPECT_EQ(rpmalloc_instance_config(instance)->disable_decommit, 1);
+	EXPECT_EQ(rpmalloc_instance_config(rpmalloc_instance_default())->disable_decommit, 0);
+
+	// Heap control structures, spans and huge blocks are mapped through the instance interface
+	heap = rpmalloc_instance_heap_acquire(instance);
+	EXPECT_NE(heap, 0);
+	EXPECT_EQ(rpmalloc_heap_instance(heap), instance);
+	for (ipass = 0; ipass < 256; ++ipass) {
+		addr[ipass] = rpmalloc_heap_alloc(heap, 16 << (ipass % 12));
+		EXPECT_NE(addr[ipass], 0);
+	}
+	EXPECT_NE(rpmalloc_heap_alloc(heap, 16 * 1024 * 1024), 0);
+	EXPECT_GE(heap_interface_calls[0], 3);
+	EXPECT_EQ(heap_interface_calls[3], 0);
+
+	// Released heaps keep their memory until the instance is destroyed, which unmaps all of it
+	rpmalloc_heap_release(heap);
+	EXPECT_EQ(heap_interface_calls[3], 0);
+	rpmalloc_instance_destroy(instance);
+	EXPECT_EQ(heap_interface_calls[3], heap_interface_calls[0]);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+//! Get the number of live sampled blocks from the heap profile header
+static size_t
+heap_sampled_live_count(void) {
+	char buffer[256];
+	rpmalloc_sampling_dump(buffer, sizeof(buffer));
+	const char* prefix = "heap profile: ";
+	if (strncmp(buffer, prefix, strlen(prefix)))
+		return 0;
+	return (size_t)strtoull(buffer + strlen(prefix), 0, 10);
+}
+
+DECLARE_TEST(alloc, heap_sampled) {
+	void* addr[64];
+	unsigned int ipass;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	// Sampling is only available if built with ENABLE_SAMPLING
+	if (rpmalloc_sampling_start(64) < 0)
+		return 0;
+
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	EXPECT_NE(heap, 0);
+	size_t live_acquire = heap_sampled_live_count();
+	for (ipass = 0; ipass < 64; ++ipass)
+		EXPECT_NE(rpmalloc_heap_alloc(heap, 1000), 0);
+
+	// Blocks sampled after the mark are dropped from the profile by the rewind, blocks before are kept
+	size_t live_mark = heap_sampled_live_count();
+	EXPECT_GT(live_mark, live_acquire);
+	rpmalloc_heap_mark_t* mark = rpmalloc_heap_mark(heap);
+	EXPECT_NE(mark, 0);
+	for (ipass = 0; ipass < 64; ++ipass) {
+		addr[ipass] = rpmalloc_heap_alloc(heap, 1000);
+		EXPECT_NE(addr[ipass], 0);
+	}
+	EXPECT_GT(heap_sampled_live_count(), live_mark);
+	rpmalloc_heap_rewind(heap, mark);
+	EXPECT_EQ(heap_sampled_live_count(), live_mark);
+
+	// Blocks handed out again after the rewind are sampled and freed as new blocks
+	for (ipass = 0; ipass < 64; ++ipass)
+		addr[ipass] = rpmalloc_heap_alloc(heap, 1000);
+	for (ipass = 0; ipass < 64; ++ipass)
+		rpmalloc_heap_free(heap, addr[ipass]);
+	EXPECT_EQ(heap_sampled_live_count(), live_mark);
+
+	// Reset drops all blocks sampled from the heap
+	rpmalloc_heap_reset(heap, 0);
+	EXPECT_EQ(heap_sampled_live_count(), live_acquire);
+
+	rpmalloc_sampling_stop();
+	rpmalloc_heap_release(heap);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, heap_sampling_hooks) {
+	sampling_hook_state_t state;
+	rpmalloc_sampling_hooks_t hooks;
+	size_t iblock;
+	unsigned int ipass;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	memset(&state, 0, sizeof(state));
+	state.memsys = &memsys;
+	hooks.alloc = sampling_hook_alloc;
+	hooks.free = sampling_hook_free;
+	hooks.context = &state;
+	if (rpmalloc_sampling_hooks(&hooks, 64) != 0) {
+		memsys.thread_finalize();
+		memsys.finalize();
+		return 0;
+	}
+
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	EXPECT_NE(heap, 0);
+	for (ipass = 0; ipass < 64; ++ipass)
+		EXPECT_NE(rpmalloc_heap_alloc(heap, 1000), 0);
+	EXPECT_GT(state.alloc_count, 0);
+	EXPECT_EQ(state.free_count, 0);
+
+	// Rewind reports the blocks sampled after the mark as freed
+	size_t alloc_mark = state.alloc_count;
+	rpmalloc_heap_mark_t* mark = rpmalloc_heap_mark(heap);
+	EXPECT_NE(mark, 0);
+	for (ipass = 0; ipass < 64; ++ipass)
+		EXPECT_NE(rpmalloc_heap_alloc(heap, 1000), 0);
+	EXPECT_GT(state.alloc_count, alloc_mark);
+	rpmalloc_heap_rewind(heap, mark);
+	EXPECT_EQ(state.free_count, state.alloc_count - alloc_mark);
+
+	// Reset reports all remaining blocks sampled from the heap as freed
+	rpmalloc_heap_reset(heap, 0);
+	EXPECT_EQ(state.free_count, state.alloc_count);
+	EXPECT_EQ(state.reported_hook_block, 0);
+
+	EXPECT_EQ(rpmalloc_sampling_hooks(0, 0), 0);
+	rpmalloc_sampling_stop();
+	rpmalloc_heap_release(heap);
+	for (iblock = 0; iblock < state.hook_block_count; ++iblock)
+		memsys.deallocate(state.hook_block[iblock]);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+static size_t heap_limit_callback_size;
+
+static int
+heap_limit_callback(rpmalloc_heap_t* heap, size_t size) {
+	// Raise the limit once to fit the requested commit
+	if (heap_limit_callback_size)
+		return 0;
+	heap_limit_callback_size = size;
+	rpmalloc_heap_set_limit(heap, rpmalloc_heap_usage(heap) + size, RPMALLOC_HEAP_LIMIT_CALLBACK);
+	return 1;
+}
+
+DECLARE_TEST(alloc, heap_limit) {
+	void* addr[2048];
+	size_t limit = 1024 * 1024;
+	unsigned int ipass, count;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	// The limit applies to committed pages, a limit well below the span size still allows allocations
+	rpmalloc_heap_t* heap = rpmalloc_heap_acquire();
+	EXPECT_NE(heap, 0);
+	rpmalloc_heap_set_limit(heap, limit, RPMALLOC_HEAP_LIMIT_FAIL);
+	for (count = 0; count < 2048; ++count) {
+		addr[count] = rpmalloc_heap_alloc(heap, 1000);
+		if (!addr[count])
+			break;
+		EXPECT_LE(rpmalloc_heap_usage(heap), limit);
+	}
+	EXPECT_LT(count, 2048);
+	EXPECT_GE(count * 1000, limit / 2);
+	EXPECT_LE(rpmalloc_heap_usage(heap), limit);
+
+	// Huge blocks are checked against the same limit
+	EXPECT_EQ(rpmalloc_heap_alloc(heap, 16 * limit), 0);
+
+	// Freed blocks are reused without exceeding the limit
+	for (ipass = 0; ipass < count; ++ipass)
+		rpmalloc_heap_free(heap, addr[ipass]);
+	for (ipass = 0; ipass < count; ++ipass) {
+		addr[ipass] = rpmalloc_heap_alloc(heap, 1000);
+		EXPECT_NE(addr[ipass], 0);
+	}
+	EXPECT_LE(rpmalloc_heap_usage(heap), limit);
+
+	// Callback is called with the number of bytes to commit and can raise the limit
+	heap_limit_callback_size = 0;
+	rpmalloc_heap_set_limit_callback(heap, heap_limit_callback);
+	rpmalloc_heap_set_limit(heap, rpmalloc_heap_usage(heap), RPMALLOC_HEAP_LIMIT_CALLBACK);
+	void* block = rpmalloc_heap_alloc(heap, 16 * limit);
+	EXPECT_NE(block, 0);
+	EXPECT_GE(heap_limit_callback_size, 16 * limit);
+	EXPECT_EQ(rpmalloc_heap_alloc(heap, 16 * limit), 0);
+
+	rpmalloc_heap_free_all(heap);
+	EXPECT_EQ(rpmalloc_heap_usage(heap), 0);
+	rpmalloc_heap_release(heap);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+typedef struct shared_heap_thread_arg_t {
+	rpmalloc_heap_shared_t* shared;
+	unsigned int passes;
+	void** pointers;
+} shared_heap_thread_arg_t;
+
+static void*
+shared_heap_thread(void* argp) {
+	shared_heap_thread_arg_t* arg = argp;
+	unsigned int ipass;
+
+	rpmalloc_thread_initialize();
+
+	for (ipass = 0; ipass < arg->passes; ++ipass) {
+		arg->pointers[ipass] = rpmalloc_heap_shared_alloc(arg->shared, 32 + (ipass % 512));
+		EXPECT_NE(arg->pointers[ipass], 0);
+		memset(arg->pointers[ipass], (int)(ipass & 0xFF), 32 + (ipass % 512));
+	}
+
+	rpmalloc_thread_finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, heap_shared) {
+	thread_t thread[2];
+	shared_heap_thread_arg_t thread_arg[2];
+	void* pointers[2][1024];
+	unsigned int ithread, ipass;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	rpmalloc_heap_shared_t* shared = rpmalloc_heap_shared_acquire();
+	EXPECT_NE(shared, 0);
+
+	for (ithread = 0; ithread < 2; ++ithread) {
+		thread_arg[ithread].shared = shared;
+		thread_arg[ithread].passes = 1024;
+		thread_arg[ithread].pointers = pointers[ithread];
+		thread_initialize(&thread[ithread], shared_heap_thread, &thread_arg[ithread], STRING_CONST("sharedheap"),
+		                  THREAD_PRIORITY_NORMAL, 0);
+		thread_start(&thread[ithread]);
+	}
+
+	test_wait_for_threads_startup(thread, 2);
+	test_wait_for_threads_finish(thread, 2);
+
+	for (ithread = 0; ithread < 2; ++ithread) {
+		EXPECT_EQ(thread_join(&thread[ithread]), 0);
+		thread_finalize(&thread[ithread]);
+	}
+
+	// Each thread allocated from its own sub heap
+	rpmalloc_heap_t* heap = rpmalloc_heap_shared_thread_heap(shared);
+	EXPECT_NE(heap, 0);
+	EXPECT_NE(rpmalloc_get_heap_for_ptr(pointers[0][0]), rpmalloc_get_heap_for_ptr(pointers[1][0]));
+	EXPECT_NE(rpmalloc_get_heap_for_ptr(pointers[0][0]), heap);
+	EXPECT_NE(rpmalloc_get_heap_for_ptr(pointers[1][0]), heap);
+
+	// Blocks can be reallocated and freed from any thread
+	for (ipass = 0; ipass < 1024; ++ipass) {
+		EXPECT_EQ(((const unsigned char*)pointers[0][ipass])[31], ipass & 0xFF);
+		EXPECT_EQ(((const unsigned char*)pointers[1][ipass])[31], ipass & 0xFF);
+		rpmalloc_heap_shared_free(shared, pointers[0][ipass]);
+		pointers[1][ipass] = rpmalloc_heap_shared_realloc(shared, pointers[1][ipass], 1000, 0);
+		EXPECT_NE(pointers[1][ipass], 0);
+		EXPECT_EQ(((const unsigned char*)pointers[1][ipass])[31], ipass & 0xFF);
+	}
+	for (ipass = 0; ipass < 1024; ++ipass)
+		rpmalloc_heap_shared_free(shared, pointers[1][ipass]);
+
+	// Reset keeps the spans in the shared pool, free all unmaps them
+	rpmalloc_heap_shared_reset(shared, 64 * 1024 * 1024);
+	void* block = rpmalloc_heap_shared_calloc(shared, 16, 16);
+	EXPECT_NE(block, 0);
+	EXPECT_EQ(((const unsigned char*)block)[255], 0);
+	rpmalloc_heap_shared_free_all(shared);
+	EXPECT_EQ(rpmalloc_heap_usage(heap), 0);
+
+	rpmalloc_heap_shared_release(shared);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+#if FOUNDATION_PLATFORM_POSIX && (FOUNDATION_SIZE_POINTER == 8)
+
+DECLARE_TEST(alloc, heap_persistent) {
+	char buffer[BUILD_MAX_PATHLEN];
+	void* base = (void*)(uintptr_t)0x300000000000ULL;
+	// Header span and one span each for small and medium pages
+	size_t size = 3 * 256 * 1024 * 1024ULL;
+	unsigned int ipass;
+	int status = -1;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	string_const_t temp_path = environment_temporary_directory();
+	string_t path =
+	    path_concat(buffer, sizeof(buffer), STRING_ARGS(temp_path), STRING_CONST("test_alloc_persistent.heap"));
+	fs_remove_file(STRING_ARGS(path));
+
+	rpmalloc_heap_t* heap = rpmalloc_heap_persistent_acquire(path.str, base, size, &status);
+	EXPECT_NE(heap, 0);
+	EXPECT_EQ(status, RPMALLOC_PERSISTENT_CREATED);
+	EXPECT_EQ(rpmalloc_heap_persistent_root(heap), 0);
+
+	unsigned int* root = rpmalloc_heap_alloc(heap, 1024 * sizeof(unsigned int));
+	EXPECT_NE(root, 0);
+	for (ipass = 0; ipass < 1024; ++ipass)
+		root[ipass] = ipass * 7;
+	void* block = rpmalloc_heap_alloc(heap, 100000);
+	EXPECT_NE(block, 0);
+	memset(block, 0x5A, 100000);
+	rpmalloc_heap_persistent_set_root(heap, root);
+	EXPECT_EQ(rpmalloc_heap_persistent_checkpoint(heap), 0);
+	EXPECT_EQ(rpmalloc_heap_persistent_detach(heap), 0);
+
+	// Reattaching after detach maps the heap at the same address with the blocks intact
+	heap = rpmalloc_heap_persistent_acquire(path.str, base, size, &status);
+	EXPECT_NE(heap, 0);
+	EXPECT_EQ(status, RPMALLOC_PERSISTENT_ATTACHED);
+	EXPECT_EQ(rpmalloc_heap_persistent_root(heap), root);
+	for (ipass = 0; ipass < 1024; ++ipass)
+		EXPECT_EQ(root[ipass], ipass * 7);
+	EXPECT_EQ(((const unsigned char*)block)[99999], 0x5A);
+	EXPECT_EQ(rpmalloc_get_heap_for_ptr(block), heap);
+
+	// Blocks allocated by the previous process can be freed and reused
+	rpmalloc_heap_free(heap, block);
+	void* other = rpmalloc_heap_alloc(heap, 100000);
+	EXPECT_NE(other, 0);
+	EXPECT_EQ(rpmalloc_get_heap_for_ptr(other), heap);
+	rpmalloc_heap_free(heap, other);
+	rpmalloc_heap_free(heap, root);
+	rpmalloc_heap_persistent_set_root(heap, 0);
+	EXPECT_EQ(rpmalloc_heap_persistent_detach(heap), 0);
+	EXPECT_NE(rpmalloc_heap_persistent_detach(heap), 0);
+
+	fs_remove_file(STRING_ARGS(path));
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+DECLARE_TEST(alloc, heap_ipc_fork) {
+	void* base = (void*)(uintptr_t)0x340000000000ULL;
+	// Header span and one small page span for each process
+	size_t size = 3 * 256 * 1024 * 1024ULL;
+	int status = -1;
+
+	memory_system_t memsys = memory_system();
+	memsys.initialize();
+	memsys.thread_initialize();
+
+	rpmalloc_heap_ipc_t* ipc = rpmalloc_heap_ipc_create(0, base, size);
+	EXPECT_NE(ipc, 0);
+	rpmalloc_heap_t* heap = rpmalloc_heap_ipc_acquire(ipc);
+	EXPECT_NE(heap, 0);
+
+	void** mailbox = rpmalloc_heap_calloc(heap, 1, sizeof(void*));
+	EXPECT_NE(mailbox, 0);
+	unsigned char* block = rpmalloc_heap_alloc(heap, 1000);
+	EXPECT_NE(block, 0);
+	memset(block, 0x11, 1000);
+
+	pid_t child = fork();
+	EXPECT_GE(child, 0);
+	if (!child) {
+		// The child process acquires its own heap, reads and frees the block of the parent and passes a block
+		// back through memory in the region
+		rpmalloc_heap_t* child_heap = rpmalloc_heap_ipc_acquire(ipc);
+		if (!child_heap || (child_heap == heap))
+			_exit(1);
+		if (block[999] != 0x11)
+			_exit(2);
+		rpfree(block);
+		unsigned char* child_block = rpmalloc_heap_alloc(child_heap, 256);
+		if (!child_block || (rpmalloc_get_heap_for_ptr(child_block) != child_heap))
+			_exit(3);
+		memset(child_block, 0x22, 256);
+		*mailbox = child_block;
+		_exit(0);
+	}
+
+	EXPECT_EQ(waitpid(child, &status, 0), child);
+	EXPECT_TRUE(WIFEXITED(status));
+	EXPECT_EQ(WEXITSTATUS(status), 0);
+
+	unsigned char* child_block = *mailbox;
+	EXPECT_NE(child_block, 0);
+	EXPECT_NE(rpmalloc_get_heap_for_ptr(child_block), heap);
+	EXPECT_EQ(child_block[0], 0x22);
+	EXPECT_EQ(child_block[255], 0x22);
+	rpfree(child_block);
+
+	// The block freed by the child is deferred to the heap of the parent and can be reused
+	rpmalloc_heap_free(heap, mailbox);
+	block = rpmalloc_heap_alloc(heap, 1000);
+	EXPECT_NE(block, 0);
+	rpmalloc_heap_free(heap, block);
+
+	rpmalloc_heap_ipc_release(heap);
+	rpmalloc_heap_ipc_detach(ipc);
+
+	memsys.thread_finalize();
+	memsys.finalize();
+
+	return 0;
+}
+
+#endif
+
+#endif
+
 static void
 test_alloc_declare(void) {
+#if RPMALLOC_FIRST_CLASS_HEAPS && FOUNDATION_PLATFORM_POSIX && (FOUNDATION_SIZE_POINTER == 8)
+	// Fork is charged for all private memory mapped by the process, run it before other tests map spans
+	ADD_TEST(alloc, heap_ipc_fork);
+#endif
 	ADD_TEST(alloc, alloc);
 	ADD_TEST(alloc, threaded);
 	ADD_TEST(alloc, crossthread);
 	ADD_TEST(alloc, threadspam);
+	ADD_TEST(alloc, context);
+	ADD_TEST(alloc, zero_realloc);
+	ADD_TEST(alloc, context_statistics);
+	ADD_TEST(alloc, profiled);
+	ADD_TEST(alloc, owns);
+	ADD_TEST(alloc, statistics_buffer);
+	ADD_TEST(alloc, lifetime);
+	ADD_TEST(alloc, rounding);
+	ADD_TEST(alloc, sampling_hooks);
+#if RPMALLOC_FIRST_CLASS_HEAPS
+	ADD_TEST(alloc, heap_mark);
+	ADD_TEST(alloc, heap_shared);
+	ADD_TEST(alloc, heap_interface);
+	ADD_TEST(alloc, heap_pinned);
+	ADD_TEST(alloc, heap_warmup);
+	ADD_TEST(alloc, instance);
+	ADD_TEST(alloc, heap_sampled);
+	ADD_TEST(alloc, heap_sampling_hooks);
+	ADD_TEST(alloc, heap_limit);
+#if FOUNDATION_PLATFORM_POSIX && (FOUNDATION_SIZE_POINTER == 8)
+	ADD_TEST(alloc, heap_persistent);
+#endif
+#endif
 }
 
 static test_suite_t test_alloc_suite = {test_alloc_application,
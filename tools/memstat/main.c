@@ -0,0 +1,143 @@
+/* main.c  -  Memory statistics monitor  -  Public Domain  -  2013 Mattias Jansson
+ *
+ * This library provides a cross-platform memory allocation library in C11 providing basic support data types and
+ * functions to write applications and games in a platform-independent fashion. The latest source code is
+ * always available at
+ *
+ * https://github.com/mjansson/memory_lib
+ *
+ * This library is built on top of the foundation library available at
+ *
+ * https://github.com/mjansson/foundation_lib
+ *
+ * This library is put in the public domain; you can redistribute it and/or modify it without any restrictions.
+ *
+ */
+
+#include <foundation/foundation.h>
+
+#include <memory/memory.h>
+#include <memory/rpmalloc.h>
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+//! Print usage of the tool
+static void
+memstat_print_usage(void) {
+	printf("Usage: memory-stat <segment name> [interval ms] [count]\n"
+	       "  Attach to the statistics export segment published by rpmalloc_statistics_export_start in another\n"
+	       "  process and print a time series of the counters. Count zero runs until the segment is removed.\n");
+}
+
+static double
+memstat_mib(unsigned long long bytes) {
+	return (double)bytes / (1024.0 * 1024.0);
+}
+
+int
+main_initialize(void) {
+	foundation_config_t config;
+	application_t application;
+
+	memset(&config, 0, sizeof(config));
+
+	memset(&application, 0, sizeof(application));
+	application.name = string_const(STRING_CONST("Memory statistics monitor"));
+	application.short_name = string_const(STRING_CONST("memory_stat"));
+	application.company = string_const(STRING_CONST(""));
+	application.version = foundation_version();
+	application.flags = APPLICATION_UTILITY;
+
+	log_set_suppress(0, ERRORLEVEL_INFO);
+
+	return foundation_initialize(memory_system_malloc(), application, config);
+}
+
+int
+main_run(void* main_arg) {
+	const string_const_t* cmdline = environment_command_line();
+	size_t argc = array_size(cmdline);
+	rpmalloc_statistics_export_t snapshot;
+	rpmalloc_statistics_export_t previous;
+	FOUNDATION_UNUSED(main_arg);
+
+	if (argc < 2) {
+		memstat_print_usage();
+		return -1;
+	}
+	char name[256];
+	string_copy(name, sizeof(name), STRING_ARGS(cmdline[1]));
+	unsigned int interval = (argc > 2) ? string_to_uint(STRING_ARGS(cmdline[2]), false) : 0;
+	unsigned int count = (argc > 3) ? string_to_uint(STRING_ARGS(cmdline[3]), false) : 0;
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		printf("Unable to open statistics segment: %s\n", name);
+		return -1;
+	}
+	void* address = mmap(0, sizeof(rpmalloc_statistics_export_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED) {
+		printf("Unable to map statistics segment: %s\n", name);
+		return -1;
+	}
+	const rpmalloc_statistics_export_t* segment = address;
+	if (rpmalloc_statistics_export_read(segment, &snapshot)) {
+		printf("Invalid statistics segment: %s\n", name);
+		munmap(address, sizeof(rpmalloc_statistics_export_t));
+		return -1;
+	}
+	if (!interval)
+		interval = (unsigned int)snapshot.interval;
+
+	printf("Process %llu, update interval %llu ms\n", snapshot.pid, snapshot.interval);
+	printf("%8s %8s %8s %8s %12s %10s %10s %10s %10s", "Time ms", "Heaps", "Active", "Spans", "Mapped MiB",
+	       "Map", "Unmap", "Commit", "Decommit");
+	if (snapshot.statistics_enabled)
+		printf(" %12s %12s", "OS MiB", "OS peak MiB");
+	printf("\n");
+
+	int result = 0;
+	unsigned long long start = snapshot.timestamp;
+	previous = snapshot;
+	for (unsigned int iupdate = 0; !count || (iupdate < count); ++iupdate) {
+		if (iupdate) {
+			thread_sleep(interval);
+			if (rpmalloc_statistics_export_read(segment, &snapshot)) {
+				printf("Statistics segment no longer valid\n");
+				result = -1;
+				break;
+			}
+			if (snapshot.update_count == previous.update_count) {
+				// Segment remains mapped here when unlinked, stop when the exporting process is gone
+				if (kill((pid_t)snapshot.pid, 0) != 0) {
+					printf("Process %llu exited\n", snapshot.pid);
+					break;
+				}
+			}
+		}
+		printf("%8llu %8llu %8llu %8llu %12.2f %10llu %10llu %10llu %10llu",
+		       (snapshot.timestamp - start) / 1000000ULL, snapshot.heaps, snapshot.heaps_active, snapshot.spans,
+		       memstat_mib(snapshot.mapped), snapshot.map_calls - previous.map_calls,
+		       snapshot.unmap_calls - previous.unmap_calls, snapshot.commit_calls - previous.commit_calls,
+		       snapshot.decommit_calls - previous.decommit_calls);
+		if (snapshot.statistics_enabled)
+			printf(" %12.2f %12.2f", memstat_mib(snapshot.os_pages_mapped * snapshot.page_size),
+			       memstat_mib(snapshot.os_pages_mapped_peak * snapshot.page_size));
+		printf("\n");
+		fflush(stdout);
+		previous = snapshot;
+	}
+
+	munmap(address, sizeof(rpmalloc_statistics_export_t));
+	return result;
+}
+
+void
+main_finalize(void) {
+	foundation_finalize();
+}